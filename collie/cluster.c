@@ -21,18 +21,35 @@ struct cluster_cmd_data {
 	int list;
 	int copies;
 	int nohalt;
+	int chain;
 	int force;
+	int throttle_mask;
+	struct sd_recovery_throttle throttle;
 	char name[STORE_LEN];
+	char placement[PLACEMENT_LEN];
 } cluster_cmd_data;
 
 #define DEFAULT_STORE	"simple"
 
+/* the limits set with cluster throttle */
+#define THROTTLE_BANDWIDTH	0x01
+#define THROTTLE_OBJECTS	0x02
+#define THROTTLE_LATENCY	0x04
+#define THROTTLE_QUEUE_DEPTH	0x08
+#define DEFAULT_PLACEMENT	"ring"
+
 static void set_nohalt(uint16_t *p)
 {
 	if (p)
 		*p |= SD_FLAG_NOHALT;
 }
 
+static void set_chain_write(uint16_t *p)
+{
+	if (p)
+		*p |= SD_FLAG_CHAIN_WRITE;
+}
+
 static int list_store(void)
 {
 	int fd, ret;
@@ -79,7 +96,8 @@ static int cluster_format(int argc, char **argv)
 	struct sd_so_rsp *rsp = (struct sd_so_rsp *)&hdr;
 	unsigned rlen, wlen;
 	struct timeval tv;
-	char store_name[STORE_LEN];
+	char buf[STORE_LEN + PLACEMENT_LEN] = { 0 };
+	char *store_name = buf, *placement = buf + STORE_LEN;
 
 	fd = connect_to(sdhost, sdport);
 	if (fd < 0)
@@ -93,6 +111,8 @@ static int cluster_format(int argc, char **argv)
 	hdr.copies = cluster_cmd_data.copies;
 	if (cluster_cmd_data.nohalt)
 		set_nohalt(&hdr.flags);
+	if (cluster_cmd_data.chain)
+		set_chain_write(&hdr.flags);
 	hdr.epoch = node_list_version;
 	hdr.ctime = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
 
@@ -100,11 +120,16 @@ static int cluster_format(int argc, char **argv)
 		strncpy(store_name, cluster_cmd_data.name, STORE_LEN);
 	else
 		strcpy(store_name, DEFAULT_STORE);
-	hdr.data_length = wlen = strlen(store_name) + 1;
+	if (strlen(cluster_cmd_data.placement))
+		strncpy(placement, cluster_cmd_data.placement, PLACEMENT_LEN);
+	else
+		strcpy(placement, DEFAULT_PLACEMENT);
+	hdr.data_length = wlen = sizeof(buf);
 	hdr.flags |= SD_FLAG_CMD_WRITE;
 
-	printf("using backend %s store\n", store_name);
-	ret = exec_req(fd, (struct sd_req *)&hdr, store_name, &wlen, &rlen);
+	printf("using backend %s store with %s placement\n", store_name,
+	       placement);
+	ret = exec_req(fd, (struct sd_req *)&hdr, buf, &wlen, &rlen);
 	close(fd);
 
 	if (ret) {
@@ -115,7 +140,9 @@ static int cluster_format(int argc, char **argv)
 	if (rsp->result != SD_RES_SUCCESS) {
 		fprintf(stderr, "Format failed: %s\n",
 				sd_strerror(rsp->result));
-		return list_store();
+		if (rsp->result == SD_RES_NO_STORE)
+			return list_store();
+		return EXIT_FAILURE;
 	}
 
 	return EXIT_SUCCESS;
@@ -401,6 +428,147 @@ static int cluster_cleanup(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int get_recovery_stat(struct sd_recovery_stat *stat)
+{
+	int fd, ret;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	unsigned rlen, wlen;
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_SYSFAIL;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	hdr.opcode = SD_OP_STAT_RECOVERY;
+	hdr.data_length = sizeof(*stat);
+
+	rlen = sizeof(*stat);
+	wlen = 0;
+	ret = exec_req(fd, &hdr, stat, &wlen, &rlen);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		return EXIT_SYSFAIL;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to get the recovery status: %s\n",
+				sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int set_recovery_throttle(struct sd_recovery_throttle *throttle)
+{
+	int fd, ret;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	unsigned rlen, wlen;
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_SYSFAIL;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	hdr.opcode = SD_OP_RECOVERY_THROTTLE;
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(*throttle);
+
+	rlen = 0;
+	wlen = sizeof(*throttle);
+	ret = exec_req(fd, &hdr, throttle, &wlen, &rlen);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		return EXIT_SYSFAIL;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Throttle failed: %s\n",
+				sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static void print_limit(const char *name, uint64_t limit, const char *unit)
+{
+	if (limit)
+		printf("%-24s%" PRIu64 " %s\n", name, limit, unit);
+	else
+		printf("%-24soff\n", name);
+}
+
+/*
+ * Set the limits given as options on all the nodes, keeping the others,
+ * and show the limits and the recovery status of the node.
+ */
+static int cluster_throttle(int argc, char **argv)
+{
+	int ret, mask = cluster_cmd_data.throttle_mask;
+	struct sd_recovery_stat stat;
+	struct sd_recovery_throttle *t = &stat.throttle;
+	char str[64];
+
+	ret = get_recovery_stat(&stat);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	if (mask) {
+		if (mask & THROTTLE_BANDWIDTH)
+			t->bytes_per_sec = cluster_cmd_data.throttle.bytes_per_sec;
+		if (mask & THROTTLE_OBJECTS)
+			t->objs_per_sec = cluster_cmd_data.throttle.objs_per_sec;
+		if (mask & THROTTLE_LATENCY)
+			t->max_latency = cluster_cmd_data.throttle.max_latency;
+		if (mask & THROTTLE_QUEUE_DEPTH)
+			t->max_queue_depth =
+				cluster_cmd_data.throttle.max_queue_depth;
+
+		ret = set_recovery_throttle(t);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+
+	if (raw_output) {
+		printf("%" PRIu64 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32
+		       " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu64 " %" PRIu64
+		       "\n", t->bytes_per_sec, t->objs_per_sec, t->max_latency,
+		       t->max_queue_depth, stat.epoch, stat.nr_done,
+		       stat.nr_objs, stat.window, stat.latency,
+		       stat.nr_throttled);
+		return EXIT_SUCCESS;
+	}
+
+	if (t->bytes_per_sec)
+		printf("%-24s%s/s\n", "Bandwidth:",
+		       size_to_str(t->bytes_per_sec, str, sizeof(str)));
+	else
+		printf("%-24soff\n", "Bandwidth:");
+	print_limit("Objects:", t->objs_per_sec, "objects/s");
+	print_limit("Latency threshold:", t->max_latency, "ms");
+	print_limit("Queue depth threshold:", t->max_queue_depth, "requests");
+
+	if (stat.epoch)
+		printf("\nRecovering epoch %" PRIu32 ": %" PRIu32 " of %" PRIu32
+		       " objects done, %" PRIu32 " in flight allowed\n",
+		       stat.epoch, stat.nr_done, stat.nr_objs, stat.window);
+	else
+		printf("\nNot recovering\n");
+	printf("Foreground latency: %" PRIu64 " us, recovery throttled %"
+	       PRIu64 " times\n", stat.latency, stat.nr_throttled);
+
+	return EXIT_SUCCESS;
+}
+
 #define RECOVER_PRINT \
 "Caution! Please try starting all the cluster nodes normally before\n\
 running this command.\n\n\
@@ -461,7 +629,7 @@ static int cluster_recover(int argc, char **argv)
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprh", "show cluster information",
 	 0, cluster_info},
-	{"format", NULL, "bcHaph", "create a Sheepdog store",
+	{"format", NULL, "bmcHCaph", "create a Sheepdog store",
 	 0, cluster_format},
 	{"shutdown", NULL, "aph", "stop Sheepdog",
 	 SUBCMD_FLAG_NEED_NODELIST, cluster_shutdown},
@@ -471,18 +639,42 @@ static struct subcommand cluster_cmd[] = {
 	0, cluster_snapshot},
 	{"cleanup", NULL, "aph", "cleanup the useless snapshot data from recovery",
 	0, cluster_cleanup},
+	{"throttle", NULL, "BOLQaprh", "show or set the limits of the recovery",
+	0, cluster_throttle},
 	{NULL,},
 };
 
+static uint32_t parse_throttle_value(const char *opt, const char *name)
+{
+	char *p;
+	long val;
+
+	val = strtol(opt, &p, 10);
+	if (opt == p || *p || val < 0 || val > UINT32_MAX) {
+		fprintf(stderr, "Invalid %s: %s\n", name, opt);
+		exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
 static int cluster_parser(int ch, char *opt)
 {
 	int copies;
 	char *p;
+	uint64_t size;
 
 	switch (ch) {
 	case 'b':
 		strncpy(cluster_cmd_data.name, opt, 10);
 		break;
+	case 'm':
+		if (strlen(opt) >= PLACEMENT_LEN) {
+			fprintf(stderr, "Invalid placement: %s\n", opt);
+			exit(EXIT_FAILURE);
+		}
+		strcpy(cluster_cmd_data.placement, opt);
+		break;
 	case 'c':
 		copies = strtol(opt, &p, 10);
 		if (opt == p || copies < 1) {
@@ -498,6 +690,9 @@ static int cluster_parser(int ch, char *opt)
 	case 'H':
 		cluster_cmd_data.nohalt = 1;
 		break;
+	case 'C':
+		cluster_cmd_data.chain = 1;
+		break;
 	case 'f':
 		cluster_cmd_data.force = 1;
 		break;
@@ -515,6 +710,27 @@ static int cluster_parser(int ch, char *opt)
 	case 'l':
 		cluster_cmd_data.list = 1;
 		break;
+	case 'B':
+		if (parse_option_size(opt, &size) < 0)
+			exit(EXIT_FAILURE);
+		cluster_cmd_data.throttle.bytes_per_sec = size;
+		cluster_cmd_data.throttle_mask |= THROTTLE_BANDWIDTH;
+		break;
+	case 'O':
+		cluster_cmd_data.throttle.objs_per_sec =
+			parse_throttle_value(opt, "object rate");
+		cluster_cmd_data.throttle_mask |= THROTTLE_OBJECTS;
+		break;
+	case 'L':
+		cluster_cmd_data.throttle.max_latency =
+			parse_throttle_value(opt, "latency");
+		cluster_cmd_data.throttle_mask |= THROTTLE_LATENCY;
+		break;
+	case 'Q':
+		cluster_cmd_data.throttle.max_queue_depth =
+			parse_throttle_value(opt, "queue depth");
+		cluster_cmd_data.throttle_mask |= THROTTLE_QUEUE_DEPTH;
+		break;
 	}
 
 	return 0;
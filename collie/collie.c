@@ -41,12 +41,23 @@ static const struct sd_option collie_options[] = {
 
 	/* cluster options */
 	{'b', "store", 1, "specify backend store"},
+	{'m', "placement", 1, "specify the object placement algorithm\n\
+                          (ring, fast-ring or straw2, default: ring)"},
 	{'c', "copies", 1, "specify the data redundancy (number of copies)"},
 	{'H', "nohalt", 0, "serve IO requests even if there are too few\n\
                           nodes for the configured redundancy"},
+	{'C', "chain", 0, "replicate writes along a chain of the replicas\n\
+                          instead of sending them from the gateway"},
 	{'f', "force", 0, "do not prompt for confirmation"},
 	{'R', "restore", 1, "restore the cluster"},
 	{'l', "list", 0, "list the user epoch information"},
+	{'B', "bandwidth", 1, "limit the recovery to this many bytes per second\n\
+                          (k, M, G or T suffixes, 0 for no limit)"},
+	{'O', "objects", 1, "limit the recovery to this many objects per second"},
+	{'L', "latency", 1, "back off the recovery while the foreground\n\
+                          requests take longer (in milliseconds)"},
+	{'Q', "queue-depth", 1, "back off the recovery while more foreground\n\
+                          requests are in flight"},
 
 	{ 0, NULL, 0, NULL },
 };
@@ -61,6 +61,7 @@ extern unsigned master_idx;
 
 int is_current(struct sheepdog_inode *i);
 char *size_to_str(uint64_t _size, char *str, int str_size);
+int parse_option_size(const char *value, uint64_t *ret);
 typedef void (*vdi_parser_func_t)(uint32_t vid, char *name, char *tag,
 				  uint32_t snapid, uint32_t flags,
 				  struct sheepdog_inode *i, void *data);
@@ -69,6 +70,7 @@ int sd_read_object(uint64_t oid, void *data, unsigned int datalen,
 		   uint64_t offset);
 int sd_write_object(uint64_t oid, uint64_t cow_oid, void *data, unsigned int datalen,
 		    uint64_t offset, uint32_t flags, int copies, int create);
+int sd_read_objects(struct sd_obj_seg *segs, int nr_segs, void *data);
 
 extern struct command vdi_command;
 extern struct command node_command;
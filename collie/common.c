@@ -11,11 +11,44 @@
 
 #include "collie.h"
 
+/* how many VDI headers parse_vdi() reads in a request */
+#define VDI_HEADER_BATCH 64
+
 int is_current(struct sheepdog_inode *i)
 {
 	return !i->snap_ctime;
 }
 
+int parse_option_size(const char *value, uint64_t *ret)
+{
+	char *postfix;
+	double sizef;
+
+	sizef = strtod(value, &postfix);
+	switch (*postfix) {
+	case 'T':
+		sizef *= 1024;
+	case 'G':
+		sizef *= 1024;
+	case 'M':
+		sizef *= 1024;
+	case 'K':
+	case 'k':
+		sizef *= 1024;
+	case 'b':
+	case '\0':
+		*ret = (uint64_t) sizef;
+		break;
+	default:
+		fprintf(stderr, "Invalid size '%s'\n", value);
+		fprintf(stderr, "You may use k, M, G or T suffixes for "
+			"kilobytes, megabytes, gigabytes and terabytes.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 char *size_to_str(uint64_t _size, char *str, int str_size)
 {
 	const char *units[] = {"MB", "GB", "TB", "PB", "EB", "ZB", "YB"};
@@ -124,6 +157,115 @@ int sd_write_object(uint64_t oid, uint64_t cow_oid, void *data, unsigned int dat
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * Read the segments into data in one request.  The segments must not be
+ * more than SD_MAX_SEGS, nor their data more than SD_MAX_SEGS_DATA.  The
+ * result of each segment is left in it, and the first error is returned.
+ */
+int sd_read_objects(struct sd_obj_seg *segs, int nr_segs, void *data)
+{
+	struct sd_objs_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	unsigned segs_len = objs_data_offset(nr_segs), data_len = 0;
+	unsigned wlen, rlen;
+	char *buf;
+	int i, fd, ret;
+
+	for (i = 0; i < nr_segs; i++) {
+		segs[i].result = SD_RES_SUCCESS;
+		data_len += segs[i].length;
+	}
+
+	buf = zalloc(segs_len + data_len);
+	if (!buf) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		ret = SD_RES_NO_MEM;
+		goto out;
+	}
+	memcpy(buf, segs, sizeof(*segs) * nr_segs);
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to connect\n");
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.epoch = node_list_version;
+	hdr.opcode = SD_OP_READ_OBJS;
+	hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_WEAK_CONSISTENCY;
+	hdr.data_length = segs_len;
+	hdr.nr_segs = nr_segs;
+
+	wlen = segs_len;
+	rlen = segs_len + data_len;
+	ret = exec_req(fd, (struct sd_req *)&hdr, buf, &wlen, &rlen);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to read objects\n");
+		ret = SD_RES_EIO;
+		goto out;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to read objects: %s\n",
+			sd_strerror(rsp->result));
+		ret = rsp->result;
+		goto out;
+	}
+	if (rlen != segs_len + data_len) {
+		fprintf(stderr, "Failed to read objects, short response\n");
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	memcpy(segs, buf, sizeof(*segs) * nr_segs);
+	memcpy(data, buf + segs_len, data_len);
+
+	ret = SD_RES_SUCCESS;
+	for (i = 0; i < nr_segs; i++) {
+		if (segs[i].result == SD_RES_SUCCESS)
+			continue;
+
+		fprintf(stderr, "Failed to read object %" PRIx64 " %s\n",
+			segs[i].oid, sd_strerror(segs[i].result));
+		if (ret == SD_RES_SUCCESS)
+			ret = segs[i].result;
+	}
+out:
+	free(buf);
+	if (ret != SD_RES_SUCCESS)
+		for (i = 0; i < nr_segs; i++)
+			if (segs[i].result == SD_RES_SUCCESS)
+				segs[i].result = ret;
+
+	return ret;
+}
+
+/*
+ * Read the headers of the VDIs in use from the VDI nr, up to
+ * VDI_HEADER_BATCH of them.
+ */
+static void read_vdi_headers(unsigned long *vdi_inuse, unsigned long nr,
+			     struct sd_obj_seg *segs, char *headers,
+			     int *nr_segs)
+{
+	int n = 0;
+
+	memset(segs, 0, sizeof(*segs) * VDI_HEADER_BATCH);
+	for (; nr < SD_NR_VDIS && n < VDI_HEADER_BATCH; nr++) {
+		if (!test_bit(nr, vdi_inuse))
+			continue;
+
+		segs[n].oid = vid_to_vdi_oid(nr);
+		segs[n++].length = SD_INODE_HEADER_SIZE;
+	}
+	*nr_segs = n;
+
+	sd_read_objects(segs, n, headers);
+}
+
 int parse_vdi(vdi_parser_func_t func, size_t size, void *data)
 {
 	int ret, fd;
@@ -131,7 +273,10 @@ int parse_vdi(vdi_parser_func_t func, size_t size, void *data)
 	static struct sheepdog_inode i;
 	struct sd_req req;
 	static DECLARE_BITMAP(vdi_inuse, SD_NR_VDIS);
+	static struct sd_obj_seg segs[VDI_HEADER_BATCH];
+	static char headers[SD_INODE_HEADER_SIZE * VDI_HEADER_BATCH];
 	unsigned int rlen, wlen = 0;
+	int n = 0, nr_segs = 0;
 
 	fd = connect_to(sdhost, sdport);
 	if (fd < 0)
@@ -157,14 +302,23 @@ int parse_vdi(vdi_parser_func_t func, size_t size, void *data)
 		if (!test_bit(nr, vdi_inuse))
 			continue;
 
+		/* read the headers of the next VDIs together */
+		if (n == nr_segs) {
+			read_vdi_headers(vdi_inuse, nr, segs, headers,
+					 &nr_segs);
+			n = 0;
+		}
+
 		oid = vid_to_vdi_oid(nr);
 
 		memset(&i, 0, sizeof(i));
-		ret = sd_read_object(oid, &i, SD_INODE_HEADER_SIZE, 0);
-		if (ret != SD_RES_SUCCESS) {
+		if (segs[n].result != SD_RES_SUCCESS) {
+			n++;
 			fprintf(stderr, "Failed to read inode header\n");
 			continue;
 		}
+		memcpy(&i, headers + SD_INODE_HEADER_SIZE * n++,
+		       SD_INODE_HEADER_SIZE);
 
 		if (i.name[0] == '\0') /* this VDI has been deleted */
 			continue;
@@ -54,18 +54,17 @@ static int node_info(int argc, char **argv)
 {
 	int i, ret, success = 0;
 	uint64_t total_size = 0, total_avail = 0, total_vdi_size = 0;
+	uint64_t used = 0, total_vnodes = 0;
+	uint64_t store_size[SD_MAX_NODES], store_free[SD_MAX_NODES];
+	int stat_ok[SD_MAX_NODES];
 	char total_str[8], avail_str[8], vdi_size_str[8];
 
-	if (!raw_output)
-		printf("Id\tSize\tUsed\tUse%%\n");
-
 	for (i = 0; i < nr_nodes; i++) {
 		char name[128];
 		int fd;
 		unsigned wlen, rlen;
 		struct sd_node_req req;
 		struct sd_node_rsp *rsp = (struct sd_node_rsp *)&req;
-		char store_str[8], free_str[8];
 
 		addr_to_str(name, sizeof(name), node_list_entries[i].addr, 0);
 
@@ -83,13 +82,12 @@ static int node_info(int argc, char **argv)
 		ret = exec_req(fd, (struct sd_req *)&req, NULL, &wlen, &rlen);
 		close(fd);
 
-		size_to_str(rsp->store_size, store_str, sizeof(store_str));
-		size_to_str(rsp->store_size - rsp->store_free, free_str,
-			    sizeof(free_str));
-		if (!ret && rsp->result == SD_RES_SUCCESS) {
-			printf(raw_output ? "%d %s %s %d%%\n" : "%2d\t%s\t%s\t%3d%%\n",
-			       i, store_str, free_str,
-			       (int)(((double)(rsp->store_size - rsp->store_free) / rsp->store_size) * 100));
+		store_size[i] = rsp->store_size;
+		store_free[i] = rsp->store_free;
+		stat_ok[i] = !ret && rsp->result == SD_RES_SUCCESS;
+		if (stat_ok[i]) {
+			used += rsp->store_size - rsp->store_free;
+			total_vnodes += node_list_entries[i].nr_vnodes;
 			success++;
 		}
 
@@ -102,6 +100,33 @@ static int node_info(int argc, char **argv)
 		return EXIT_SYSFAIL;
 	}
 
+	/*
+	 * Objects are spread in proportion to the number of vnodes, so the
+	 * projected use of a node is its vnode share of the used space.
+	 */
+	if (!raw_output)
+		printf("Id\tSize\tUsed\tUse%%\tV-Nodes\tProj%%\n");
+	for (i = 0; i < nr_nodes; i++) {
+		char store_str[8], used_str[8];
+		double projected = 0;
+
+		if (!stat_ok[i])
+			continue;
+
+		if (total_vnodes && store_size[i])
+			projected = (double)used * node_list_entries[i].nr_vnodes /
+				total_vnodes / store_size[i];
+
+		size_to_str(store_size[i], store_str, sizeof(store_str));
+		size_to_str(store_size[i] - store_free[i], used_str,
+			    sizeof(used_str));
+		printf(raw_output ? "%d %s %s %d%% %d %d%%\n"
+				  : "%2d\t%s\t%s\t%3d%%\t%7d\t%4d%%\n",
+		       i, store_str, used_str,
+		       (int)(((double)(store_size[i] - store_free[i]) / store_size[i]) * 100),
+		       node_list_entries[i].nr_vnodes, (int)(projected * 100));
+	}
+
 	parse_vdi(cal_total_vdi_size, SD_INODE_HEADER_SIZE, &total_vdi_size);
 
 	size_to_str(total_size, total_str, sizeof(total_str));
@@ -116,11 +141,76 @@ static int node_info(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int node_stat(int argc, char **argv)
+{
+	int i, ret, success = 0;
+
+	if (!raw_output)
+		printf("Id\tReads\t\tHedged\t\tWon\t\tDelay(us)\t"
+		       "Writes\t\tCoalesced\tRatio\n");
+
+	for (i = 0; i < nr_nodes; i++) {
+		char name[128];
+		int fd;
+		unsigned wlen, rlen;
+		struct sd_req hdr;
+		struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+		struct sd_gateway_stat stat;
+		double ratio;
+
+		addr_to_str(name, sizeof(name), node_list_entries[i].addr, 0);
+
+		fd = connect_to(name, node_list_entries[i].port);
+		if (fd < 0)
+			return 1;
+
+		memset(&hdr, 0, sizeof(hdr));
+
+		hdr.opcode = SD_OP_STAT_GATEWAY;
+		hdr.epoch = node_list_version;
+		hdr.data_length = sizeof(stat);
+
+		wlen = 0;
+		rlen = sizeof(stat);
+		ret = exec_req(fd, &hdr, &stat, &wlen, &rlen);
+		close(fd);
+
+		if (!ret && rsp->result == SD_RES_SUCCESS) {
+			/* client writes per write done */
+			ratio = 1;
+			if (stat.nr_client_writes)
+				ratio = (double)stat.nr_client_writes /
+					(stat.nr_client_writes -
+					 stat.nr_coalesced_writes);
+
+			printf(raw_output ? "%d %" PRIu64 " %" PRIu64 " %" PRIu64
+			       " %" PRIu64 " %" PRIu64 " %" PRIu64 " %.2f\n" :
+			       "%2d\t%-15" PRIu64 "\t%-15" PRIu64 "\t%-15"
+			       PRIu64 "\t%-15" PRIu64 "\t%-15" PRIu64 "\t%-15"
+			       PRIu64 "\t%.2f\n",
+			       i, stat.nr_reads, stat.nr_hedges,
+			       stat.nr_hedge_wins, stat.hedge_delay,
+			       stat.nr_client_writes, stat.nr_coalesced_writes,
+			       ratio);
+			success++;
+		}
+	}
+
+	if (success == 0) {
+		fprintf(stderr, "Cannot get information from any nodes\n");
+		return EXIT_SYSFAIL;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static struct subcommand node_cmd[] = {
 	{"list", NULL, "aprh", "list nodes",
 	 SUBCMD_FLAG_NEED_NODELIST, node_list},
 	{"info", NULL, "aprh", "show information about each node",
 	 SUBCMD_FLAG_NEED_NODELIST, node_info},
+	{"stat", NULL, "aprh", "show gateway statistics of each node",
+	 SUBCMD_FLAG_NEED_NODELIST, node_stat},
 	{NULL,},
 };
 
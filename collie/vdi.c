@@ -32,36 +32,6 @@ struct get_vdi_info {
 	uint32_t snapid;
 };
 
-static int parse_option_size(const char *value, uint64_t *ret)
-{
-	char *postfix;
-	double sizef;
-
-	sizef = strtod(value, &postfix);
-	switch (*postfix) {
-	case 'T':
-		sizef *= 1024;
-	case 'G':
-		sizef *= 1024;
-	case 'M':
-		sizef *= 1024;
-	case 'K':
-	case 'k':
-		sizef *= 1024;
-	case 'b':
-	case '\0':
-		*ret = (uint64_t) sizef;
-		break;
-	default:
-		fprintf(stderr, "Invalid size '%s'\n", value);
-		fprintf(stderr, "You may use k, M, G or T suffixes for "
-			"kilobytes, megabytes, gigabytes and terabytes.\n");
-		return -1;
-	}
-
-	return 0;
-}
-
 static void print_vdi_list(uint32_t vid, char *name, char *tag, uint32_t snapid,
 			   uint32_t flags, struct sheepdog_inode *i, void *data)
 {
@@ -949,14 +919,18 @@ static int vdi_getattr(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+/* how many objects vdi_read() reads in a request */
+#define NR_READ_OBJS (SD_MAX_SEGS_DATA / SD_DATA_OBJ_SIZE)
+
 static int vdi_read(int argc, char **argv)
 {
 	char *vdiname = argv[optind++];
 	uint32_t vid;
-	int ret, idx;
+	int ret, idx, nr, n, holes[NR_READ_OBJS];
 	struct sheepdog_inode *inode = NULL;
-	uint64_t offset = 0, oid, done = 0, total = (uint64_t) -1;
-	unsigned int len, remain;
+	struct sd_obj_seg segs[NR_READ_OBJS];
+	uint64_t offset = 0, done = 0, total = (uint64_t) -1;
+	unsigned int len, remain, pos, data_len = 0, lens[NR_READ_OBJS];
 	char *buf = NULL;
 
 	if (argv[optind]) {
@@ -979,7 +953,7 @@ static int vdi_read(int argc, char **argv)
 	}
 
 	inode = malloc(sizeof(*inode));
-	buf = malloc(SD_DATA_OBJ_SIZE);
+	buf = malloc(SD_MAX_SEGS_DATA);
 	if (!inode || !buf) {
 		fprintf(stderr, "Failed to allocate memory\n");
 		ret = EXIT_SYSFAIL;
@@ -1011,22 +985,49 @@ static int vdi_read(int argc, char **argv)
 	idx = offset / SD_DATA_OBJ_SIZE;
 	offset %= SD_DATA_OBJ_SIZE;
 	while (done < total) {
-		len = min(total - done, SD_DATA_OBJ_SIZE - offset);
+		/* read the next objects together */
+		len = 0;
+		for (nr = 0, n = 0; nr < NR_READ_OBJS && done + len < total;
+		     nr++) {
+			lens[nr] = min(total - done - len,
+				       SD_DATA_OBJ_SIZE - offset);
+			holes[nr] = !inode->data_vdi_id[idx];
+			if (!holes[nr]) {
+				segs[n].oid = vid_to_data_oid(
+					inode->data_vdi_id[idx], idx);
+				segs[n].offset = offset;
+				segs[n++].length = lens[nr];
+				data_len += lens[nr];
+			}
+			len += lens[nr];
+			offset = 0;
+			idx++;
+		}
 
-		if (inode->data_vdi_id[idx]) {
-			oid = vid_to_data_oid(inode->data_vdi_id[idx], idx);
-			ret = sd_read_object(oid, buf, len, offset);
+		if (n) {
+			ret = sd_read_objects(segs, n, buf);
 			if (ret != SD_RES_SUCCESS) {
 				fprintf(stderr, "Failed to read VDI\n");
 				ret = EXIT_FAILURE;
 				goto out;
 			}
-		} else
-			memset(buf, 0, len);
+		}
+
+		/* the data is packed, so move it in place from the end */
+		pos = len;
+		while (nr--) {
+			pos -= lens[nr];
+			if (holes[nr])
+				memset(buf + pos, 0, lens[nr]);
+			else {
+				data_len -= lens[nr];
+				memmove(buf + pos, buf + data_len, lens[nr]);
+			}
+		}
 
 		remain = len;
 		while (remain) {
-			ret = write(STDOUT_FILENO, buf + (len - remain), len);
+			ret = write(STDOUT_FILENO, buf + (len - remain), remain);
 			if (ret < 0) {
 				fprintf(stderr, "Failed to write to stdout: %m\n");
 				ret = EXIT_SYSFAIL;
@@ -1035,8 +1036,6 @@ static int vdi_read(int argc, char **argv)
 			remain -= ret;
 		}
 
-		offset = 0;
-		idx++;
 		done += len;
 	}
 	fsync(STDOUT_FILENO);
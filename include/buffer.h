@@ -0,0 +1,20 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct buffer_stat {
+	uint64_t in_use;	/* bytes handed out */
+	uint64_t cached;	/* bytes kept in the pool for reuse */
+	uint64_t nr_allocs;
+	uint64_t nr_misses;	/* allocations the pool couldn't serve */
+};
+
+void init_buffer_pool(int use_hugepages);
+void *alloc_buffer(size_t size);
+void *zalloc_buffer(size_t size);
+void free_buffer(void *buf, size_t size);
+void get_buffer_stat(struct buffer_stat *stat);
+
+#endif
@@ -37,12 +37,18 @@ int conn_rx_on(struct connection *conn);
 int is_conn_dead(struct connection *conn);
 int do_read(int sockfd, void *buf, int len);
 int rx(struct connection *conn, enum conn_state next_state);
+int rx_splice(struct connection *conn, int pipe, enum conn_state next_state);
 int tx(struct connection *conn, enum conn_state next_state, int flags);
+int tx_sendfile(struct connection *conn, int fd, off_t *offset,
+		enum conn_state next_state);
+int tx_iov(struct connection *conn, struct iovec **iov, int *nr_iov,
+	   enum conn_state next_state, int flags);
 int connect_to(const char *name, int port);
 int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int *wlen);
 int exec_req(int sockfd, struct sd_req *hdr, void *data,
 	     unsigned int *wlen, unsigned int *rlen);
-int create_listen_ports(int port, int (*callback)(int fd, void *), void *data);
+int create_listen_ports(int port, int (*callback)(int fd, void *), void *data,
+			int reuseport);
 
 char *addr_to_str(char *str, int size, uint8_t *addr, uint16_t port);
 int set_nonblocking(int fd);
@@ -17,7 +17,7 @@
 #include "net.h"
 #include "logger.h"
 
-#define SD_SHEEP_PROTO_VER 0x04
+#define SD_SHEEP_PROTO_VER 0x05
 
 #define SD_DEFAULT_REDUNDANCY 3
 #define SD_MAX_REDUNDANCY 8
@@ -25,8 +25,18 @@
 #define SD_MAX_NODES 1024
 #define SD_DEFAULT_VNODES 64
 #define SD_MAX_VNODES 65536
+/*
+ * With '--vnodes auto', a node with this much store capacity gets
+ * SD_DEFAULT_VNODES vnodes like a node with a fixed count, and the others
+ * get proportionally more or fewer, within the bounds below.
+ */
+#define SD_AUTO_VNODES_CAPACITY (1ULL << 40)
+#define SD_MIN_AUTO_VNODES 16
+#define SD_MAX_AUTO_VNODES 1024
 #define SD_MAX_VMS   4096 /* FIXME: should be removed */
 
+#define PLACEMENT_LEN 16
+
 #define SD_OP_SHEEP          0x80
 #define SD_OP_DEL_VDI        0x81
 #define SD_OP_GET_NODE_LIST  0x82
@@ -43,9 +53,14 @@
 #define SD_OP_RESTORE        0x92
 #define SD_OP_GET_SNAP_FILE  0x93
 #define SD_OP_CLEANUP        0x94
+#define SD_OP_STAT_GATEWAY   0x95
+#define SD_OP_RECOVERY_THROTTLE 0x96
+#define SD_OP_STAT_RECOVERY  0x97
 
 #define SD_FLAG_CMD_IO_LOCAL   0x0010
 #define SD_FLAG_CMD_RECOVERY 0x0020
+/* a chain replicated write, which the replica forwards to the next one */
+#define SD_FLAG_CMD_CHAIN    0x0080
 
 /* set this flag when you want to read a VDI which is opened by
    another client.  Note that the obtained data may not be the latest
@@ -53,6 +68,18 @@
    concurrent accesses to non-snapshot VDIs. */
 #define SD_FLAG_CMD_WEAK_CONSISTENCY 0x0040
 
+/*
+ * a read of a whole data object whose data is a struct sd_extent_map and
+ * the data of the extents, so that the holes aren't sent
+ */
+#define SD_FLAG_CMD_SPARSE   0x0800
+
+/*
+ * a list of objects which only has the objects the node at dst_idx of
+ * dst_epoch holds
+ */
+#define SD_FLAG_CMD_FILTER   0x1000
+
 /* flags for VDI attribute operations */
 #define SD_FLAG_CMD_CREAT    0x0100
 #define SD_FLAG_CMD_EXCL     0x0200
@@ -65,6 +92,7 @@
 #define SD_RES_INVALID_EPOCH 0x45 /* Invalid epoch */
 
 #define SD_FLAG_NOHALT       0x0004 /* Serve the IO rquest even lack of nodes */
+#define SD_FLAG_CHAIN_WRITE  0x0008 /* Replicate writes along a chain of replicas */
 
 struct sd_so_req {
 	uint8_t		proto_ver;
@@ -102,7 +130,10 @@ struct sd_list_req {
 	uint32_t        id;
 	uint32_t        data_length;
 	uint32_t        tgt_epoch;
-	uint32_t        pad[7];
+	uint32_t        dst_idx;
+	uint64_t        cursor;		/* list the objects after this one */
+	uint32_t        dst_epoch;
+	uint32_t        pad[3];
 };
 
 struct sd_list_rsp {
@@ -113,7 +144,9 @@ struct sd_list_rsp {
 	uint32_t        id;
 	uint32_t        data_length;
 	uint32_t        result;
-	uint32_t        pad[7];
+	uint32_t        __pad;
+	uint64_t        cursor;		/* the last object looked at, or 0 */
+	uint32_t        pad[4];
 };
 
 struct sd_node_req {
@@ -142,6 +175,64 @@ struct sd_node_rsp {
 	uint64_t	store_free;
 };
 
+/* counters of the gateway read path, returned by SD_OP_STAT_GATEWAY */
+struct sd_gateway_stat {
+	uint64_t	nr_reads;	/* reads sent to remote replicas */
+	uint64_t	nr_hedges;	/* reads sent to a second replica */
+	uint64_t	nr_hedge_wins;	/* hedged reads answered first */
+	uint64_t	hedge_delay;	/* current hedge delay in usec */
+	uint64_t	nr_writes;	/* writes forwarded to remote replicas */
+	uint64_t	write_tx_bytes;	/* payload sent for them */
+	uint64_t	buf_in_use;	/* bytes of pooled buffers in use */
+	uint64_t	buf_cached;	/* bytes of pooled buffers kept free */
+	uint64_t	nr_client_writes;	/* writes from the clients */
+	uint64_t	nr_coalesced_writes;	/* of them, merged into others */
+};
+
+/*
+ * Limits of the recovery, set by SD_OP_RECOVERY_THROTTLE.  Zero means
+ * no limit.  When either of the foreground thresholds is set, the
+ * recovery backs off while the foreground requests go above it.
+ */
+struct sd_recovery_throttle {
+	uint64_t	bytes_per_sec;
+	uint32_t	objs_per_sec;
+	uint32_t	max_latency;	/* foreground latency in msec */
+	uint32_t	max_queue_depth;	/* foreground requests in flight */
+	uint32_t	__pad;
+};
+
+/* returned by SD_OP_STAT_RECOVERY */
+struct sd_recovery_stat {
+	struct sd_recovery_throttle throttle;
+	uint32_t	epoch;		/* the epoch being recovered, or 0 */
+	uint32_t	nr_done;
+	uint32_t	nr_objs;
+	uint32_t	window;		/* objects allowed in flight now */
+	uint64_t	latency;	/* recent foreground latency in usec */
+	uint64_t	nr_throttled;	/* times the recovery waited */
+};
+
+/*
+ * The head of the data of a read with SD_FLAG_CMD_SPARSE, one sector.
+ * The data of the extents follows it packed, and the rest of the object
+ * reads as zeros.
+ */
+#define SD_MAX_EXTENTS 63
+
+struct sd_extent {
+	uint32_t	offset;
+	uint32_t	length;
+};
+
+struct sd_extent_map {
+	uint32_t	nr_extents;
+	uint32_t	__pad;
+	struct sd_extent extents[SD_MAX_EXTENTS];
+};
+
+#define SD_SPARSE_OBJ_SIZE (sizeof(struct sd_extent_map) + SD_DATA_OBJ_SIZE)
+
 struct sd_node {
 	uint8_t         addr[16];
 	uint16_t        port;
@@ -155,6 +246,22 @@ struct sd_vnode {
 	uint16_t        port;
 	uint16_t	node_idx;
 	uint32_t	zone;
+
+	/*
+	 * The replica successor table: the vnode indexes which
+	 * get_nth_node() returns for this vnode as a base, filled in by
+	 * nodes_to_vnodes().
+	 */
+	uint16_t	replicas[SD_MAX_REDUNDANCY];
+	uint8_t		nr_replicas;
+
+	/*
+	 * The node table for node based placement: the i'th entry holds
+	 * the index of a vnode of the i'th node on the ring and the weight
+	 * of the node.  The weight is zero after the last node.
+	 */
+	uint16_t	node_vnode;
+	uint16_t	node_weight;
 };
 
 struct epoch_log {
@@ -180,7 +287,7 @@ static inline int same_zone(struct sd_vnode *e, int n1, int n2)
 }
 
 /* traverse the virtual node list and return the n'th one */
-static inline int get_nth_node(struct sd_vnode *entries,
+static inline int __get_nth_node(struct sd_vnode *entries,
 			       int nr_entries, int base, int n)
 {
 	int nodes[SD_MAX_REDUNDANCY];
@@ -206,18 +313,34 @@ next:
 	return idx;
 }
 
+/* return the n'th replica of the base vnode with the successor table */
+static inline int get_nth_node(struct sd_vnode *entries,
+			       int nr_entries, int base, int n)
+{
+	if (n < entries[base].nr_replicas)
+		return entries[base].replicas[n];
+
+	return __get_nth_node(entries, nr_entries, base, n);
+}
+
 static inline int hval_to_sheep(struct sd_vnode *entries,
 				int nr_entries, uint64_t id, int idx)
 {
-	int i;
-	struct sd_vnode *e = entries, *n;
-
-	for (i = 0; i < nr_entries - 1; i++, e++) {
-		n = e + 1;
-		if (id > e->id && id <= n->id)
-			break;
+	int lo = 0, hi = nr_entries, mid;
+
+	/*
+	 * Entries are sorted by id, so the owner of 'id' is the first vnode
+	 * whose id is not smaller than 'id'.  If there is no such vnode, we
+	 * wrap around to the first entry of the ring.
+	 */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (entries[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return get_nth_node(entries, nr_entries, (i + 1) % nr_entries, idx);
+	return get_nth_node(entries, nr_entries, lo % nr_entries, idx);
 }
 
 static inline int obj_to_sheep(struct sd_vnode *entries,
@@ -315,6 +438,78 @@ static inline int vnode_cmp(const void *a, const void *b)
 	return 0;
 }
 
+static inline int conflict_vnodes(struct sd_vnode *e, int n1, int n2)
+{
+	return same_node(e, n1, n2) || same_zone(e, n1, n2);
+}
+
+/*
+ * Build the replica successor table of each vnode.
+ *
+ * Conflicting vnodes (the same node or the same zone) form equivalence
+ * classes, so the replicas of vnode i are i itself followed by the
+ * replicas of vnode i + 1 which don't conflict with i.  We walk the ring
+ * only for the last vnode and derive the others backwards from it.
+ */
+static inline void build_replica_table(struct sd_vnode *entries,
+				       int nr_entries)
+{
+	struct sd_vnode *e, *next, *last = entries + nr_entries - 1;
+	int i, j, idx;
+
+	if (nr_entries == 0)
+		return;
+
+	last->nr_replicas = 0;
+	for (i = 0; i < nr_entries; i++) {
+		idx = (nr_entries - 1 + i) % nr_entries;
+		for (j = 0; j < last->nr_replicas; j++)
+			if (conflict_vnodes(entries, idx, last->replicas[j]))
+				break;
+		if (j < last->nr_replicas)
+			continue;
+
+		last->replicas[last->nr_replicas++] = idx;
+		if (last->nr_replicas == SD_MAX_REDUNDANCY)
+			break;
+	}
+
+	for (i = nr_entries - 2; i >= 0; i--) {
+		e = entries + i;
+		next = e + 1;
+
+		e->replicas[0] = i;
+		e->nr_replicas = 1;
+		for (j = 0; j < next->nr_replicas; j++) {
+			if (e->nr_replicas == last->nr_replicas)
+				break;
+			idx = next->replicas[j];
+			if (!conflict_vnodes(entries, i, idx))
+				e->replicas[e->nr_replicas++] = idx;
+		}
+	}
+}
+
+static inline void build_node_table(struct sd_node *nodes,
+				    struct sd_vnode *entries, int nr_entries)
+{
+	int i, nr = 0;
+	uint8_t seen[SD_MAX_NODES] = { 0 };
+
+	for (i = 0; i < nr_entries; i++) {
+		if (seen[entries[i].node_idx])
+			continue;
+		seen[entries[i].node_idx] = 1;
+
+		entries[nr].node_vnode = i;
+		entries[nr].node_weight = nodes[entries[i].node_idx].nr_vnodes;
+		nr++;
+	}
+
+	for (i = nr; i < nr_entries; i++)
+		entries[i].node_weight = 0;
+}
+
 static inline int nodes_to_vnodes(struct sd_node *nodes, int nr,
 				  struct sd_vnode *vnodes)
 {
@@ -344,8 +539,11 @@ static inline int nodes_to_vnodes(struct sd_node *nodes, int nr,
 		n++;
 	}
 
-	if (vnodes)
+	if (vnodes) {
 		qsort(vnodes, nr_vnodes, sizeof(*vnodes), vnode_cmp);
+		build_replica_table(vnodes, nr_vnodes);
+		build_node_table(nodes, vnodes, nr_vnodes);
+	}
 
 	return nr_vnodes;
 }
@@ -23,6 +23,10 @@
 #define SD_OP_READ_OBJ       0x02
 #define SD_OP_WRITE_OBJ      0x03
 #define SD_OP_REMOVE_OBJ     0x04
+#define SD_OP_READ_OBJS      0x05
+#define SD_OP_WRITE_OBJS     0x06
+#define SD_OP_REMOVE_OBJS    0x07
+#define SD_OP_DISCARD_OBJ    0x08
 
 #define SD_OP_NEW_VDI        0x11
 #define SD_OP_LOCK_VDI       0x12
@@ -99,6 +103,10 @@
 
 #define STORE_LEN 16
 
+/* limits of a request on a list of object segments */
+#define SD_MAX_SEGS 1024
+#define SD_MAX_SEGS_DATA (SD_DATA_OBJ_SIZE * 4)
+
 struct sd_req {
 	uint8_t		proto_ver;
 	uint8_t		opcode;
@@ -134,6 +142,26 @@ struct sd_obj_req {
 	uint64_t        offset;
 };
 
+/*
+ * SD_OP_DISCARD_OBJ drops the data of a range of a data object, which
+ * reads as zeros afterwards.  A discard of the whole object removes it
+ * and clears its entry in the inode, so the client is expected to clear
+ * the entry in its copy of the inode too.  There is no data.
+ */
+struct sd_discard_req {
+	uint8_t		proto_ver;
+	uint8_t		opcode;
+	uint16_t	flags;
+	uint32_t	epoch;
+	uint32_t        id;
+	uint32_t        data_length;
+	uint64_t        oid;
+	uint64_t        cow_oid;
+	uint32_t        copies;
+	uint32_t        length;
+	uint64_t        offset;
+};
+
 struct sd_obj_rsp {
 	uint8_t		proto_ver;
 	uint8_t		opcode;
@@ -146,6 +174,40 @@ struct sd_obj_rsp {
 	uint32_t        pad[6];
 };
 
+/*
+ * SD_OP_READ_OBJS, SD_OP_WRITE_OBJS and SD_OP_REMOVE_OBJS work on a list
+ * of object segments.  The request data is the nr_segs segments, followed
+ * by the data of the segments in order for writes, and is sent with
+ * SD_FLAG_CMD_WRITE.  The response data is the segments with their
+ * results, followed by the data of the segments in order for reads.  The
+ * data starts at objs_data_offset(), so that it can be read and written
+ * with O_DIRECT in place.
+ */
+struct sd_objs_req {
+	uint8_t		proto_ver;
+	uint8_t		opcode;
+	uint16_t	flags;
+	uint32_t	epoch;
+	uint32_t        id;
+	uint32_t        data_length;
+	uint32_t	nr_segs;
+	uint32_t	copies;
+	uint32_t	pad[6];
+};
+
+struct sd_obj_seg {
+	uint64_t	oid;
+	uint64_t	offset;
+	uint32_t	length;
+	uint32_t	result;
+};
+
+static inline uint32_t objs_data_offset(uint32_t nr_segs)
+{
+	return (sizeof(struct sd_obj_seg) * nr_segs + SECTOR_SIZE - 1) &
+		~(SECTOR_SIZE - 1);
+}
+
 struct sd_vdi_req {
 	uint8_t		proto_ver;
 	uint8_t		opcode;
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Buffer pool
+ *
+ * Request and object buffers are rounded up to a power of two between a
+ * sector and SD_DATA_OBJ_SIZE, and freed buffers are kept for reuse
+ * instead of being returned to malloc.  Every thread keeps a few buffers
+ * of each size class for itself, and hands the rest over to a pool
+ * shared by all the threads.  The caller passes the size of the buffer
+ * to free_buffer(), so the buffers carry no header and keep the
+ * alignment O_DIRECT needs.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "sheepdog_proto.h"
+#include "buffer.h"
+#include "util.h"
+
+#define MIN_CLASS_SHIFT 9	/* a sector */
+#define MAX_CLASS_SHIFT 22	/* SD_DATA_OBJ_SIZE */
+#define NR_CLASSES (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+
+#define PAGE_SIZE_ALIGN 4096
+#define HUGEPAGE_SIZE (2 << 20)
+
+/* how much a thread and the shared pool keep for reuse */
+#define THREAD_CACHE_SIZE (8 << 20)
+#define THREAD_CACHE_MAX 64
+#define GLOBAL_CACHE_SIZE (64 << 20)
+
+/* a free buffer links to the next one through its first bytes */
+struct free_buffer {
+	struct free_buffer *next;
+};
+
+struct buffer_cache {
+	struct free_buffer *head;
+	int nr;
+};
+
+static __thread struct buffer_cache thread_cache[NR_CLASSES];
+
+static struct buffer_cache global_cache[NR_CLASSES];
+static size_t global_cache_size;
+static pthread_mutex_t global_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int use_hugepages;
+static struct buffer_stat buf_stat;
+
+static int size_to_class(size_t size)
+{
+	int shift = MIN_CLASS_SHIFT;
+
+	while (((size_t)1 << shift) < size)
+		shift++;
+
+	return shift - MIN_CLASS_SHIFT;
+}
+
+static inline size_t class_size(int class)
+{
+	return (size_t)1 << (class + MIN_CLASS_SHIFT);
+}
+
+static inline int thread_cache_max(int class)
+{
+	int nr = THREAD_CACHE_SIZE / class_size(class);
+
+	if (nr < 1)
+		return 1;
+
+	return min(nr, THREAD_CACHE_MAX);
+}
+
+static void *pop(struct buffer_cache *cache)
+{
+	struct free_buffer *buf = cache->head;
+
+	if (buf) {
+		cache->head = buf->next;
+		cache->nr--;
+	}
+
+	return buf;
+}
+
+static void push(struct buffer_cache *cache, void *p)
+{
+	struct free_buffer *buf = p;
+
+	buf->next = cache->head;
+	cache->head = buf;
+	cache->nr++;
+}
+
+static void *new_buffer(size_t size)
+{
+	size_t align = size < PAGE_SIZE_ALIGN ? 1 << MIN_CLASS_SHIFT :
+		PAGE_SIZE_ALIGN;
+	void *buf;
+
+	if (use_hugepages && size >= HUGEPAGE_SIZE)
+		align = HUGEPAGE_SIZE;
+
+	if (posix_memalign(&buf, align, size))
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (align == HUGEPAGE_SIZE)
+		madvise(buf, size, MADV_HUGEPAGE);
+#endif
+
+	__sync_add_and_fetch(&buf_stat.nr_misses, 1);
+
+	return buf;
+}
+
+void init_buffer_pool(int hugepages)
+{
+	use_hugepages = hugepages;
+}
+
+/*
+ * Returns a buffer aligned to a sector, or to a page if it is that large.
+ * Buffers larger than SD_DATA_OBJ_SIZE are not pooled.
+ */
+void *alloc_buffer(size_t size)
+{
+	int class;
+	void *buf;
+
+	__sync_add_and_fetch(&buf_stat.nr_allocs, 1);
+
+	if (size > SD_DATA_OBJ_SIZE) {
+		buf = new_buffer(size);
+		if (buf)
+			__sync_add_and_fetch(&buf_stat.in_use, size);
+		return buf;
+	}
+
+	class = size_to_class(size);
+	size = class_size(class);
+
+	buf = pop(thread_cache + class);
+	if (!buf) {
+		pthread_mutex_lock(&global_cache_lock);
+		buf = pop(global_cache + class);
+		if (buf)
+			global_cache_size -= size;
+		pthread_mutex_unlock(&global_cache_lock);
+	}
+
+	if (buf)
+		__sync_sub_and_fetch(&buf_stat.cached, size);
+	else {
+		buf = new_buffer(size);
+		if (!buf)
+			return NULL;
+	}
+
+	__sync_add_and_fetch(&buf_stat.in_use, size);
+
+	return buf;
+}
+
+void *zalloc_buffer(size_t size)
+{
+	void *buf = alloc_buffer(size);
+
+	if (buf)
+		memset(buf, 0, size);
+
+	return buf;
+}
+
+/* size must be the one the buffer was allocated with */
+void free_buffer(void *buf, size_t size)
+{
+	int class;
+
+	if (!buf)
+		return;
+
+	if (size > SD_DATA_OBJ_SIZE) {
+		__sync_sub_and_fetch(&buf_stat.in_use, size);
+		free(buf);
+		return;
+	}
+
+	class = size_to_class(size);
+	size = class_size(class);
+	__sync_sub_and_fetch(&buf_stat.in_use, size);
+
+	if (thread_cache[class].nr < thread_cache_max(class)) {
+		push(thread_cache + class, buf);
+		goto cached;
+	}
+
+	pthread_mutex_lock(&global_cache_lock);
+	if (global_cache_size + size <= GLOBAL_CACHE_SIZE) {
+		push(global_cache + class, buf);
+		global_cache_size += size;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&global_cache_lock);
+
+	if (buf) {
+		free(buf);
+		return;
+	}
+cached:
+	__sync_add_and_fetch(&buf_stat.cached, size);
+}
+
+void get_buffer_stat(struct buffer_stat *s)
+{
+	s->in_use = __sync_add_and_fetch(&buf_stat.in_use, 0);
+	s->cached = __sync_add_and_fetch(&buf_stat.cached, 0);
+	s->nr_allocs = __sync_add_and_fetch(&buf_stat.nr_allocs, 0);
+	s->nr_misses = __sync_add_and_fetch(&buf_stat.nr_misses, 0);
+}
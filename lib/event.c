@@ -21,8 +21,9 @@
 #include "event.h"
 #include "logger.h"
 
-static int efd;
-static LIST_HEAD(events_list);
+/* every thread which calls init_event() runs its own event loop */
+static __thread int efd;
+static __thread struct list_head events_list;
 
 #define TICK 1
 
@@ -78,6 +79,7 @@ int init_event(int nr)
 		eprintf("failed to create epoll fd\n");
 		return -1;
 	}
+	INIT_LIST_HEAD(&events_list);
 	return 0;
 }
 
@@ -19,6 +19,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -85,6 +86,48 @@ int rx(struct connection *conn, enum conn_state next_state)
 	return ret;
 }
 
+/* like rx(), but moves the data into a pipe instead of rx_buf */
+int rx_splice(struct connection *conn, int pipe, enum conn_state next_state)
+{
+	int ret;
+
+	ret = splice(conn->fd, NULL, pipe, NULL, conn->rx_length,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (!ret || ret < 0) {
+		if (errno != EAGAIN)
+			conn->c_rx_state = C_IO_CLOSED;
+		return 0;
+	}
+
+	conn->rx_length -= ret;
+
+	if (!conn->rx_length)
+		conn->c_rx_state = next_state;
+
+	return ret;
+}
+
+/* like tx(), but sends the data from a file at *offset */
+int tx_sendfile(struct connection *conn, int fd, off_t *offset,
+		enum conn_state next_state)
+{
+	int ret;
+
+	ret = sendfile(conn->fd, fd, offset, conn->tx_length);
+	if (ret <= 0) {
+		if (!ret || errno != EAGAIN)
+			conn->c_tx_state = C_IO_CLOSED;
+		return 0;
+	}
+
+	conn->tx_length -= ret;
+
+	if (!conn->tx_length)
+		conn->c_tx_state = next_state;
+
+	return ret;
+}
+
 int tx(struct connection *conn, enum conn_state next_state, int flags)
 {
 	int ret;
@@ -105,7 +148,49 @@ int tx(struct connection *conn, enum conn_state next_state, int flags)
 	return ret;
 }
 
-int create_listen_ports(int port, int (*callback)(int fd, void *), void *data)
+/*
+ * like tx(), but sends the buffers of an iovec array with one sendmsg.
+ * *iov and *nr_iov are advanced past the data which was sent.
+ */
+int tx_iov(struct connection *conn, struct iovec **iov, int *nr_iov,
+	   enum conn_state next_state, int flags)
+{
+	struct msghdr msg;
+	size_t len;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = *iov;
+	msg.msg_iovlen = *nr_iov;
+
+	ret = sendmsg(conn->fd, &msg, flags);
+	if (ret < 0) {
+		if (errno != EAGAIN)
+			conn->c_tx_state = C_IO_CLOSED;
+		return 0;
+	}
+
+	for (len = ret; *nr_iov && len >= (*iov)->iov_len; (*nr_iov)--) {
+		len -= (*iov)->iov_len;
+		(*iov)++;
+	}
+	if (*nr_iov) {
+		(*iov)->iov_base = (char *)(*iov)->iov_base + len;
+		(*iov)->iov_len -= len;
+	}
+
+	if (!*nr_iov)
+		conn->c_tx_state = next_state;
+
+	return ret;
+}
+
+/*
+ * With reuseport, several sockets can listen on the port, and the kernel
+ * spreads the new connections over them.
+ */
+int create_listen_ports(int port, int (*callback)(int fd, void *), void *data,
+			int reuseport)
 {
 	char servname[64];
 	int fd, ret, opt;
@@ -136,6 +221,21 @@ int create_listen_ports(int port, int (*callback)(int fd, void *), void *data)
 		if (ret)
 			eprintf("failed to set SO_REUSEADDR: %m\n");
 
+		if (reuseport) {
+#ifdef SO_REUSEPORT
+			ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+					 sizeof(opt));
+#else
+			ret = -1;
+			errno = ENOPROTOOPT;
+#endif
+			if (ret) {
+				eprintf("failed to set SO_REUSEPORT: %m\n");
+				close(fd);
+				continue;
+			}
+		}
+
 		opt = 1;
 		if (res->ai_family == AF_INET6) {
 			ret = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt,
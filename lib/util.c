@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <fcntl.h>
 
 #include "util.h"
 #include "logger.h"
@@ -212,3 +213,52 @@ ssize_t xpwrite(int fd, const void *buf, size_t count, off_t offset)
 
 	return total;
 }
+
+/*
+ * Move count bytes from a pipe into fd at offset.  If the file can't be
+ * spliced into, e.g. the pipe pages don't meet the alignment of O_DIRECT,
+ * the rest is read from the pipe and written with pwrite.
+ */
+ssize_t xsplice_pwrite(int pipe, int fd, size_t count, off_t offset)
+{
+	ssize_t total = 0, ret;
+	loff_t off = offset;
+	void *buf;
+
+	while (count > 0) {
+		ret = splice(pipe, NULL, fd, &off, count, SPLICE_F_MOVE);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL)
+				break;
+			return -1;
+		}
+		if (!ret) {
+			errno = ENODATA;
+			return -1;
+		}
+		count -= ret;
+		total += ret;
+	}
+
+	if (!count)
+		return total;
+
+	buf = valloc(count);
+	if (!buf)
+		return -1;
+
+	if (xread(pipe, buf, count) != count) {
+		free(buf);
+		errno = ENODATA;
+		return -1;
+	}
+
+	ret = xpwrite(fd, buf, count, off);
+	free(buf);
+	if (ret < 0)
+		return -1;
+
+	return total + ret;
+}
@@ -449,6 +449,7 @@ static int local_dispatch(void)
 					queue_work(local_block_wq, &work);
 
 					ev->callbacked = 1;
+					shm_queue_set_chksum();
 				}
 			}
 			goto out;
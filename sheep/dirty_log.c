@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Dirty object log
+ *
+ * Every node logs the objects written or removed on it in each epoch
+ * which started with the format or with a node joining or leaving, for
+ * the last few epochs.
+ * A node coming back to the cluster asks the others for the objects
+ * logged from the last epoch it was in, which may have been written after
+ * it died, until it came back.  It recovers only those from them; the
+ * rest of its objects are still the same as when it left.  A log
+ * which gets too large overflows and is dropped, and the logs are
+ * dropped after a while, so a node away for long does a full recovery.
+ * The logs live in memory, so a node which restarted has none.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sheep_priv.h"
+
+#define DIRTY_LOG_SLOTS (1U << 16)
+#define DIRTY_LOG_MAX_OBJS (DIRTY_LOG_SLOTS / 4 * 3)
+#define DIRTY_LOG_EXPIRE 3600	/* seconds */
+
+/* an empty slot, which no object has as its id */
+#define NO_OID UINT64_MAX
+
+struct dirty_log {
+	uint32_t epoch;
+	time_t start;
+	int overflow;
+	int nr;
+	uint64_t *slots;	/* an open addressing hash set of the oids */
+};
+
+static struct dirty_log dirty_logs[DIRTY_LOG_EPOCHS];
+static pthread_mutex_t dirty_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct dirty_log *epoch_to_log(uint32_t epoch)
+{
+	return dirty_logs + epoch % DIRTY_LOG_EPOCHS;
+}
+
+/* returns the log of the epoch, or NULL if it isn't usable */
+static struct dirty_log *find_log(uint32_t epoch)
+{
+	struct dirty_log *log = epoch_to_log(epoch);
+
+	if (log->epoch != epoch || log->overflow)
+		return NULL;
+
+	if (time(NULL) - log->start > DIRTY_LOG_EXPIRE) {
+		dprintf("the log of epoch %"PRIu32" expired\n", epoch);
+		return NULL;
+	}
+
+	return log;
+}
+
+/* called in the main thread when a node joined or left */
+void start_dirty_log(uint32_t epoch)
+{
+	struct dirty_log *log = epoch_to_log(epoch);
+
+	pthread_mutex_lock(&dirty_log_lock);
+	free(log->slots);
+	memset(log, 0, sizeof(*log));
+	log->epoch = epoch;
+	log->start = time(NULL);
+	pthread_mutex_unlock(&dirty_log_lock);
+}
+
+void add_dirty_obj(uint64_t oid, uint32_t epoch)
+{
+	struct dirty_log *log;
+	uint32_t i;
+
+	pthread_mutex_lock(&dirty_log_lock);
+
+	log = find_log(epoch);
+	if (!log)
+		goto out;
+
+	if (!log->slots) {
+		log->slots = malloc(sizeof(uint64_t) * DIRTY_LOG_SLOTS);
+		if (!log->slots) {
+			log->overflow = 1;
+			goto out;
+		}
+		memset(log->slots, 0xff, sizeof(uint64_t) * DIRTY_LOG_SLOTS);
+	}
+
+	i = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT) % DIRTY_LOG_SLOTS;
+	while (log->slots[i] != NO_OID) {
+		if (log->slots[i] == oid)
+			goto out;
+		i = (i + 1) % DIRTY_LOG_SLOTS;
+	}
+
+	if (log->nr == DIRTY_LOG_MAX_OBJS) {
+		vprintf(SDOG_INFO, "the dirty object log of epoch %"PRIu32
+			" overflowed\n", epoch);
+		free(log->slots);
+		log->slots = NULL;
+		log->overflow = 1;
+		goto out;
+	}
+
+	log->slots[i] = oid;
+	log->nr++;
+out:
+	pthread_mutex_unlock(&dirty_log_lock);
+}
+
+/*
+ * List the objects logged from hdr->tgt_epoch to hdr->dst_epoch.  An
+ * object can be listed once for each epoch.
+ */
+int get_dirty_list(const struct sd_list_req *hdr, struct sd_list_rsp *rsp,
+		   void *data)
+{
+	uint64_t *list = (uint64_t *)data;
+	int nr = 0, max_nr = hdr->data_length / sizeof(uint64_t);
+	int res = SD_RES_SUCCESS;
+	struct dirty_log *log;
+	uint32_t epoch, i;
+
+	if (hdr->tgt_epoch > hdr->dst_epoch ||
+	    hdr->dst_epoch - hdr->tgt_epoch >= DIRTY_LOG_EPOCHS)
+		return SD_RES_NO_DIRTY_LOG;
+
+	pthread_mutex_lock(&dirty_log_lock);
+	for (epoch = hdr->tgt_epoch; epoch <= hdr->dst_epoch; epoch++) {
+		log = find_log(epoch);
+		if (!log || nr + log->nr > max_nr) {
+			dprintf("no usable log of epoch %"PRIu32"\n", epoch);
+			res = SD_RES_NO_DIRTY_LOG;
+			goto out;
+		}
+
+		for (i = 0; log->slots && i < DIRTY_LOG_SLOTS; i++)
+			if (log->slots[i] != NO_OID)
+				list[nr++] = log->slots[i];
+	}
+
+	rsp->data_length = nr * sizeof(uint64_t);
+out:
+	pthread_mutex_unlock(&dirty_log_lock);
+	return res;
+}
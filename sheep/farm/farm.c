@@ -72,7 +72,14 @@ err:
 
 static int farm_write(uint64_t oid, struct siocb *iocb)
 {
-	ssize_t size = xpwrite(iocb->fd, iocb->buf, iocb->length, iocb->offset);
+	ssize_t size;
+
+	if (iocb->pipe)
+		size = xsplice_pwrite(iocb->pipe, iocb->fd, iocb->length,
+				      iocb->offset);
+	else
+		size = store_pwrite(iocb->fd, iocb->buf, iocb->length,
+				    iocb->offset);
 
 	if (size != iocb->length)
 		return SD_RES_EIO;
@@ -95,7 +102,7 @@ static int write_last_sector(int fd, uint32_t length)
 	}
 	memset(buf, 0, size);
 
-	ret = xpwrite(fd, buf, size, off);
+	ret = store_pwrite(fd, buf, size, off);
 	if (ret != size)
 		ret = SD_RES_EIO;
 	else
@@ -130,7 +137,7 @@ static int err_to_sderr(uint64_t oid, int err)
  */
 int prealloc(int fd, uint32_t size)
 {
-	int ret = fallocate(fd, 0, 0, size);
+	int ret = store_fallocate(fd, 0, 0, size);
 	if (ret < 0) {
 		if (errno != ENOSYS && errno != EOPNOTSUPP) {
 			dprintf("%m\n");
@@ -159,7 +166,7 @@ static int farm_open(uint64_t oid, struct siocb *iocb, int create)
 
 	strbuf_addstr(&buf, obj_path);
 	strbuf_addf(&buf, "%016" PRIx64, oid);
-	fd = open(buf.buf, flags, def_fmode);
+	fd = store_open(buf.buf, flags, def_fmode);
 	if (fd < 0) {
 		ret = err_to_sderr(oid, errno);
 		goto out;
@@ -441,7 +448,8 @@ static int farm_read(uint64_t oid, struct siocb *iocb)
 		memcpy(iocb->buf, buffer, iocb->length);
 		free(buffer);
 	} else {
-		ssize_t size = xpread(iocb->fd, iocb->buf, iocb->length, iocb->offset);
+		ssize_t size = store_pread(iocb->fd, iocb->buf, iocb->length,
+					   iocb->offset);
 
 		if (size != iocb->length)
 			return SD_RES_EIO;
@@ -452,7 +460,7 @@ static int farm_read(uint64_t oid, struct siocb *iocb)
 static int farm_atomic_put(uint64_t oid, struct siocb *iocb)
 {
 	char path[PATH_MAX], tmp_path[PATH_MAX];
-	int flags = def_open_flags | O_CREAT;
+	int flags = def_open_flags | O_CREAT | O_TRUNC;
 	int ret = SD_RES_EIO, fd;
 	uint32_t len = iocb->length;
 
@@ -468,11 +476,17 @@ static int farm_atomic_put(uint64_t oid, struct siocb *iocb)
 		goto out;
 	}
 
-	ret = xwrite(fd, iocb->buf, len);
-	if (ret != len) {
-		eprintf("failed to write object. %m\n");
-		ret = SD_RES_EIO;
-		goto out_close;
+	if (iocb->flags & SD_FLAG_CMD_SPARSE) {
+		ret = write_sparse_obj(fd, iocb->buf);
+		if (ret != SD_RES_SUCCESS)
+			goto out_close;
+	} else {
+		ret = xwrite(fd, iocb->buf, len);
+		if (ret != len) {
+			eprintf("failed to write object. %m\n");
+			ret = SD_RES_EIO;
+			goto out_close;
+		}
 	}
 
 	ret = rename(tmp_path, path);
@@ -235,15 +235,16 @@ static unsigned char *omap_tree_insert(uint64_t oid, unsigned char *sha1)
 
 static int oid_stale(uint64_t oid)
 {
-	int i, vidx, copies;
+	int i, vidx, copies, idxs[SD_MAX_REDUNDANCY];
 	struct sd_vnode *vnodes = sys->vnodes;
 
 	copies = sys->nr_sobjs;
 	if (copies > sys->nr_zones)
 		copies = sys->nr_zones;
+	copies = obj_to_vnodes(vnodes, sys->nr_vnodes, oid, copies, idxs);
 
 	for (i = 0; i < copies; i++) {
-		vidx = obj_to_sheep(vnodes, sys->nr_vnodes, oid, i);
+		vidx = idxs[i];
 		if (is_myself(vnodes[vidx].addr, vnodes[vidx].port))
 			return 0;
 	}
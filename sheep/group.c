@@ -47,6 +47,8 @@ struct join_message {
 	uint32_t result;
 	uint8_t inc_epoch; /* set non-zero when we increment epoch of all nodes */
 	uint8_t store[STORE_LEN];
+	uint8_t placement[PLACEMENT_LEN];
+	struct sd_recovery_throttle throttle;
 	union {
 		struct sd_node nodes[0];
 		struct sd_node leave_nodes[0];
@@ -446,20 +448,34 @@ out:
 
 static void join(struct sd_node *joining, struct join_message *msg)
 {
+	int i, nr_vnodes = joining->nr_vnodes;
+
 	if (msg->proto_ver != SD_SHEEP_PROTO_VER) {
 		eprintf("joining node sent a message with the wrong protocol version\n");
 		msg->result = SD_RES_VER_MISMATCH;
 		return;
 	}
 
+	/* nodes with '--vnodes auto' can have many vnodes */
+	for (i = 0; i < sys->nr_nodes; i++)
+		nr_vnodes += sys->nodes[i].nr_vnodes;
+	if (nr_vnodes > SD_MAX_VNODES) {
+		eprintf("too many vnodes, %d\n", nr_vnodes);
+		msg->result = SD_RES_INVALID_PARMS;
+		return;
+	}
+
 	msg->result = get_cluster_status(joining, msg->nodes, msg->nr_nodes,
 					 msg->ctime, msg->epoch,
 					 &msg->cluster_status, &msg->inc_epoch);
 	msg->nr_sobjs = sys->nr_sobjs;
 	msg->cluster_flags = sys->flags;
 	msg->ctime = get_cluster_ctime();
-	if (sd_store)
+	if (sd_store) {
 		strcpy((char *)msg->store, sd_store->name);
+		strcpy((char *)msg->placement, sd_placement->name);
+	}
+	msg->throttle = sys->recovery_throttle;
 }
 
 static int get_vdi_bitmap_from(struct sd_node *node)
@@ -584,6 +600,23 @@ static void update_cluster_info(struct join_message *msg,
 				panic("backend store %s not supported\n", msg->store);
 	}
 
+	if (strlen((char *)msg->placement) &&
+	    strcmp((char *)msg->placement, sd_placement->name)) {
+		sd_placement = find_placement_driver((char *)msg->placement);
+		if (!sd_placement)
+			panic("placement %s not supported\n", msg->placement);
+		if (set_cluster_placement(msg->placement) != SD_RES_SUCCESS)
+			panic("failed to store into config file\n");
+	}
+
+	/* the throttle may have been set while this node was away */
+	if (memcmp(&msg->throttle, &sys->recovery_throttle,
+		   sizeof(msg->throttle))) {
+		set_recovery_throttle(&msg->throttle);
+		if (set_cluster_throttle(&msg->throttle) != SD_RES_SUCCESS)
+			panic("failed to store into config file\n");
+	}
+
 join_finished:
 	sys->nodes[sys->nr_nodes++] = *joined;
 	qsort(sys->nodes, sys->nr_nodes, sizeof(*sys->nodes), node_cmp);
@@ -841,8 +874,11 @@ static void __sd_join_done(struct cpg_event *cevent)
 		list_for_each_entry_safe(node, t, &sys->leave_list, list) {
 			list_del(&node->list);
 		}
+		start_dirty_log(sys->epoch);
 		start_recovery(sys->epoch);
-	}
+	} else if (sys_can_recover())
+		/* the cluster started again at the epoch */
+		recover_from_checkpoint(sys->epoch);
 
 	if (sys_stat_halt()) {
 		if (sys->nr_zones >= sys->nr_sobjs)
@@ -873,8 +909,10 @@ static void __sd_leave_done(struct cpg_event *cevent)
 
 	print_node_list(sys->nodes, sys->nr_nodes);
 
-	if (sys_can_recover())
+	if (sys_can_recover()) {
+		start_dirty_log(sys->epoch);
 		start_recovery(sys->epoch);
+	}
 
 	if (sys_can_halt()) {
 		if (sys->nr_zones < sys->nr_sobjs)
@@ -1001,18 +1039,89 @@ int is_access_to_busy_objects(uint64_t oid)
 	if (!oid)
 		return 0;
 
+	if (is_sending_obj(oid))
+		return 1;
+
 	list_for_each_entry(req, &sys->outstanding_req_list, r_wlist) {
 		if (req->rq.flags & SD_FLAG_CMD_RECOVERY) {
 			if (req->rq.opcode != SD_OP_READ_OBJ)
 				eprintf("bug\n");
 			continue;
 		}
-		if (oid == req->local_oid)
+		if (oid == req->local_oid || objs_req_has_oid(req, oid))
 			return 1;
 	}
 	return 0;
 }
 
+/* whether an outstanding vectored request has a segment on oid */
+static int is_access_to_busy_segs(uint64_t oid)
+{
+	struct request *req;
+
+	list_for_each_entry(req, &sys->outstanding_req_list, r_wlist)
+		if (objs_req_has_oid(req, oid))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * While this node recovers, a gateway request doing I/O with forward_objs()
+ * sends its local segments back to this node instead of doing them itself.
+ */
+static int forwards_local_segs(struct request *req)
+{
+	if (req->rq.flags & SD_FLAG_CMD_IO_LOCAL)
+		return 0;
+
+	return is_vectored_op(req->op) || req->rq.opcode == SD_OP_DISCARD_OBJ;
+}
+
+/*
+ * A vectored request waits for the outstanding requests on the objects of
+ * its segments, local or not, like the gateway does for a single object.
+ * A local one doesn't wait for the gateway requests which may have sent
+ * it, or it would wait for itself; it is ordered against the requests
+ * doing local I/O.
+ */
+static int is_access_to_busy_objs(struct request *req)
+{
+	struct sd_objs_req *hdr = (struct sd_objs_req *)&req->rq;
+	struct sd_obj_seg *segs = req->data;
+	int local = req->rq.flags & SD_FLAG_CMD_IO_LOCAL;
+	struct request *r;
+	int i;
+
+	if (!segs || !hdr->nr_segs || hdr->nr_segs > SD_MAX_SEGS ||
+	    objs_data_offset(hdr->nr_segs) > hdr->data_length)
+		return 0;
+
+	for (i = 0; i < hdr->nr_segs; i++)
+		if (is_sending_obj(segs[i].oid))
+			return 1;
+
+	list_for_each_entry(r, &sys->outstanding_req_list, r_wlist) {
+		struct sd_obj_req *h = (struct sd_obj_req *)&r->rq;
+
+		if (r->rq.flags & SD_FLAG_CMD_RECOVERY || !is_io_op(r->op))
+			continue;
+		if (local && forwards_local_segs(r))
+			continue;
+
+		for (i = 0; i < hdr->nr_segs; i++) {
+			if (is_vectored_op(r->op)) {
+				if (objs_req_has_oid(r, segs[i].oid))
+					return 1;
+			} else if ((!local && h->oid == segs[i].oid) ||
+				   r->local_oid == segs[i].oid)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
 static int __is_access_to_recoverying_objects(struct request *req)
 {
 	if (req->rq.flags & SD_FLAG_CMD_RECOVERY) {
@@ -1038,9 +1147,161 @@ static int __is_access_to_busy_objects(struct request *req)
 	if (is_access_to_busy_objects(req->local_oid))
 		return 1;
 
+	/* the segments of a vectored request are busy even if not local */
+	if (is_access_to_busy_segs(((struct sd_obj_req *)&req->rq)->oid))
+		return 1;
+
 	return 0;
 }
 
+/* how many client writes a gateway write carries at most */
+#define MAX_COALESCED_WRITES 32
+
+static int is_gateway_write(struct request *req)
+{
+	struct sd_obj_req *hdr = (struct sd_obj_req *)&req->rq;
+
+	return hdr->opcode == SD_OP_WRITE_OBJ && is_data_obj(hdr->oid) &&
+		!hdr->cow_oid && req->data &&
+		!(hdr->flags & (SD_FLAG_CMD_IO_LOCAL | SD_FLAG_CMD_CHAIN |
+				SD_FLAG_CMD_RECOVERY | SD_FLAG_CMD_COW));
+}
+
+static inline int ranges_touch(struct sd_obj_req *a, struct sd_obj_req *b)
+{
+	return a->offset <= b->offset + b->data_length &&
+		b->offset <= a->offset + a->data_length;
+}
+
+/*
+ * A gateway write waits for the one in flight on the same range of the
+ * object, so that they are done in order, and so that the writes queued
+ * behind it are coalesced into one.
+ */
+static int is_access_to_writing_range(struct request *req)
+{
+	struct sd_obj_req *hdr = (struct sd_obj_req *)&req->rq;
+	struct request *r;
+
+	if (!is_gateway_write(req))
+		return 0;
+
+	list_for_each_entry(r, &sys->outstanding_req_list, r_wlist) {
+		struct sd_obj_req *h = (struct sd_obj_req *)&r->rq;
+
+		if (is_gateway_write(r) && h->oid == hdr->oid &&
+		    ranges_touch(h, hdr))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Merge the gateway writes queued behind req, which are on the same
+ * object and contiguous with or overlapping it, into req.  They are
+ * copied in the order of the queue, so the later ones win.  The scan
+ * stops at anything else on the object, and at the requests other than
+ * I/O, like flushes, so no request is moved before one it followed.
+ */
+static void coalesce_writes(struct request *req)
+{
+	struct sd_obj_req *hdr = (struct sd_obj_req *)&req->rq, *h;
+	struct request *r, *merged[MAX_COALESCED_WRITES];
+	struct cpg_event *cevent;
+	struct list_head *p;
+	uint64_t start = hdr->offset, end = hdr->offset + hdr->data_length;
+	int i, nr = 0, total = req->nr_coalesced;
+	char *data;
+
+	for (p = req->cev.cpg_event_list.next; p != &sys->cpg_event_siblings;
+	     p = p->next) {
+		cevent = list_entry(p, struct cpg_event, cpg_event_list);
+		if (cevent->ctype == CPG_EVENT_NOTIFY)
+			continue;
+		if (is_membership_change_event(cevent->ctype))
+			break;
+
+		r = container_of(cevent, struct request, cev);
+		h = (struct sd_obj_req *)&r->rq;
+		if (!is_io_op(r->op) || is_vectored_op(r->op))
+			break;
+		if (h->oid != hdr->oid && h->cow_oid != hdr->oid)
+			continue;
+
+		if (!is_gateway_write(r) || h->flags != hdr->flags ||
+		    h->copies != hdr->copies || h->epoch != hdr->epoch ||
+		    h->offset > end || h->offset + h->data_length < start ||
+		    total + 1 + r->nr_coalesced >= MAX_COALESCED_WRITES)
+			break;
+
+		merged[nr++] = r;
+		total += 1 + r->nr_coalesced;
+		if (h->offset < start)
+			start = h->offset;
+		if (h->offset + h->data_length > end)
+			end = h->offset + h->data_length;
+	}
+
+	if (!nr)
+		return;
+
+	data = alloc_buffer(end - start);
+	if (!data)
+		return;
+
+	memcpy(data + hdr->offset - start, req->data, hdr->data_length);
+	if (!req->nr_coalesced)
+		INIT_LIST_HEAD(&req->coalesced_list);
+
+	for (i = 0; i < nr; i++) {
+		r = merged[i];
+		h = (struct sd_obj_req *)&r->rq;
+		memcpy(data + h->offset - start, r->data, h->data_length);
+
+		list_del(&r->cev.cpg_event_list);
+		list_add_tail(&r->r_wlist, &req->coalesced_list);
+		if (r->nr_coalesced)
+			list_splice_init(&r->coalesced_list,
+					 &req->coalesced_list);
+		req->nr_coalesced += 1 + r->nr_coalesced;
+		r->nr_coalesced = 0;
+
+		/* the response of a write has no data */
+		free_buffer(r->data, r->data_length);
+		add_outstanding_data(-(int)r->data_length);
+		r->data = NULL;
+		r->data_length = 0;
+	}
+
+	free_buffer(req->data, req->data_length);
+	add_outstanding_data(end - start - req->data_length);
+	req->data = data;
+	req->data_length = end - start;
+	hdr->offset = start;
+	hdr->data_length = end - start;
+}
+
+/* complete the writes coalesced into req with the result of req */
+void finish_coalesced_writes(struct request *req)
+{
+	struct request *r, *n;
+
+	if (!is_gateway_write(req))
+		return;
+
+	account_gateway_writes(req->nr_coalesced);
+	if (!req->nr_coalesced)
+		return;
+
+	list_for_each_entry_safe(r, n, &req->coalesced_list, r_wlist) {
+		list_del(&r->r_wlist);
+		r->rp.result = req->rp.result;
+		r->done(r);
+	}
+	req->nr_coalesced = 0;
+}
+
 static int need_consistency_check(uint8_t opcode, uint16_t flags)
 {
 	if (flags & SD_FLAG_CMD_IO_LOCAL)
@@ -1058,6 +1319,31 @@ static int need_consistency_check(uint8_t opcode, uint16_t flags)
 	return 1;
 }
 
+/*
+ * A replica in the middle of a write chain waits for the next one, so
+ * each position gets its own work queue.  Sharing the io workers, the
+ * nodes could end up waiting for each other.
+ */
+static struct work_queue *get_io_wqueue(struct request *req)
+{
+	int pos, copies, idxs[SD_MAX_REDUNDANCY];
+
+	if (!(req->rq.flags & SD_FLAG_CMD_CHAIN))
+		return sys->io_wqueue;
+
+	pos = get_chain_pos(req, idxs, &copies);
+	if (pos < 0 || pos == copies - 1)
+		return sys->io_wqueue;
+
+	if (!sys->chain_wqueue[pos]) {
+		sys->chain_wqueue[pos] = init_work_queue(NR_IO_WORKER_THREAD);
+		if (!sys->chain_wqueue[pos])
+			panic("failed to create a work queue\n");
+	}
+
+	return sys->chain_wqueue[pos];
+}
+
 /* can be called only by the main process */
 void start_cpg_event_work(void)
 {
@@ -1089,9 +1375,36 @@ do_retry:
 		if (is_membership_change_event(cevent->ctype))
 			break;
 
+		if (is_io_op(req->op) && is_gateway_write(req)) {
+			coalesce_writes(req);
+			n = list_entry(cevent->cpg_event_list.next,
+				       struct cpg_event, cpg_event_list);
+		}
+
 		list_del(&cevent->cpg_event_list);
 
-		if (is_io_op(req->op)) {
+		if (is_io_op(req->op) && is_vectored_op(req->op)) {
+			if (is_access_to_busy_objs(req) ||
+			    (!(req->rq.flags & SD_FLAG_CMD_IO_LOCAL) &&
+			     is_access_to_recoverying_segs(req))) {
+				list_add_tail(&req->r_wlist, &sys->req_wait_for_obj_list);
+				continue;
+			}
+
+			list_add_tail(&req->r_wlist, &sys->outstanding_req_list);
+			sys->nr_outstanding_io++;
+
+			if (req->rq.flags & SD_FLAG_CMD_IO_LOCAL) {
+				int ret = check_epoch(req);
+				if (ret != SD_RES_SUCCESS) {
+					req->rp.result = ret;
+					list_del(&req->r_wlist);
+					list_add_tail(&req->r_wlist, &failed_req_list);
+					continue;
+				}
+				fail_recoverying_segs(req);
+			}
+		} else if (is_io_op(req->op)) {
 			int copies = sys->nr_sobjs;
 
 			if (copies > req->nr_zones)
@@ -1113,7 +1426,8 @@ do_retry:
 					list_add_tail(&req->r_wlist, &sys->req_wait_for_obj_list);
 				continue;
 			}
-			if (__is_access_to_busy_objects(req)) {
+			if (__is_access_to_busy_objects(req) ||
+			    is_access_to_writing_range(req)) {
 				list_add_tail(&req->r_wlist, &sys->req_wait_for_obj_list);
 				continue;
 			}
@@ -1155,7 +1469,7 @@ do_retry:
 		if (is_cluster_op(req->op))
 			queue_work(sys->cpg_wqueue, &req->work);
 		else if (req->rq.flags & SD_FLAG_CMD_IO_LOCAL)
-			queue_work(sys->io_wqueue, &req->work);
+			queue_work(get_io_wqueue(req), &req->work);
 		else
 gateway_work:
 			queue_work(sys->gateway_wqueue, &req->work);
@@ -1434,7 +1748,6 @@ int create_cluster(int port, int64_t zone, int nr_vnodes)
 	INIT_LIST_HEAD(&sys->outstanding_req_list);
 	INIT_LIST_HEAD(&sys->req_wait_for_obj_list);
 	INIT_LIST_HEAD(&sys->consistent_obj_list);
-	INIT_LIST_HEAD(&sys->blocking_conn_list);
 
 	INIT_LIST_HEAD(&sys->cpg_event_siblings);
 
@@ -313,14 +313,14 @@ out:
 /* Fetch the object, cache it in success */
 int object_cache_pull(struct object_cache *oc, uint32_t idx)
 {
-	int i, n = 0, fd, ret = SD_RES_NO_MEM;
-	unsigned wlen = 0, rlen, data_length, read_len;
+	int i, n = 0, ret = SD_RES_NO_MEM;
+	unsigned data_length, read_len;
 	uint64_t oid;
 	struct sd_obj_req hdr = { 0 };
-	struct sd_obj_rsp *rsp = (struct sd_obj_rsp *)&hdr;
+	struct sd_obj_rsp rsp = { 0 };
 	struct sd_vnode *vnodes = sys->vnodes;
 	void *buf;
-	int copies;
+	int copies, idxs[SD_MAX_REDUNDANCY];
 
 	if (idx & CACHE_VDI_BIT) {
 		oid = vid_to_vdi_oid(oc->vid);
@@ -330,7 +330,7 @@ int object_cache_pull(struct object_cache *oc, uint32_t idx)
 		data_length = SD_DATA_OBJ_SIZE;
 	}
 
-	buf = valloc(data_length);
+	buf = alloc_buffer(data_length);
 	if (buf == NULL) {
 		eprintf("failed to allocate memory\n");
 		goto out;
@@ -339,10 +339,11 @@ int object_cache_pull(struct object_cache *oc, uint32_t idx)
 	copies = sys->nr_sobjs;
 	if (sys->nr_zones < copies)
 		copies = sys->nr_zones;
+	copies = obj_to_vnodes(vnodes, sys->nr_vnodes, oid, copies, idxs);
 
 	/* Check if we can read locally */
 	for (i = 0; i < copies; i++) {
-		n = obj_to_sheep(vnodes, sys->nr_vnodes, oid, i);
+		n = idxs[i];
 		if (is_myself(vnodes[n].addr, vnodes[n].port)) {
 			struct siocb iocb = { 0 };
 			iocb.epoch = sys->epoch;
@@ -366,39 +367,24 @@ int object_cache_pull(struct object_cache *oc, uint32_t idx)
 
 pull_remote:
 	/* Okay, no luck, let's read remotely */
-	for (i = 0; i < copies; i++) {
-		n = obj_to_sheep(vnodes, sys->nr_vnodes, oid, i);
-		if (is_myself(vnodes[n].addr, vnodes[n].port))
-			continue;
+	for (i = 0, n = 0; i < copies; i++)
+		if (!is_myself(vnodes[idxs[i]].addr, vnodes[idxs[i]].port))
+			idxs[n++] = idxs[i];
+	sort_read_replicas(vnodes, idxs, n);
 
-		hdr.opcode = SD_OP_READ_OBJ;
-		hdr.oid = oid;
-		hdr.epoch = sys->epoch;
-		hdr.data_length = rlen = data_length;
-		hdr.flags = SD_FLAG_CMD_IO_LOCAL;
-
-		fd = get_sheep_fd(vnodes[n].addr, vnodes[n].port, vnodes[n].node_idx, hdr.epoch);
-		if (fd < 0)
-			continue;
+	hdr.opcode = SD_OP_READ_OBJ;
+	hdr.oid = oid;
+	hdr.epoch = sys->epoch;
+	hdr.data_length = data_length;
 
-		ret = exec_req(fd, (struct sd_req *)&hdr, buf, &wlen, &rlen);
-		if (ret) { /* network errors */
-			del_sheep_fd(fd);
-			ret = SD_RES_NETWORK_ERROR;
-		} else
-			ret = rsp->result;
-		read_len = rlen;
+	ret = read_remote_replicas(vnodes, idxs, n, &hdr, buf, &rsp);
+	read_len = min(data_length, rsp.data_length);
 
-		dprintf("[remote] %08"PRIx32", res:%"PRIx32"\n", idx, ret);
-		if (ret != SD_RES_SUCCESS)
-			continue;
-		else
-			break;
-	}
+	dprintf("[remote] %08"PRIx32", res:%"PRIx32"\n", idx, ret);
 out:
 	if (ret == SD_RES_SUCCESS)
 		ret = create_cache_object(oc, idx, buf, read_len);
-	free(buf);
+	free_buffer(buf, data_length);
 	return ret;
 }
 
@@ -427,7 +413,7 @@ static int push_cache_object(uint32_t vid, uint32_t idx, int create)
 	else
 		data_length = SD_DATA_OBJ_SIZE;
 
-	buf = valloc(data_length);
+	buf = alloc_buffer(data_length);
 	if (buf == NULL) {
 		eprintf("failed to allocate memory\n");
 		goto out;
@@ -456,7 +442,7 @@ static int push_cache_object(uint32_t vid, uint32_t idx, int create)
 		goto out;
 	}
 out:
-	free(buf);
+	free_buffer(buf, data_length);
 	return ret;
 }
 
@@ -573,6 +559,39 @@ out:
 	return ret;
 }
 
+/* drop a range of a cached object, if it is cached */
+int object_cache_discard(struct object_cache *oc, uint32_t idx,
+			 uint64_t offset, uint32_t length)
+{
+	int fd, ret;
+	struct strbuf p;
+
+	strbuf_init(&p, PATH_MAX);
+	strbuf_addstr(&p, cache_dir);
+	strbuf_addf(&p, "/%06"PRIx32"/%08"PRIx32, oc->vid, idx);
+
+	fd = open(p.buf, def_open_flags, def_fmode);
+	if (fd < 0) {
+		ret = errno == ENOENT ? SD_RES_SUCCESS : SD_RES_EIO;
+		goto out;
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		ret = SD_RES_EIO;
+		eprintf("%m\n");
+		goto close;
+	}
+	ret = punch_hole(fd, offset, length);
+	if (flock(fd, LOCK_UN) < 0) {
+		ret = SD_RES_EIO;
+		eprintf("%m\n");
+	}
+close:
+	close(fd);
+out:
+	strbuf_release(&p);
+	return ret;
+}
+
 int object_cache_init(const char *p)
 {
 	int ret = 0;
@@ -29,6 +29,9 @@ struct sd_op_template {
 	/* process request even when cluster is not working */
 	int force;
 
+	/* an io operation on a list of object segments */
+	int vectored;
+
 	/*
 	 * process_work() will be called in the worker thread, and
 	 * process_main() will be called in the main thread.
@@ -143,11 +146,24 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	int i, latest_epoch, ret;
 	uint64_t ctime;
 	struct siocb iocb = { 0 };
+	struct placement_driver *placement;
+	const char *placement_name = DEFAULT_PLACEMENT;
+
+	/* the placement name follows the store name if it is specified */
+	if (hdr->data_length >= STORE_LEN + PLACEMENT_LEN)
+		placement_name = (char *)data + STORE_LEN;
+	placement = find_placement_driver(placement_name);
+	if (!placement)
+		return SD_RES_INVALID_PARMS;
 
 	sd_store = find_store_driver(data);
 	if (!sd_store)
 		return SD_RES_NO_STORE;
 
+	sd_placement = placement;
+	if (set_cluster_placement((uint8_t *)placement->name) != SD_RES_SUCCESS)
+		return SD_RES_EIO;
+
 	latest_epoch = get_latest_epoch();
 	iocb.epoch = latest_epoch;
 	sd_store->format(&iocb);
@@ -173,6 +189,7 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 		return SD_RES_EIO;
 
 	update_epoch_store(sys->epoch);
+	start_dirty_log(sys->epoch);
 
 	set_cluster_copies(sys->nr_sobjs);
 	set_cluster_flags(sys->flags);
@@ -232,6 +249,30 @@ static int cluster_get_vdi_attr(const struct sd_req *req, struct sd_rsp *rsp,
 	return ret;
 }
 
+static int local_stat_gateway(const struct sd_req *req, struct sd_rsp *rsp,
+			      void *data)
+{
+	if (req->data_length < sizeof(struct sd_gateway_stat))
+		return SD_RES_INVALID_PARMS;
+
+	get_gateway_stat(data);
+	rsp->data_length = sizeof(struct sd_gateway_stat);
+
+	return SD_RES_SUCCESS;
+}
+
+static int local_stat_recovery(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data)
+{
+	if (req->data_length < sizeof(struct sd_recovery_stat))
+		return SD_RES_INVALID_PARMS;
+
+	get_recovery_stat(data);
+	rsp->data_length = sizeof(struct sd_recovery_stat);
+
+	return SD_RES_SUCCESS;
+}
+
 static int local_get_store_list(const struct sd_req *req, struct sd_rsp *rsp,
 				void *data)
 {
@@ -350,6 +391,13 @@ static int local_get_obj_list(const struct sd_req *req, struct sd_rsp *rsp,
 			    (struct sd_list_rsp *)rsp, data);
 }
 
+static int local_get_dirty_list(const struct sd_req *req, struct sd_rsp *rsp,
+				void *data)
+{
+	return get_dirty_list((const struct sd_list_req *)req,
+			      (struct sd_list_rsp *)rsp, data);
+}
+
 static int local_get_epoch(const struct sd_req *req, struct sd_rsp *rsp,
 			   void *data)
 {
@@ -432,6 +480,18 @@ static int cluster_snapshot(const struct sd_req *req, struct sd_rsp *rsp,
 	return ret;
 }
 
+static int cluster_recovery_throttle(const struct sd_req *req,
+				     struct sd_rsp *rsp, void *data)
+{
+	if (req->data_length < sizeof(struct sd_recovery_throttle))
+		return SD_RES_INVALID_PARMS;
+
+	set_recovery_throttle(data);
+
+	/* the nodes which join or restart later get it from the config */
+	return set_cluster_throttle(data);
+}
+
 static int cluster_cleanup(const struct sd_req *req, struct sd_rsp *rsp,
 				void *data)
 {
@@ -585,7 +645,25 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = cluster_cleanup,
 	},
 
+	[SD_OP_RECOVERY_THROTTLE] = {
+		.type = SD_OP_TYPE_CLUSTER,
+		.force = 1,
+		.process_main = cluster_recovery_throttle,
+	},
+
 	/* local operations */
+	[SD_OP_STAT_GATEWAY] = {
+		.type = SD_OP_TYPE_LOCAL,
+		.force = 1,
+		.process_work = local_stat_gateway,
+	},
+
+	[SD_OP_STAT_RECOVERY] = {
+		.type = SD_OP_TYPE_LOCAL,
+		.force = 1,
+		.process_main = local_stat_recovery,
+	},
+
 	[SD_OP_GET_STORE_LIST] = {
 		.type = SD_OP_TYPE_LOCAL,
 		.force = 1,
@@ -626,6 +704,11 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_get_obj_list,
 	},
 
+	[SD_OP_GET_DIRTY_LIST] = {
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_dirty_list,
+	},
+
 	[SD_OP_GET_EPOCH] = {
 		.type = SD_OP_TYPE_LOCAL,
 		.process_work = local_get_epoch,
@@ -662,6 +745,29 @@ static struct sd_op_template sd_ops[] = {
 		.type = SD_OP_TYPE_IO,
 		.process_work = store_remove_obj,
 	},
+
+	[SD_OP_DISCARD_OBJ] = {
+		.type = SD_OP_TYPE_IO,
+		.process_work = store_discard_obj,
+	},
+
+	[SD_OP_READ_OBJS] = {
+		.type = SD_OP_TYPE_IO,
+		.vectored = 1,
+		.process_work = store_objs,
+	},
+
+	[SD_OP_WRITE_OBJS] = {
+		.type = SD_OP_TYPE_IO,
+		.vectored = 1,
+		.process_work = store_objs,
+	},
+
+	[SD_OP_REMOVE_OBJS] = {
+		.type = SD_OP_TYPE_IO,
+		.vectored = 1,
+		.process_work = store_objs,
+	},
 };
 
 struct sd_op_template *get_sd_op(uint8_t opcode)
@@ -692,6 +798,11 @@ int is_force_op(struct sd_op_template *op)
 	return !!op->force;
 }
 
+int is_vectored_op(struct sd_op_template *op)
+{
+	return !!op->vectored;
+}
+
 int has_process_work(struct sd_op_template *op)
 {
 	return !!op->process_work;
@@ -0,0 +1,588 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Peer connection pool
+ *
+ * Requests to other sheep share one connection per peer.  They are
+ * tagged with an id, so any number of them can be in flight on a
+ * connection, and a receiver thread hands each response over to the
+ * request with the same id.  The receiver never blocks on a socket; it
+ * keeps the state of a partly received response per socket, so a slow
+ * peer doesn't hold up the responses of the others.
+ *
+ * Connections are keyed by the address of the peer, so they survive
+ * epoch changes.  A broken connection is reconnected when the next
+ * request to the peer is sent.  Only a failed connect backs off the next
+ * one, by a delay which doubles on each failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "sheep_priv.h"
+
+#define PEER_HASH_SIZE 256
+#define PEER_MIN_BACKOFF 1 /* seconds */
+#define PEER_MAX_BACKOFF 16
+#define NR_PEER_EVENTS 64
+#define PEER_RX_BUDGET (256 * 1024) /* bytes from a socket per turn */
+
+enum peer_req_state {
+	PEER_REQ_INFLIGHT,
+	PEER_REQ_RECEIVING,
+	PEER_REQ_DONE,
+};
+
+/*
+ * A connected socket of a peer.  The connection holds a reference until
+ * the receiver closes it, and a sender holds one while sending.
+ */
+struct peer_sock {
+	int fd;
+	int refcnt;
+	struct peer_conn *conn;
+	struct list_head inflight;
+
+	/* the response being received, touched only by the receiver */
+	struct sd_rsp rsp;
+	unsigned rsp_done;
+	struct peer_req *cur;
+	unsigned rlen;
+	unsigned data_done;
+};
+
+struct peer_conn {
+	uint8_t addr[16];
+	uint16_t port;
+	struct list_head hash;
+
+	/* serializes connecting and sending */
+	pthread_mutex_t send_lock;
+	/* protected by peer_lock, set only with send_lock held too */
+	struct peer_sock *sock;
+	/* protected by send_lock */
+	time_t retry_time;
+	int backoff;
+
+	uint32_t next_id;
+};
+
+struct peer_req {
+	struct list_head list;
+	struct peer_sock *sock;
+	uint32_t id;
+	enum peer_req_state state;
+	int cancelled;
+	struct async_waiter *waiter;
+
+	void *rbuf;
+	unsigned rlen;
+
+	int result;
+	struct sd_rsp rsp;
+};
+
+/*
+ * peer_lock protects the hash table, the sockets of the connections, the
+ * inflight lists and the requests
+ */
+static struct list_head peer_hash[PEER_HASH_SIZE];
+static pthread_mutex_t peer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t peer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t peer_once = PTHREAD_ONCE_INIT;
+static int peer_efd;
+
+/* called with peer_lock held */
+static void complete_req(struct peer_req *req, int result)
+{
+	if (req->cancelled) {
+		free(req);
+		return;
+	}
+
+	req->result = result;
+	req->state = PEER_REQ_DONE;
+	if (req->waiter)
+		async_wakeup(req->waiter);
+}
+
+static void put_sock(struct peer_sock *sock)
+{
+	if (__sync_sub_and_fetch(&sock->refcnt, 1))
+		return;
+
+	close(sock->fd);
+	free(sock);
+}
+
+/* called by the receiver when the socket fails or is shut down */
+static void close_sock(struct peer_sock *sock)
+{
+	struct peer_conn *conn = sock->conn;
+	struct peer_req *req, *n;
+
+	epoll_ctl(peer_efd, EPOLL_CTL_DEL, sock->fd, NULL);
+
+	pthread_mutex_lock(&peer_lock);
+	if (conn->sock == sock)
+		conn->sock = NULL;
+
+	if (sock->cur)
+		complete_req(sock->cur, SD_RES_NETWORK_ERROR);
+	list_for_each_entry_safe(req, n, &sock->inflight, list) {
+		list_del(&req->list);
+		complete_req(req, SD_RES_NETWORK_ERROR);
+	}
+	pthread_cond_broadcast(&peer_cond);
+	pthread_mutex_unlock(&peer_lock);
+
+	put_sock(sock);
+}
+
+/*
+ * Returns the number of bytes received, 0 if there is nothing to receive
+ * for now, or -1 if the socket failed or was closed.
+ */
+static int recv_nonblock(int fd, void *buf, unsigned len)
+{
+	int ret;
+again:
+	ret = recv(fd, buf, len, MSG_DONTWAIT);
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto again;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		eprintf("failed to receive from a peer, %m\n");
+		return -1;
+	}
+	if (!ret)
+		return -1;
+
+	return ret;
+}
+
+/* the header of a response is in, look for its request */
+static void start_response(struct peer_sock *sock)
+{
+	struct peer_req *req;
+
+	pthread_mutex_lock(&peer_lock);
+	list_for_each_entry(req, &sock->inflight, list) {
+		if (req->id == sock->rsp.id) {
+			list_del(&req->list);
+			req->state = PEER_REQ_RECEIVING;
+			sock->cur = req;
+			if (!req->cancelled)
+				sock->rlen = min(req->rlen,
+						 sock->rsp.data_length);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&peer_lock);
+
+	if (!sock->cur)
+		eprintf("response to an unknown request %u\n", sock->rsp.id);
+}
+
+static void finish_response(struct peer_sock *sock)
+{
+	pthread_mutex_lock(&peer_lock);
+	if (sock->cur) {
+		sock->cur->rsp = sock->rsp;
+		complete_req(sock->cur, SD_RES_SUCCESS);
+	}
+	pthread_cond_broadcast(&peer_cond);
+	pthread_mutex_unlock(&peer_lock);
+
+	sock->rsp_done = 0;
+	sock->cur = NULL;
+	sock->rlen = 0;
+	sock->data_done = 0;
+}
+
+/*
+ * Receive what the socket has, up to PEER_RX_BUDGET bytes.  The data
+ * beyond the buffer of the request is dropped.  Returns -1 if the socket
+ * failed.
+ */
+static int recv_responses(struct peer_sock *sock)
+{
+	static char scratch[65536];
+	unsigned len, budget = PEER_RX_BUDGET;
+	char *buf;
+	int ret;
+
+	while (budget) {
+		if (sock->rsp_done < sizeof(sock->rsp)) {
+			buf = (char *)&sock->rsp + sock->rsp_done;
+			ret = recv_nonblock(sock->fd, buf,
+					    sizeof(sock->rsp) - sock->rsp_done);
+			if (ret <= 0)
+				return ret;
+			sock->rsp_done += ret;
+			if (sock->rsp_done < sizeof(sock->rsp))
+				continue;
+			start_response(sock);
+		}
+
+		if (sock->data_done < sock->rsp.data_length) {
+			if (sock->data_done < sock->rlen) {
+				buf = (char *)sock->cur->rbuf + sock->data_done;
+				len = sock->rlen - sock->data_done;
+			} else {
+				buf = scratch;
+				len = min(sock->rsp.data_length - sock->data_done,
+					  (uint32_t)sizeof(scratch));
+			}
+			ret = recv_nonblock(sock->fd, buf, min(len, budget));
+			if (ret <= 0)
+				return ret;
+			sock->data_done += ret;
+			budget -= ret;
+			if (sock->data_done < sock->rsp.data_length)
+				continue;
+		}
+
+		finish_response(sock);
+	}
+
+	return 0;
+}
+
+static void *peer_receiver(void *arg)
+{
+	struct epoll_event events[NR_PEER_EVENTS];
+	int i, nr;
+
+	for (;;) {
+		nr = epoll_wait(peer_efd, events, ARRAY_SIZE(events), -1);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("epoll_wait failed, %m\n");
+		}
+
+		for (i = 0; i < nr; i++) {
+			struct peer_sock *sock = events[i].data.ptr;
+
+			if (recv_responses(sock) < 0)
+				close_sock(sock);
+		}
+	}
+
+	return NULL;
+}
+
+static void init_peer_pool(void)
+{
+	pthread_t thread;
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(peer_hash); i++)
+		INIT_LIST_HEAD(&peer_hash[i]);
+
+	peer_efd = epoll_create(SD_MAX_NODES);
+	if (peer_efd < 0)
+		panic("failed to create an epoll fd, %m\n");
+
+	ret = pthread_create(&thread, NULL, peer_receiver, NULL);
+	if (ret)
+		panic("failed to create the peer receiver, %s\n", strerror(ret));
+}
+
+static struct peer_conn *get_conn(uint8_t *addr, uint16_t port)
+{
+	struct peer_conn *conn;
+	struct list_head *head;
+	uint64_t hval;
+
+	hval = fnv_64a_buf(addr, 16, FNV1A_64_INIT);
+	hval = fnv_64a_buf(&port, sizeof(port), hval);
+	head = &peer_hash[hval % PEER_HASH_SIZE];
+
+	pthread_mutex_lock(&peer_lock);
+	list_for_each_entry(conn, head, hash) {
+		if (!memcmp(conn->addr, addr, sizeof(conn->addr)) &&
+		    conn->port == port)
+			goto out;
+	}
+
+	conn = zalloc(sizeof(*conn));
+	if (!conn)
+		panic("failed to allocate memory\n");
+	memcpy(conn->addr, addr, sizeof(conn->addr));
+	conn->port = port;
+	pthread_mutex_init(&conn->send_lock, NULL);
+	list_add(&conn->hash, head);
+out:
+	pthread_mutex_unlock(&peer_lock);
+
+	return conn;
+}
+
+/* called with conn->send_lock held */
+static int connect_peer(struct peer_conn *conn)
+{
+	char name[INET6_ADDRSTRLEN];
+	struct peer_sock *sock;
+	struct epoll_event ev;
+	time_t now = time(NULL);
+	int fd;
+
+	if (now < conn->retry_time)
+		return -1;
+
+	addr_to_str(name, sizeof(name), conn->addr, 0);
+	fd = connect_to(name, conn->port);
+	if (fd < 0)
+		goto fail;
+
+	if (set_timeout(fd) || set_nodelay(fd)) {
+		eprintf("%m\n");
+		close(fd);
+		goto fail;
+	}
+
+	sock = zalloc(sizeof(*sock));
+	if (!sock)
+		panic("failed to allocate memory\n");
+	sock->fd = fd;
+	sock->refcnt = 1;
+	sock->conn = conn;
+	INIT_LIST_HEAD(&sock->inflight);
+
+	/* before the receiver can see it, so that it can detach it */
+	pthread_mutex_lock(&peer_lock);
+	conn->sock = sock;
+	pthread_mutex_unlock(&peer_lock);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = sock;
+	if (epoll_ctl(peer_efd, EPOLL_CTL_ADD, fd, &ev)) {
+		eprintf("failed to add epoll event: %m\n");
+		pthread_mutex_lock(&peer_lock);
+		conn->sock = NULL;
+		pthread_mutex_unlock(&peer_lock);
+		close(fd);
+		free(sock);
+		goto fail;
+	}
+
+	conn->backoff = 0;
+	conn->retry_time = 0;
+
+	return 0;
+fail:
+	if (conn->backoff)
+		conn->backoff = min(conn->backoff * 2, PEER_MAX_BACKOFF);
+	else
+		conn->backoff = PEER_MIN_BACKOFF;
+	conn->retry_time = now + conn->backoff;
+
+	return -1;
+}
+
+/*
+ * Put the request on the inflight list of the socket of the connection,
+ * and return the socket with a reference held, or NULL if there is none.
+ */
+static struct peer_sock *attach_req(struct peer_conn *conn,
+				    struct peer_req *req)
+{
+	struct peer_sock *sock;
+
+	pthread_mutex_lock(&peer_lock);
+	sock = conn->sock;
+	if (sock) {
+		__sync_add_and_fetch(&sock->refcnt, 1);
+		req->id = conn->next_id++;
+		req->sock = sock;
+		req->state = PEER_REQ_INFLIGHT;
+		list_add_tail(&req->list, &sock->inflight);
+	}
+	pthread_mutex_unlock(&peer_lock);
+
+	return sock;
+}
+
+/*
+ * Send a request to the peer.  Up to rlen bytes of the response data are
+ * received in rbuf.  Returns NULL on network errors.
+ */
+struct peer_req *peer_send_req(uint8_t *addr, uint16_t port,
+			       struct sd_req *hdr, void *data, unsigned wlen,
+			       void *rbuf, unsigned rlen)
+{
+	struct peer_conn *conn;
+	struct peer_sock *sock;
+	struct peer_req *req;
+
+	pthread_once(&peer_once, init_peer_pool);
+
+	conn = get_conn(addr, port);
+
+	req = zalloc(sizeof(*req));
+	if (!req)
+		panic("failed to allocate memory\n");
+	req->rbuf = rbuf;
+	req->rlen = rlen;
+
+	pthread_mutex_lock(&conn->send_lock);
+	sock = attach_req(conn, req);
+	if (!sock && connect_peer(conn) == 0)
+		sock = attach_req(conn, req);
+	if (!sock) {
+		pthread_mutex_unlock(&conn->send_lock);
+		free(req);
+		return NULL;
+	}
+
+	hdr->id = req->id;
+	if (send_req(sock->fd, hdr, data, &wlen)) {
+		pthread_mutex_unlock(&conn->send_lock);
+		/* let the receiver fail the other requests and close it */
+		peer_cancel_req(req, 1);
+		put_sock(sock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&conn->send_lock);
+	put_sock(sock);
+
+	return req;
+}
+
+/* the realtime clock timeout milliseconds from now */
+static void get_deadline(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Wait until one of the requests completes.  Returns its index, or -1
+ * if none completes within timeout milliseconds.  In an async work, the
+ * worker thread is yielded to other works meanwhile.
+ */
+int peer_wait_req(struct peer_req **reqs, int nr, int timeout)
+{
+	struct async_waiter waiter;
+	struct timespec deadline;
+	int i, ret = 0;
+
+	get_deadline(&deadline, timeout);
+
+	pthread_mutex_lock(&peer_lock);
+	for (;;) {
+		for (i = 0; i < nr; i++)
+			if (reqs[i]->state == PEER_REQ_DONE)
+				goto out;
+
+		if (ret == ETIMEDOUT) {
+			i = -1;
+			goto out;
+		}
+
+		if (!in_async_work()) {
+			ret = pthread_cond_timedwait(&peer_cond, &peer_lock,
+						     &deadline);
+			continue;
+		}
+
+		/*
+		 * Prepare only while no request points to the waiter, so
+		 * that a late wakeup from the last wait can't be taken for
+		 * this one.
+		 */
+		async_wait_prepare(&waiter, &deadline);
+		for (i = 0; i < nr; i++)
+			reqs[i]->waiter = &waiter;
+		pthread_mutex_unlock(&peer_lock);
+
+		if (async_wait(&waiter) < 0)
+			ret = ETIMEDOUT;
+
+		pthread_mutex_lock(&peer_lock);
+		for (i = 0; i < nr; i++)
+			reqs[i]->waiter = NULL;
+	}
+out:
+	pthread_mutex_unlock(&peer_lock);
+
+	return i;
+}
+
+/*
+ * Free a completed request and return SD_RES_SUCCESS with the response
+ * in rsp, or SD_RES_NETWORK_ERROR.
+ */
+int peer_finish_req(struct peer_req *req, struct sd_rsp *rsp)
+{
+	int ret = req->result;
+
+	if (ret == SD_RES_SUCCESS && rsp)
+		memcpy(rsp, &req->rsp, sizeof(*rsp));
+	free(req);
+
+	return ret;
+}
+
+/*
+ * Drop a request we are no longer interested in.  Its response will be
+ * discarded.  If fatal, the connection is considered broken and closed.
+ *
+ * A response being received is written to the buffer of the caller, so
+ * that is waited out.  If the peer stalls meanwhile, its connection is
+ * closed too.
+ */
+void peer_cancel_req(struct peer_req *req, int fatal)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock(&peer_lock);
+	if (fatal && req->state != PEER_REQ_DONE)
+		shutdown(req->sock->fd, SHUT_RDWR);
+
+	get_deadline(&deadline, DEFAULT_SOCKET_TIMEOUT * 1000);
+	while (req->state == PEER_REQ_RECEIVING) {
+		if (fatal) {
+			pthread_cond_wait(&peer_cond, &peer_lock);
+			continue;
+		}
+		if (pthread_cond_timedwait(&peer_cond, &peer_lock,
+					   &deadline) == ETIMEDOUT) {
+			shutdown(req->sock->fd, SHUT_RDWR);
+			fatal = 1;
+		}
+	}
+
+	if (req->state == PEER_REQ_INFLIGHT) {
+		req->cancelled = 1;
+		req = NULL;
+	}
+	pthread_mutex_unlock(&peer_lock);
+
+	free(req);
+}
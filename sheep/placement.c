@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Placement drivers map an object to the vnodes which store its replicas.
+ * The driver is chosen when the cluster is formatted and is recorded in
+ * the cluster config, so every node places objects in the same way.
+ *
+ *   ring      : the consistent hash ring with the FNV-1a hash of the oid
+ *   fast-ring : the same ring, but hashing the oid a word at a time
+ *   straw2    : weighted rendezvous hashing over nodes, where the weight of
+ *               a node is its number of vnodes.  It balances better than
+ *               the ring and, on membership change, only moves objects from
+ *               or to the nodes which left or joined.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "sheep_priv.h"
+
+LIST_HEAD(placement_drivers);
+
+/* the finalizer of MurmurHash3, which mixes a 64 bit word at once */
+static inline uint64_t fmix_64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static int ring_hval_to_vnodes(struct sd_vnode *entries, int nr_entries,
+			       uint64_t hval, int nr_copies, int *idxs)
+{
+	int i, base;
+
+	base = hval_to_sheep(entries, nr_entries, hval, 0);
+	for (i = 0; i < nr_copies; i++)
+		idxs[i] = get_nth_node(entries, nr_entries, base, i);
+
+	return nr_copies;
+}
+
+static int ring_obj_to_vnodes(struct sd_vnode *entries, int nr_entries,
+			      uint64_t oid, int nr_copies, int *idxs)
+{
+	uint64_t hval = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+
+	return ring_hval_to_vnodes(entries, nr_entries, hval, nr_copies, idxs);
+}
+
+static int fast_ring_obj_to_vnodes(struct sd_vnode *entries, int nr_entries,
+				   uint64_t oid, int nr_copies, int *idxs)
+{
+	return ring_hval_to_vnodes(entries, nr_entries, fmix_64(oid),
+				   nr_copies, idxs);
+}
+
+static int conflicts_with(struct sd_vnode *entries, int idx, int *idxs, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (conflict_vnodes(entries, idx, idxs[i]))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Each node draws ln(u) / weight, where u is a uniform hash of the object
+ * and the node in (0, 1], and the nodes with the longest straws store the
+ * replicas.  Nodes in the same zone as an already selected one are skipped.
+ */
+static int straw2_obj_to_vnodes(struct sd_vnode *entries, int nr_entries,
+				uint64_t oid, int nr_copies, int *idxs)
+{
+	double draws[SD_MAX_NODES];
+	uint64_t hoid = fmix_64(oid), h;
+	int i, j, nr, best;
+
+	for (nr = 0; nr < nr_entries && entries[nr].node_weight; nr++) {
+		h = fmix_64(hoid ^ entries[entries[nr].node_vnode].id);
+		draws[nr] = log((double)((h >> 11) + 1) / (1ULL << 53)) /
+			entries[nr].node_weight;
+	}
+
+	for (i = 0; i < nr_copies; i++) {
+		best = -1;
+		for (j = 0; j < nr; j++) {
+			if (best >= 0 && draws[j] <= draws[best])
+				continue;
+
+			if (conflicts_with(entries, entries[j].node_vnode,
+					   idxs, i))
+				continue;
+
+			best = j;
+		}
+		if (best < 0)
+			break;
+
+		idxs[i] = entries[best].node_vnode;
+	}
+
+	return i;
+}
+
+static struct placement_driver placement_ring = {
+	.name = "ring",
+	.obj_to_vnodes = ring_obj_to_vnodes,
+};
+
+static struct placement_driver placement_fast_ring = {
+	.name = "fast-ring",
+	.obj_to_vnodes = fast_ring_obj_to_vnodes,
+};
+
+static struct placement_driver placement_straw2 = {
+	.name = "straw2",
+	.obj_to_vnodes = straw2_obj_to_vnodes,
+};
+
+add_placement_driver(placement_ring);
+add_placement_driver(placement_fast_ring);
+add_placement_driver(placement_straw2);
+
+struct placement_driver *sd_placement = &placement_ring;
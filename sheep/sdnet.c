@@ -11,11 +11,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 
 #include "sheep_priv.h"
 
@@ -38,7 +43,7 @@ void resume_pending_requests(void)
 int is_access_local(struct sd_vnode *e, int nr_nodes,
 		    uint64_t oid, int copies)
 {
-	int i, n;
+	int i, n, idxs[SD_MAX_REDUNDANCY];
 
 	if (oid == 0)
 		return 0;
@@ -46,8 +51,9 @@ int is_access_local(struct sd_vnode *e, int nr_nodes,
 	if (copies > nr_nodes)
 		copies = nr_nodes;
 
+	copies = obj_to_vnodes(e, nr_nodes, oid, copies, idxs);
 	for (i = 0; i < copies; i++) {
-		n = obj_to_sheep(e, nr_nodes, oid, i);
+		n = idxs[i];
 
 		if (is_myself(e[n].addr, e[n].port))
 			return 1;
@@ -61,6 +67,10 @@ static void setup_access_to_local_objects(struct request *req)
 	struct sd_obj_req *hdr = (struct sd_obj_req *)&req->rq;
 	int copies;
 
+	/* a vectored request is busy on its segments, see objs_req_has_oid() */
+	if (is_vectored_op(req->op))
+		return;
+
 	if (hdr->flags & SD_FLAG_CMD_IO_LOCAL) {
 		req->local_oid = hdr->oid;
 		return;
@@ -163,8 +173,18 @@ done:
 	resume_pending_requests();
 	resume_recovery_work();
 
-	if (!again)
+	if (!again) {
+		if (!(req->rq.flags & SD_FLAG_CMD_RECOVERY)) {
+			struct timespec end;
+
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			add_foreground_latency(
+				(end.tv_sec - req->start.tv_sec) * 1000000 +
+				(end.tv_nsec - req->start.tv_nsec) / 1000);
+		}
+		finish_coalesced_writes(req);
 		req->done(req);
+	}
 }
 
 static void local_op_done(struct work *work)
@@ -279,52 +299,338 @@ done:
 
 static void client_incref(struct client_info *ci);
 static void client_decref(struct client_info *ci);
+static void unblock_conns(struct net_thread *nt);
+
+/*
+ * The clients are served by the main thread, or by sys->nr_net_threads
+ * network threads, each with its own event loop and its own listening
+ * socket on the port.  A network thread receives the requests and sends
+ * the responses, but hands the requests over to the main thread to be
+ * dispatched, so they are still serialized with the membership events
+ * on the cpg event queue.  The completed requests are handed back to the
+ * thread of the client.
+ */
+struct net_thread {
+	pthread_t thread;
+	int efd;
+
+	/* the requests completed by the main thread */
+	pthread_mutex_t lock;
+	struct list_head done_reqs;
+
+	/* blocked until the outstanding data is small enough again */
+	struct list_head blocking_conns;
+	int blocked;
+
+	struct list_head free_pipes;
+	int nr_free_pipes;
+};
+
+static struct net_thread main_net_thread;
+static struct net_thread *net_threads;
+static __thread struct net_thread *this_net_thread;
+
+/* the requests received by the network threads */
+static int new_reqs_efd;
+static pthread_mutex_t new_reqs_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(new_reqs);
+
+/*
+ * The replica reads whose data is still being sent from the object file.
+ * They are done before it is sent, so their objects are kept busy until
+ * then, or a write could change the data under sendfile().
+ */
+static int sendfile_efd;
+static pthread_mutex_t sendfile_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(sendfile_reqs);
+
+/* called in the worker thread which read the object */
+void add_sendfile_req(struct request *req)
+{
+	pthread_mutex_lock(&sendfile_lock);
+	list_add_tail(&req->sendfile_list, &sendfile_reqs);
+	pthread_mutex_unlock(&sendfile_lock);
+}
+
+/* called in the thread of the client when the data is sent */
+static void del_sendfile_req(struct request *req)
+{
+	pthread_mutex_lock(&sendfile_lock);
+	list_del(&req->sendfile_list);
+	pthread_mutex_unlock(&sendfile_lock);
+
+	eventfd_write(sendfile_efd, 1);
+}
+
+int is_sending_obj(uint64_t oid)
+{
+	struct request *req;
+	int ret = 0;
+
+	pthread_mutex_lock(&sendfile_lock);
+	list_for_each_entry(req, &sendfile_reqs, sendfile_list) {
+		if (((struct sd_obj_req *)&req->rq)->oid == oid) {
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sendfile_lock);
+
+	return ret;
+}
+
+static void sendfile_done_handler(int fd, int events, void *data)
+{
+	eventfd_t value;
+
+	eventfd_read(fd, &value);
+	resume_pending_requests();
+}
+
+/*
+ * The data of a large local write is spliced from the socket into a pipe
+ * and from the pipe into the object file, so it is never copied to user
+ * space.  Free pipes are kept for reuse by each network thread.
+ */
+#define SPLICE_MIN_SIZE (64 * 1024)
+#define NR_FREE_PIPES 64
+
+/* the size the pipes are resized to, or -1 if we can't splice */
+static int pipe_size;
+
+static int can_splice(struct sd_req *hdr)
+{
+	struct sd_obj_req *obj_hdr = (struct sd_obj_req *)hdr;
+
+	if (hdr->opcode != SD_OP_WRITE_OBJ &&
+	    hdr->opcode != SD_OP_CREATE_AND_WRITE_OBJ)
+		return 0;
+
+	/* the chained, copy-on-write and journaled writes need the data */
+	if (!(hdr->flags & SD_FLAG_CMD_IO_LOCAL) ||
+	    hdr->flags & (SD_FLAG_CMD_CHAIN | SD_FLAG_CMD_COW) ||
+	    is_vdi_obj(obj_hdr->oid))
+		return 0;
+
+	return hdr->data_length >= SPLICE_MIN_SIZE &&
+		hdr->data_length <= SD_DATA_OBJ_SIZE;
+}
+
+/*
+ * Unprivileged processes can't resize pipes beyond pipe-max-size, so the
+ * size is found out with a pipe at startup, and larger writes aren't
+ * spliced.
+ */
+static void init_pipe_size(void)
+{
+	int fd[2], size;
+
+	if (pipe(fd) < 0) {
+		eprintf("failed to create a pipe, not splicing: %m\n");
+		pipe_size = -1;
+		return;
+	}
+
+	for (size = SD_DATA_OBJ_SIZE; size >= SPLICE_MIN_SIZE; size /= 2)
+		if (fcntl(fd[0], F_SETPIPE_SZ, size) >= size)
+			break;
+
+	close(fd[0]);
+	close(fd[1]);
+
+	if (size < SPLICE_MIN_SIZE) {
+		eprintf("failed to resize a pipe, not splicing: %m\n");
+		pipe_size = -1;
+		return;
+	}
+
+	pipe_size = size;
+}
+
+/*
+ * The data of a large local read is left in the object file and sent from
+ * there with sendfile().
+ */
+static int can_sendfile(struct sd_req *hdr)
+{
+	return hdr->opcode == SD_OP_READ_OBJ &&
+		hdr->flags & SD_FLAG_CMD_IO_LOCAL &&
+		!(hdr->flags & SD_FLAG_CMD_SPARSE) &&
+		hdr->data_length >= SPLICE_MIN_SIZE;
+}
+
+static struct data_pipe *get_data_pipe(unsigned len)
+{
+	struct net_thread *nt = this_net_thread;
+	struct data_pipe *p;
+
+	if (pipe_size < 0 || len > pipe_size)
+		return NULL;
+
+	if (!list_empty(&nt->free_pipes)) {
+		p = list_first_entry(&nt->free_pipes, struct data_pipe, list);
+		list_del(&p->list);
+		nt->nr_free_pipes--;
+		return p;
+	}
+
+	p = zalloc(sizeof(*p));
+	if (!p)
+		return NULL;
+
+	if (pipe(p->fd) < 0) {
+		eprintf("failed to create a pipe: %m\n");
+		free(p);
+		return NULL;
+	}
+
+	if (fcntl(p->fd[0], F_SETPIPE_SZ, pipe_size) < pipe_size) {
+		close(p->fd[0]);
+		close(p->fd[1]);
+		free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+static void put_data_pipe(struct data_pipe *p)
+{
+	struct net_thread *nt = this_net_thread;
+	int len;
+
+	/* a pipe with data left in it can't be reused */
+	if (nt->nr_free_pipes < NR_FREE_PIPES &&
+	    ioctl(p->fd[0], FIONREAD, &len) == 0 && !len) {
+		list_add(&p->list, &nt->free_pipes);
+		nt->nr_free_pipes++;
+		return;
+	}
+
+	close(p->fd[0]);
+	close(p->fd[1]);
+	free(p);
+}
+
+/*
+ * The limit of the outstanding data is of all the threads, so the data
+ * freed by one wakes up the connections blocked by the others.
+ */
+static void wake_blocked_threads(void)
+{
+	int i;
+
+	if (main_net_thread.blocked)
+		eventfd_write(main_net_thread.efd, 1);
+
+	for (i = 0; i < sys->nr_net_threads; i++)
+		if (net_threads[i].blocked)
+			eventfd_write(net_threads[i].efd, 1);
+}
+
+/*
+ * Every change of the outstanding data goes through here, so that the
+ * one which brings it below the limit wakes up the blocked threads.
+ */
+void add_outstanding_data(int len)
+{
+	unsigned size;
+
+	size = __sync_add_and_fetch(&sys->outstanding_data_size, len);
+	if (len < 0 && size < MAX_OUTSTANDING_DATA_SIZE &&
+	    size - len >= MAX_OUTSTANDING_DATA_SIZE)
+		wake_blocked_threads();
+}
 
-static struct request *alloc_request(struct client_info *ci, int data_length)
+static struct request *alloc_request(struct client_info *ci, int data_length,
+				     struct data_pipe *pipe)
 {
 	struct request *req;
 
-	req = zalloc(sizeof(struct request));
+	req = zalloc_buffer(sizeof(struct request));
 	if (!req)
 		return NULL;
 
 	req->ci = ci;
 	client_incref(ci);
-	if (data_length) {
-		req->data_length = data_length;
-		req->data = valloc(data_length);
+	req->data_length = data_length;
+	if (pipe)
+		req->pipe = pipe;
+	else if (data_length && !can_sendfile(&ci->conn.rx_hdr)) {
+		req->data = alloc_buffer(data_length);
 		if (!req->data) {
-			free(req);
+			free_buffer(req, sizeof(struct request));
 			return NULL;
 		}
 	}
 
 	list_add(&req->r_siblings, &ci->reqs);
 	INIT_LIST_HEAD(&req->r_wlist);
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
 
-	sys->nr_outstanding_reqs++;
-	sys->outstanding_data_size += data_length;
+	__sync_add_and_fetch(&sys->nr_outstanding_reqs, 1);
+	add_outstanding_data(data_length);
 
 	return req;
 }
 
+/*
+ * A pipe holds as many buffers as pages, so it can fill up before the
+ * data fits if the socket hands over partial pages.
+ */
+static int pipe_is_full(struct connection *conn)
+{
+	int len;
+
+	return ioctl(conn->fd, FIONREAD, &len) == 0 && len > 0;
+}
+
+/* move the data received so far from the pipe into a buffer */
+static int unsplice_request(struct request *req, struct connection *conn)
+{
+	unsigned done = req->data_length - conn->rx_length;
+
+	dprintf("the pipe is full, receiving into a buffer\n");
+
+	req->data = alloc_buffer(req->data_length);
+	if (!req->data)
+		return -1;
+
+	if (xread(req->pipe->fd[0], req->data, done) != done)
+		return -1;
+
+	put_data_pipe(req->pipe);
+	req->pipe = NULL;
+	conn->rx_buf = (char *)req->data + done;
+
+	return 0;
+}
+
 static void free_request(struct request *req)
 {
-	sys->nr_outstanding_reqs--;
-	sys->outstanding_data_size -= req->data_length;
+	__sync_sub_and_fetch(&sys->nr_outstanding_reqs, 1);
+	add_outstanding_data(-(int)req->data_length);
 
 	list_del(&req->r_siblings);
 	free_ordered_sd_vnode_list(req->entry);
-	free(req->data);
-	free(req);
+	if (req->pipe)
+		put_data_pipe(req->pipe);
+	if (req->file_fd) {
+		close(req->file_fd);
+		del_sendfile_req(req);
+	}
+	free_buffer(req->data, req->data_length);
+	free_buffer(req, sizeof(struct request));
 }
 
-static void req_done(struct request *req)
+/* called in the thread of the client */
+static void client_req_done(struct request *req)
 {
 	int dead = 0;
 	struct client_info *ci = req->ci;
 
-	if (conn_tx_on(&ci->conn)) {
+	/* the responses which complete together go out together */
+	if (!(ci->conn.events & EPOLLOUT) && conn_tx_on(&ci->conn)) {
 		dprintf("connection seems to be dead\n");
 		dead = 1;
 	} else
@@ -336,6 +642,79 @@ static void req_done(struct request *req)
 	client_decref(ci);
 }
 
+static void req_done(struct request *req)
+{
+	struct net_thread *nt = req->ci->net;
+
+	/* the vnode lists belong to the main thread */
+	free_ordered_sd_vnode_list(req->entry);
+	req->entry = NULL;
+
+	if (nt == &main_net_thread) {
+		client_req_done(req);
+		return;
+	}
+
+	pthread_mutex_lock(&nt->lock);
+	list_add_tail(&req->r_wlist, &nt->done_reqs);
+	pthread_mutex_unlock(&nt->lock);
+
+	eventfd_write(nt->efd, 1);
+}
+
+static void done_reqs_handler(int fd, int events, void *data)
+{
+	struct net_thread *nt = data;
+	struct request *req, *n;
+	eventfd_t value;
+	LIST_HEAD(list);
+
+	eventfd_read(fd, &value);
+
+	pthread_mutex_lock(&nt->lock);
+	list_splice_init(&nt->done_reqs, &list);
+	pthread_mutex_unlock(&nt->lock);
+
+	list_for_each_entry_safe(req, n, &list, r_wlist) {
+		list_del(&req->r_wlist);
+		client_req_done(req);
+	}
+
+	unblock_conns(nt);
+}
+
+static void submit_request(struct request *req)
+{
+	if (req->ci->net == &main_net_thread) {
+		queue_request(req);
+		return;
+	}
+
+	pthread_mutex_lock(&new_reqs_lock);
+	list_add_tail(&req->r_wlist, &new_reqs);
+	pthread_mutex_unlock(&new_reqs_lock);
+
+	eventfd_write(new_reqs_efd, 1);
+}
+
+static void new_reqs_handler(int fd, int events, void *data)
+{
+	struct request *req, *n;
+	eventfd_t value;
+	LIST_HEAD(list);
+
+	eventfd_read(fd, &value);
+
+	pthread_mutex_lock(&new_reqs_lock);
+	list_splice_init(&new_reqs, &list);
+	pthread_mutex_unlock(&new_reqs_lock);
+
+	list_for_each_entry_safe(req, n, &list, r_wlist) {
+		list_del_init(&req->r_wlist);
+		queue_request(req);
+	}
+}
+
 static void init_rx_hdr(struct client_info *ci)
 {
 	ci->conn.c_rx_state = C_IO_HEADER;
@@ -344,31 +723,115 @@ static void init_rx_hdr(struct client_info *ci)
 	ci->conn.rx_buf = &ci->conn.rx_hdr;
 }
 
-static void client_rx_handler(struct client_info *ci)
+/*
+ * Pipelined requests are read into the cache of the client as many as
+ * have arrived, and parsed from there.  Only the large payloads are read
+ * directly into their buffers.
+ */
+#define RX_CACHE_SIZE (64 * 1024)
+#define RX_DIRECT_SIZE (16 * 1024)
+
+static inline int rx_cached(struct client_info *ci)
+{
+	return ci->rx_cache_end - ci->rx_cache_start;
+}
+
+/* like rx(), but takes the data from the cache first */
+static int client_rx(struct client_info *ci, enum conn_state next_state)
+{
+	struct connection *conn = &ci->conn;
+	int len;
+
+	if (!rx_cached(ci)) {
+		if (conn->rx_length >= RX_DIRECT_SIZE)
+			return rx(conn, next_state);
+
+		len = read(conn->fd, ci->rx_cache, RX_CACHE_SIZE);
+		if (len <= 0) {
+			if (!len || errno != EAGAIN)
+				conn->c_rx_state = C_IO_CLOSED;
+			return 0;
+		}
+		ci->rx_cache_start = 0;
+		ci->rx_cache_end = len;
+	}
+
+	len = min(conn->rx_length, rx_cached(ci));
+	memcpy(conn->rx_buf, ci->rx_cache + ci->rx_cache_start, len);
+	ci->rx_cache_start += len;
+	conn->rx_length -= len;
+	conn->rx_buf = (char *)conn->rx_buf + len;
+
+	if (!conn->rx_length)
+		conn->c_rx_state = next_state;
+	else if (conn->rx_length >= RX_DIRECT_SIZE)
+		len += rx(conn, next_state);
+
+	return len;
+}
+
+/* like rx_splice(), but writes the data in the cache into the pipe first */
+static int client_rx_splice(struct client_info *ci, int pipe,
+			    enum conn_state next_state)
+{
+	struct connection *conn = &ci->conn;
+	int len;
+
+	if (!rx_cached(ci))
+		return rx_splice(conn, pipe, next_state);
+
+	len = min(conn->rx_length, rx_cached(ci));
+	if (xwrite(pipe, ci->rx_cache + ci->rx_cache_start, len) != len) {
+		conn->c_rx_state = C_IO_CLOSED;
+		return 0;
+	}
+	ci->rx_cache_start += len;
+	conn->rx_length -= len;
+
+	if (!conn->rx_length)
+		conn->c_rx_state = next_state;
+
+	return len;
+}
+
+/* returns 0 if a complete request was received */
+static int client_rx_request(struct client_info *ci)
 {
 	int ret;
 	uint64_t data_len;
 	struct connection *conn = &ci->conn;
 	struct sd_req *hdr = &conn->rx_hdr;
 	struct request *req;
+	struct data_pipe *pipe;
 
-	if (!ci->rx_req && sys->outstanding_data_size > MAX_OUTSTANDING_DATA_SIZE) {
+	/* the requests read ahead are parsed, or nobody would wake us up */
+	if (!ci->rx_req && !rx_cached(ci) &&
+	    sys->outstanding_data_size > MAX_OUTSTANDING_DATA_SIZE) {
 		dprintf("too many requests (%p)\n", &ci->conn);
 		conn_rx_off(&ci->conn);
-		list_add(&ci->conn.blocking_siblings, &sys->blocking_conn_list);
-		return;
+		list_add(&ci->conn.blocking_siblings, &ci->net->blocking_conns);
+		/* pairs with free_request(), which frees and then looks */
+		__sync_fetch_and_or(&ci->net->blocked, 1);
+		unblock_conns(ci->net);
+		return -1;
 	}
 
 	switch (conn->c_rx_state) {
 	case C_IO_HEADER:
-		ret = rx(conn, C_IO_DATA_INIT);
+		ret = client_rx(ci, C_IO_DATA_INIT);
 		if (!ret || conn->c_rx_state != C_IO_DATA_INIT)
 			break;
 	case C_IO_DATA_INIT:
 		data_len = hdr->data_length;
 
-		req = alloc_request(ci, data_len);
+		pipe = NULL;
+		if (can_splice(hdr))
+			pipe = get_data_pipe(data_len);
+
+		req = alloc_request(ci, data_len, pipe);
 		if (!req) {
+			if (pipe)
+				put_data_pipe(pipe);
 			conn->c_rx_state = C_IO_CLOSED;
 			break;
 		}
@@ -386,19 +849,32 @@ static void client_rx_handler(struct client_info *ci)
 			break;
 		}
 	case C_IO_DATA:
-		ret = rx(conn, C_IO_END);
+		if (ci->rx_req->pipe) {
+			ret = client_rx_splice(ci, ci->rx_req->pipe->fd[1],
+					       C_IO_END);
+			if (ret || conn->c_rx_state != C_IO_DATA ||
+			    !pipe_is_full(conn))
+				break;
+
+			if (unsplice_request(ci->rx_req, conn) < 0) {
+				conn->c_rx_state = C_IO_CLOSED;
+				break;
+			}
+		}
+		ret = client_rx(ci, C_IO_END);
 		break;
 	default:
 		eprintf("bug: unknown state %d\n", conn->c_rx_state);
 	}
 
-	if (is_conn_dead(conn) && ci->rx_req) {
-		free_request(ci->rx_req);
-		return;
+	if (is_conn_dead(conn)) {
+		if (ci->rx_req)
+			free_request(ci->rx_req);
+		return -1;
 	}
 
 	if (conn->c_rx_state != C_IO_END)
-		return;
+		return -1;
 
 	/* now we have a complete command */
 
@@ -413,91 +889,134 @@ static void client_rx_handler(struct client_info *ci)
 
 	req->done = req_done;
 
-	queue_request(req);
+	submit_request(req);
+
+	return 0;
 }
 
-static void init_tx_hdr(struct client_info *ci)
+static void client_rx_handler(struct client_info *ci)
 {
-	struct sd_rsp *rsp = (struct sd_rsp *)&ci->conn.tx_hdr;
-	struct request *req;
-
-	if (ci->tx_req || list_empty(&ci->done_reqs))
-		return;
+	while (client_rx_request(ci) == 0 && rx_cached(ci))
+		;
+}
 
-	memset(rsp, 0, sizeof(*rsp));
+static void unblock_conns(struct net_thread *nt)
+{
+	struct connection *conn, *n;
 
-	req = list_first_entry(&ci->done_reqs, struct request, r_wlist);
-	list_del(&req->r_wlist);
+	if (sys->outstanding_data_size >= MAX_OUTSTANDING_DATA_SIZE)
+		return;
 
-	ci->tx_req = req;
-	ci->conn.tx_length = sizeof(*rsp);
-	ci->conn.c_tx_state = C_IO_HEADER;
-	ci->conn.tx_buf = rsp;
+	__sync_fetch_and_and(&nt->blocked, 0);
+	list_for_each_entry_safe(conn, n, &nt->blocking_conns,
+				 blocking_siblings) {
+		dprintf("rx on %p\n", conn);
+		list_del(&conn->blocking_siblings);
+		conn_rx_on(conn);
+	}
+}
 
+static void init_tx_rsp(struct request *req, struct sd_rsp *rsp)
+{
 	/* use cpu_to_le */
 	memcpy(rsp, &req->rp, sizeof(*rsp));
 
 	rsp->epoch = sys->epoch;
 	rsp->opcode = req->rq.opcode;
 	rsp->id = req->rq.id;
+
+	/* a read to be sent with sendfile() which failed has no data */
+	if (!req->data && !req->file_fd)
+		rsp->data_length = 0;
+}
+
+/*
+ * Collect the completed requests into an iovec array of the headers and
+ * the data.  A request whose data is sent with sendfile() ends the batch.
+ */
+static void init_tx_batch(struct client_info *ci)
+{
+	struct sd_rsp *rsp;
+	struct request *req;
+	struct iovec *iov;
+
+	if (ci->nr_tx_reqs || list_empty(&ci->done_reqs))
+		return;
+
+	ci->nr_tx_iov = 0;
+	ci->tx_iov_cur = ci->tx_iov;
+
+	while (!list_empty(&ci->done_reqs) && ci->nr_tx_reqs < MAX_TX_BATCH) {
+		req = list_first_entry(&ci->done_reqs, struct request, r_wlist);
+		list_del(&req->r_wlist);
+
+		rsp = ci->tx_hdrs + ci->nr_tx_reqs;
+		ci->tx_reqs[ci->nr_tx_reqs++] = req;
+		init_tx_rsp(req, rsp);
+
+		iov = ci->tx_iov + ci->nr_tx_iov++;
+		iov->iov_base = rsp;
+		iov->iov_len = sizeof(*rsp);
+
+		if (!rsp->data_length)
+			continue;
+
+		if (req->file_fd) {
+			ci->tx_file_req = req;
+			ci->conn.tx_length = rsp->data_length;
+			break;
+		}
+
+		iov = ci->tx_iov + ci->nr_tx_iov++;
+		iov->iov_base = req->data;
+		iov->iov_len = rsp->data_length;
+	}
+
+	ci->conn.c_tx_state = C_IO_HEADER;
+}
+
+static void free_tx_batch(struct client_info *ci)
+{
+	while (ci->nr_tx_reqs)
+		free_request(ci->tx_reqs[--ci->nr_tx_reqs]);
+	ci->tx_file_req = NULL;
 }
 
 static void client_tx_handler(struct client_info *ci)
 {
-	int ret, opt;
-	struct sd_rsp *rsp = (struct sd_rsp *)&ci->conn.tx_hdr;
-	struct connection *conn, *n;
+	int ret;
+	struct request *req;
 again:
-	init_tx_hdr(ci);
-	if (!ci->tx_req) {
+	init_tx_batch(ci);
+	if (!ci->nr_tx_reqs) {
 		conn_tx_off(&ci->conn);
-		if (sys->outstanding_data_size < MAX_OUTSTANDING_DATA_SIZE) {
-			list_for_each_entry_safe(conn, n, &sys->blocking_conn_list,
-						 blocking_siblings) {
-				dprintf("rx on %p\n", conn);
-				list_del(&conn->blocking_siblings);
-				conn_rx_on(conn);
-			}
-		}
+		unblock_conns(ci->net);
 		return;
 	}
 
-	opt = 1;
-	setsockopt(ci->conn.fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
+	req = ci->tx_file_req;
 
 	switch (ci->conn.c_tx_state) {
 	case C_IO_HEADER:
-		ret = tx(&ci->conn, C_IO_DATA_INIT, 0);
-		if (!ret)
+		/* MSG_MORE holds the last header back for the sendfile data */
+		ret = tx_iov(&ci->conn, &ci->tx_iov_cur, &ci->nr_tx_iov,
+			     req ? C_IO_DATA : C_IO_END, req ? MSG_MORE : 0);
+		if (!ret || ci->conn.c_tx_state != C_IO_DATA)
 			break;
-
-		if (rsp->data_length) {
-			ci->conn.tx_length = rsp->data_length;
-			ci->conn.tx_buf = ci->tx_req->data;
-			ci->conn.c_tx_state = C_IO_DATA;
-		} else {
-			ci->conn.c_tx_state = C_IO_END;
-			break;
-		}
 	case C_IO_DATA:
-		ret = tx(&ci->conn, C_IO_END, 0);
-		if (!ret)
-			break;
+		tx_sendfile(&ci->conn, req->file_fd, &req->file_offset,
+			    C_IO_END);
 	default:
 		break;
 	}
 
-	opt = 0;
-	setsockopt(ci->conn.fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
-
 	if (is_conn_dead(&ci->conn)) {
-		free_request(ci->tx_req);
+		free_tx_batch(ci);
 		return;
 	}
 
 	if (ci->conn.c_tx_state == C_IO_END) {
-		free_request(ci->tx_req);
-		ci->tx_req = NULL;
+		free_tx_batch(ci);
 		goto again;
 	}
 }
@@ -505,6 +1024,7 @@ again:
 static void destroy_client(struct client_info *ci)
 {
 	close(ci->conn.fd);
+	free_buffer(ci->rx_cache, RX_CACHE_SIZE);
 	free(ci);
 }
 
@@ -528,9 +1048,16 @@ static struct client_info *create_client(int fd, struct cluster_info *cluster)
 	if (!ci)
 		return NULL;
 
+	ci->rx_cache = alloc_buffer(RX_CACHE_SIZE);
+	if (!ci->rx_cache) {
+		free(ci);
+		return NULL;
+	}
+
 	ci->conn.fd = fd;
 	ci->conn.events = EPOLLIN;
 	ci->refcnt = 1;
+	ci->net = this_net_thread;
 
 	INIT_LIST_HEAD(&ci->reqs);
 	INIT_LIST_HEAD(&ci->done_reqs);
@@ -612,9 +1139,138 @@ static int create_listen_port_fn(int fd, void *data)
 	return register_event(fd, listen_handler, data);
 }
 
+static void init_net_thread(struct net_thread *nt)
+{
+	pthread_mutex_init(&nt->lock, NULL);
+	INIT_LIST_HEAD(&nt->done_reqs);
+	INIT_LIST_HEAD(&nt->blocking_conns);
+	INIT_LIST_HEAD(&nt->free_pipes);
+}
+
+struct net_thread_arg {
+	struct net_thread *nt;
+	int port;
+	void *data;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int ret;
+};
+
+static void *net_thread_routine(void *arg)
+{
+	struct net_thread_arg *a = arg;
+	struct net_thread *nt = a->nt;
+	sigset_t set;
+	int ret;
+
+	/* the signals are for the main thread, e.g. of the local driver */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	this_net_thread = nt;
+
+	ret = init_event(EPOLL_SIZE);
+	if (!ret)
+		ret = register_event(nt->efd, done_reqs_handler, nt);
+	if (!ret)
+		ret = create_listen_ports(a->port, create_listen_port_fn,
+					  a->data, 1);
+
+	pthread_mutex_lock(&a->lock);
+	a->ret = ret;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	if (ret)
+		return NULL;
+
+	for (;;)
+		event_loop(-1);
+
+	return NULL;
+}
+
+static int start_net_thread(struct net_thread *nt, int port, void *data)
+{
+	struct net_thread_arg arg = {
+		.nt = nt,
+		.port = port,
+		.data = data,
+		.ret = -1,
+	};
+	int ret;
+
+	init_net_thread(nt);
+	nt->efd = eventfd(0, EFD_NONBLOCK);
+	if (nt->efd < 0) {
+		eprintf("failed to create an eventfd: %m\n");
+		return -1;
+	}
+
+	pthread_mutex_init(&arg.lock, NULL);
+	pthread_cond_init(&arg.cond, NULL);
+
+	pthread_mutex_lock(&arg.lock);
+	ret = pthread_create(&nt->thread, NULL, net_thread_routine, &arg);
+	if (ret) {
+		pthread_mutex_unlock(&arg.lock);
+		eprintf("failed to create a network thread: %s\n",
+			strerror(ret));
+		return -1;
+	}
+	pthread_cond_wait(&arg.cond, &arg.lock);
+	pthread_mutex_unlock(&arg.lock);
+
+	return arg.ret;
+}
+
 int create_listen_port(int port, void *data)
 {
-	return create_listen_ports(port, create_listen_port_fn, data);
+	int i;
+
+	init_pipe_size();
+
+	init_net_thread(&main_net_thread);
+	this_net_thread = &main_net_thread;
+
+	/* woken up by wake_blocked_threads() */
+	main_net_thread.efd = eventfd(0, EFD_NONBLOCK);
+	if (main_net_thread.efd < 0) {
+		eprintf("failed to create an eventfd: %m\n");
+		return 1;
+	}
+	if (register_event(main_net_thread.efd, done_reqs_handler,
+			   &main_net_thread))
+		return 1;
+
+	sendfile_efd = eventfd(0, EFD_NONBLOCK);
+	if (sendfile_efd < 0) {
+		eprintf("failed to create an eventfd: %m\n");
+		return 1;
+	}
+	if (register_event(sendfile_efd, sendfile_done_handler, NULL))
+		return 1;
+
+	if (!sys->nr_net_threads)
+		return create_listen_ports(port, create_listen_port_fn, data, 0);
+
+	new_reqs_efd = eventfd(0, EFD_NONBLOCK);
+	if (new_reqs_efd < 0) {
+		eprintf("failed to create an eventfd: %m\n");
+		return 1;
+	}
+	if (register_event(new_reqs_efd, new_reqs_handler, NULL))
+		return 1;
+
+	net_threads = zalloc(sizeof(*net_threads) * sys->nr_net_threads);
+	if (!net_threads)
+		return 1;
+
+	for (i = 0; i < sys->nr_net_threads; i++)
+		if (start_net_thread(net_threads + i, port, data))
+			return 1;
+
+	return 0;
 }
 
 int write_object(struct sd_vnode *e,
@@ -623,16 +1279,17 @@ int write_object(struct sd_vnode *e,
 		 uint64_t offset, uint16_t flags, int nr, int create)
 {
 	struct sd_obj_req hdr;
-	int i, n, fd, ret;
+	int i, n, fd, ret, idxs[SD_MAX_REDUNDANCY];
 	char name[128];
 
 	if (nr > zones)
 		nr = zones;
+	obj_to_vnodes(e, vnodes, oid, nr, idxs);
 
 	for (i = 0; i < nr; i++) {
 		unsigned rlen = 0, wlen = datalen;
 
-		n = obj_to_sheep(e, vnodes, oid, i);
+		n = idxs[i];
 
 		if (is_myself(e[n].addr, e[n].port)) {
 			ret = write_object_local(oid, data, datalen, offset,
@@ -689,13 +1346,15 @@ int read_object(struct sd_vnode *e,
 	struct sd_obj_rsp *rsp = (struct sd_obj_rsp *)&hdr;
 	char name[128];
 	int i = 0, n, fd, ret, last_error = SD_RES_SUCCESS;
+	int idxs[SD_MAX_REDUNDANCY];
 
 	if (nr > zones)
 		nr = zones;
+	obj_to_vnodes(e, vnodes, oid, nr, idxs);
 
 	/* search a local object first */
 	for (i = 0; i < nr; i++) {
-		n = obj_to_sheep(e, vnodes, oid, i);
+		n = idxs[i];
 
 		if (is_myself(e[n].addr, e[n].port)) {
 			ret = read_object_local(oid, data, datalen, offset, nr,
@@ -714,7 +1373,7 @@ int read_object(struct sd_vnode *e,
 	for (i = 0; i < nr; i++) {
 		unsigned wlen = 0, rlen = datalen;
 
-		n = obj_to_sheep(e, vnodes, oid, i);
+		n = idxs[i];
 
 		addr_to_str(name, sizeof(name), e[n].addr, 0);
 
@@ -758,15 +1417,16 @@ int remove_object(struct sd_vnode *e,
 	char name[128];
 	struct sd_obj_req hdr;
 	struct sd_obj_rsp *rsp = (struct sd_obj_rsp *)&hdr;
-	int i = 0, n, fd, ret;
+	int i = 0, n, fd, ret, idxs[SD_MAX_REDUNDANCY];
 
 	if (nr > zones)
 		nr = zones;
+	obj_to_vnodes(e, vnodes, oid, nr, idxs);
 
 	for (i = 0; i < nr; i++) {
 		unsigned wlen = 0, rlen = 0;
 
-		n = obj_to_sheep(e, vnodes, oid, i);
+		n = idxs[i];
 
 		addr_to_str(name, sizeof(name), e[n].addr, 0);
 
@@ -796,83 +1456,3 @@ int remove_object(struct sd_vnode *e,
 
 	return 0;
 }
-
-static __thread int cached_fds[SD_MAX_NODES];
-static __thread uint32_t cached_epoch = 0;
-
-void del_sheep_fd(int fd)
-{
-	int i;
-
-	for (i = 0; i < SD_MAX_NODES; i++) {
-		if (cached_fds[i] == fd) {
-			if (fd >= 0)
-				close(fd);
-
-			cached_fds[i] = -1;
-
-			return;
-		}
-	}
-}
-
-int get_sheep_fd(uint8_t *addr, uint16_t port, int node_idx, uint32_t epoch)
-{
-	int i, fd, ret;
-	char name[INET6_ADDRSTRLEN];
-
-	if (cached_epoch == 0) {
-		/* initialize */
-		for (i = 0; i < SD_MAX_NODES; i++)
-			cached_fds[i] = -1;
-
-		cached_epoch = epoch;
-	}
-
-	if (before(epoch, cached_epoch)) {
-		eprintf("requested epoch is smaller than the previous one: %d < %d\n",
-			epoch, cached_epoch);
-		return -1;
-	}
-	if (after(epoch, cached_epoch)) {
-		for (i = 0; i < SD_MAX_NODES; i++) {
-			if (cached_fds[i] >= 0)
-				close(cached_fds[i]);
-
-			cached_fds[i] = -1;
-		}
-		cached_epoch = epoch;
-	}
-
-	fd = cached_fds[node_idx];
-	dprintf("%d, %d\n", epoch, fd);
-
-	if (cached_epoch == epoch && fd >= 0) {
-		dprintf("using the cached fd %d\n", fd);
-		return fd;
-	}
-
-	addr_to_str(name, sizeof(name), addr, 0);
-
-	fd = connect_to(name, port);
-	if (fd < 0)
-		return -1;
-
-	ret = set_timeout(fd);
-	if (ret) {
-		eprintf("%m\n");
-		close(fd);
-		return -1;
-	}
-
-	ret = set_nodelay(fd);
-	if (ret) {
-		eprintf("%m\n");
-		close(fd);
-		return -1;
-	}
-
-	cached_fds[node_idx] = fd;
-
-	return fd;
-}
@@ -22,7 +22,6 @@
 
 #include "sheep_priv.h"
 
-#define EPOLL_SIZE 4096
 #define DEFAULT_OBJECT_DIR "/tmp"
 #define LOG_FILE_NAME "sheep.log"
 
@@ -38,11 +37,15 @@ static struct option const long_options[] = {
 	{"zone", required_argument, NULL, 'z'},
 	{"vnodes", required_argument, NULL, 'v'},
 	{"cluster", required_argument, NULL, 'c'},
+	{"hedge", required_argument, NULL, 'g'},
+	{"hugepages", no_argument, NULL, 'H'},
+	{"net-threads", required_argument, NULL, 'n'},
+	{"recovery-window", required_argument, NULL, 'R'},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, NULL, 0},
 };
 
-static const char *short_options = "p:fl:dDz:v:c:h";
+static const char *short_options = "p:fl:dDz:v:c:g:Hn:R:h";
 
 static void usage(int status)
 {
@@ -61,10 +64,18 @@ Options:\n\
   -D, --directio          use direct IO when accessing the object from object cache\n\
   -S, --sync              flush the object cache synchronously\n\
   -z, --zone              specify the zone id\n\
-  -v, --vnodes            specify the number of virtual nodes\n\
+  -v, --vnodes            specify the number of virtual nodes, or 'auto' to\n\
+                          derive it from the store capacity\n\
   -c, --cluster           specify the cluster driver\n\
+  -g, --hedge             send a gateway read also to another replica when the\n\
+                          first one is slower than this percentile of reads\n\
+  -H, --hugepages         back the large request and object buffers with\n\
+                          transparent huge pages\n\
+  -n, --net-threads       serve the clients with this many network threads\n\
+                          instead of the main thread\n\
+  -R, --recovery-window   recover this many objects at a time (default %d)\n\
   -h, --help              display this help and exit\n\
-", PACKAGE_VERSION, program_name);
+", PACKAGE_VERSION, program_name, DEFAULT_RECOVERY_WINDOW);
 	exit(status);
 }
 
@@ -95,12 +106,15 @@ int main(int argc, char **argv)
 	int log_level = SDOG_INFO;
 	char path[PATH_MAX];
 	int64_t zone = -1;
-	int nr_vnodes = SD_DEFAULT_VNODES;
+	int nr_vnodes = SD_DEFAULT_VNODES, auto_vnodes = 0;
+	int use_hugepages = 0;
 	char *p;
 	struct cluster_driver *cdrv;
 
 	signal(SIGPIPE, SIG_IGN);
 
+	sys->recovery_window = DEFAULT_RECOVERY_WINDOW;
+
 	while ((ch = getopt_long(argc, argv, short_options, long_options,
 				 &longindex)) >= 0) {
 		switch (ch) {
@@ -148,6 +162,10 @@ int main(int argc, char **argv)
 			sys->this_node.zone = zone;
 			break;
 		case 'v':
+			if (!strcmp(optarg, "auto")) {
+				auto_vnodes = 1;
+				break;
+			}
 			nr_vnodes = strtol(optarg, &p, 10);
 			if (optarg == p || nr_vnodes < 0 || SD_MAX_VNODES < nr_vnodes) {
 				fprintf(stderr, "Invalid number of virtual nodes '%s': "
@@ -170,6 +188,39 @@ int main(int argc, char **argv)
 
 			sys->cdrv_option = get_cdrv_option(sys->cdrv, optarg);
 			break;
+		case 'g':
+			sys->hedge_percentile = strtol(optarg, &p, 10);
+			if (optarg == p || sys->hedge_percentile < 1 ||
+			    sys->hedge_percentile > 99) {
+				fprintf(stderr, "Invalid hedge percentile '%s': "
+					"must be an integer between 1 and 99\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'H':
+			use_hugepages = 1;
+			break;
+		case 'n':
+			sys->nr_net_threads = strtol(optarg, &p, 10);
+			if (optarg == p || sys->nr_net_threads < 0 ||
+			    sys->nr_net_threads > MAX_NET_THREADS) {
+				fprintf(stderr, "Invalid number of network threads '%s': "
+					"must be an integer between 0 and %d\n",
+					optarg, MAX_NET_THREADS);
+				exit(1);
+			}
+			break;
+		case 'R':
+			sys->recovery_window = strtol(optarg, &p, 10);
+			if (optarg == p || sys->recovery_window < 1 ||
+			    sys->recovery_window > MAX_RECOVERY_WINDOW) {
+				fprintf(stderr, "Invalid recovery window '%s': "
+					"must be an integer between 1 and %d\n",
+					optarg, MAX_RECOVERY_WINDOW);
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage(0);
 			break;
@@ -197,10 +248,18 @@ int main(int argc, char **argv)
 	if (ret)
 		exit(1);
 
+	init_buffer_pool(use_hugepages);
+
 	ret = init_store(dir);
 	if (ret)
 		exit(1);
 
+	if (auto_vnodes) {
+		nr_vnodes = get_auto_vnodes();
+		if (nr_vnodes < 0)
+			exit(1);
+	}
+
 	ret = init_event(EPOLL_SIZE);
 	if (ret)
 		exit(1);
@@ -216,9 +275,12 @@ int main(int argc, char **argv)
 	}
 
 	sys->cpg_wqueue = init_work_queue(1);
-	sys->gateway_wqueue = init_work_queue(NR_GW_WORKER_THREAD);
-	sys->io_wqueue = init_work_queue(NR_IO_WORKER_THREAD);
-	sys->recovery_wqueue = init_work_queue(1);
+	sys->gateway_wqueue = init_async_work_queue(NR_GW_WORKER_THREAD);
+	if (init_uring() == 0)
+		sys->io_wqueue = init_async_work_queue(NR_IO_WORKER_THREAD);
+	else
+		sys->io_wqueue = init_work_queue(NR_IO_WORKER_THREAD);
+	sys->recovery_wqueue = init_work_queue(sys->recovery_window);
 	sys->deletion_wqueue = init_work_queue(1);
 	sys->flush_wqueue = init_work_queue(1);
 	if (!sys->cpg_wqueue || !sys->gateway_wqueue || !sys->io_wqueue ||
@@ -21,9 +21,11 @@
 #include "sheep.h"
 #include "cluster.h"
 #include "rbtree.h"
+#include "buffer.h"
 
 #define SD_OP_GET_OBJ_LIST   0xA1
 #define SD_OP_GET_EPOCH      0XA2
+#define SD_OP_GET_DIRTY_LIST 0xA3
 
 #define SD_STATUS_OK                0x00000001
 #define SD_STATUS_WAIT_FOR_FORMAT   0x00000002
@@ -33,6 +35,7 @@
 #define SD_STATUS_HALT              0x00000020
 
 #define SD_RES_NETWORK_ERROR    0x81 /* Network error between sheep */
+#define SD_RES_NO_DIRTY_LOG     0x82 /* No dirty object log of the epochs */
 
 enum cpg_event_type {
 	CPG_EVENT_JOIN,
@@ -49,12 +52,31 @@ struct cpg_event {
 	struct list_head cpg_event_list;
 };
 
+#define MAX_TX_BATCH 64
+
+struct net_thread;
+
 struct client_info {
 	struct connection conn;
+	/* the thread the client is served by */
+	struct net_thread *net;
 
 	struct request *rx_req;
 
-	struct request *tx_req;
+	/* the data read ahead of the request being received */
+	char *rx_cache;
+	int rx_cache_start;
+	int rx_cache_end;
+
+	/* the completed requests sent back with one sendmsg */
+	struct request *tx_reqs[MAX_TX_BATCH];
+	struct sd_rsp tx_hdrs[MAX_TX_BATCH];
+	struct iovec tx_iov[MAX_TX_BATCH * 2];
+	struct iovec *tx_iov_cur;
+	int nr_tx_reqs;
+	int nr_tx_iov;
+	/* the last one of them, whose data follows with sendfile */
+	struct request *tx_file_req;
 
 	struct list_head reqs;
 	struct list_head done_reqs;
@@ -66,6 +88,12 @@ struct request;
 
 typedef void (*req_end_t) (struct request *);
 
+/* a pipe holding the data of a write spliced from the socket */
+struct data_pipe {
+	int fd[2];
+	struct list_head list;
+};
+
 struct request {
 	struct cpg_event cev;
 	struct sd_req rq;
@@ -75,6 +103,11 @@ struct request {
 
 	void *data;
 	unsigned int data_length;
+	struct data_pipe *pipe;
+	/* if non-zero, the data of the response is sent from this file */
+	int file_fd;
+	off_t file_offset;
+	struct list_head sendfile_list;
 
 	struct client_info *ci;
 	struct list_head r_siblings;
@@ -88,6 +121,12 @@ struct request {
 	int nr_zones;
 	int check_consistency;
 
+	/* the client writes merged into this one */
+	struct list_head coalesced_list;
+	int nr_coalesced;
+
+	struct timespec start;	/* when the request was received */
+
 	req_end_t done;
 	struct work work;
 };
@@ -134,7 +173,6 @@ struct cluster_info {
 	struct list_head outstanding_req_list;
 	struct list_head req_wait_for_obj_list;
 	struct list_head consistent_obj_list;
-	struct list_head blocking_conn_list;
 
 	uint32_t nr_sobjs;
 	int nr_zones;
@@ -149,6 +187,10 @@ struct cluster_info {
 
 	int use_directio;
 	uint8_t sync_flush;
+	int hedge_percentile;
+	int nr_net_threads;
+	int recovery_window;	/* objects recovered at a time */
+	struct sd_recovery_throttle recovery_throttle;
 
 	struct work_queue *cpg_wqueue;
 	struct work_queue *gateway_wqueue;
@@ -156,6 +198,8 @@ struct cluster_info {
 	struct work_queue *deletion_wqueue;
 	struct work_queue *recovery_wqueue;
 	struct work_queue *flush_wqueue;
+	/* chained writes waiting for the replica at the next position */
+	struct work_queue *chain_wqueue[SD_MAX_REDUNDANCY - 1];
 };
 
 struct siocb {
@@ -163,6 +207,7 @@ struct siocb {
 	uint16_t flags;
 	uint32_t epoch;
 	void *buf;
+	int pipe; /* if non-zero, write the data from this pipe, not buf */
 	uint32_t length;
 	uint64_t offset;
 };
@@ -206,9 +251,60 @@ static inline struct store_driver *find_store_driver(const char *name)
 	return NULL;
 }
 
+struct placement_driver {
+	struct list_head list;
+	const char *name;
+	/*
+	 * Store the vnode indexes of the first nr_copies replicas of the
+	 * object into idxs, and return the number of them.
+	 */
+	int (*obj_to_vnodes)(struct sd_vnode *entries, int nr_entries,
+			     uint64_t oid, int nr_copies, int *idxs);
+};
+
+#define DEFAULT_PLACEMENT "ring"
+
+extern struct list_head placement_drivers;
+extern struct placement_driver *sd_placement;
+#define add_placement_driver(driver)                             \
+static void __attribute__((constructor)) add_ ## driver(void) {  \
+	list_add_tail(&driver.list, &placement_drivers);         \
+}
+
+static inline struct placement_driver *find_placement_driver(const char *name)
+{
+	struct placement_driver *driver;
+
+	list_for_each_entry(driver, &placement_drivers, list) {
+		if (strcmp(driver->name, name) == 0)
+			return driver;
+	}
+	return NULL;
+}
+
+static inline int obj_to_vnodes(struct sd_vnode *entries, int nr_entries,
+				uint64_t oid, int nr_copies, int *idxs)
+{
+	return sd_placement->obj_to_vnodes(entries, nr_entries, oid,
+					   nr_copies, idxs);
+}
+
+/* return the vnode index of the idx'th replica of the object */
+static inline int obj_to_vnode(struct sd_vnode *entries, int nr_entries,
+			       uint64_t oid, int idx)
+{
+	int idxs[SD_MAX_REDUNDANCY];
+
+	if (obj_to_vnodes(entries, nr_entries, oid, idx + 1, idxs) <= idx)
+		panic("bug"); /* not found */
+
+	return idxs[idx];
+}
+
 extern struct cluster_info *sys;
 
 int create_listen_port(int port, void *data);
+void add_outstanding_data(int len);
 
 int init_store(const char *dir);
 int init_base_path(const char *dir);
@@ -235,10 +331,13 @@ int get_ordered_sd_vnode_list(struct sd_vnode **entries,
 			      int *nr_vnodes, int *nr_zones);
 void free_ordered_sd_vnode_list(struct sd_vnode *entries);
 int is_access_to_busy_objects(uint64_t oid);
+int is_sending_obj(uint64_t oid);
+void add_sendfile_req(struct request *req);
 int is_access_local(struct sd_vnode *e, int nr_nodes,
 		    uint64_t oid, int copies);
 
 void resume_pending_requests(void);
+void finish_coalesced_writes(struct request *req);
 
 int create_cluster(int port, int64_t zone, int nr_vnodes);
 int leave_cluster(void);
@@ -251,6 +350,14 @@ int write_object_local(uint64_t oid, char *data, unsigned int datalen,
 int read_object_local(uint64_t oid, char *data, unsigned int datalen,
 		      uint64_t offset, int copies, uint32_t epoch);
 int forward_write_obj_req(struct request *req);
+int get_chain_pos(struct request *req, int *idxs, int *copies);
+int forward_chain_write(struct request *req, uint32_t epoch);
+void sort_read_replicas(struct sd_vnode *e, int *idxs, int nr);
+int read_remote_replicas(struct sd_vnode *e, int *idxs, int nr,
+			 struct sd_obj_req *hdr, void *data,
+			 struct sd_obj_rsp *rsp);
+void get_gateway_stat(struct sd_gateway_stat *stat);
+void account_gateway_writes(int nr_coalesced);
 
 int read_epoch(uint32_t *epoch, uint64_t *ctime,
 	       struct sd_node *entries, int *nr_entries);
@@ -265,17 +372,30 @@ int set_cluster_flags(uint16_t flags);
 int get_cluster_flags(uint16_t *flags);
 int set_cluster_store(const uint8_t *name);
 int get_cluster_store(uint8_t *buf);
+int set_cluster_placement(const uint8_t *name);
+int get_cluster_placement(uint8_t *buf);
+int set_cluster_throttle(const struct sd_recovery_throttle *t);
+int get_cluster_throttle(struct sd_recovery_throttle *t);
 
 int store_create_and_write_obj(const struct sd_req *, struct sd_rsp *, void *);
 int store_write_obj(const struct sd_req *, struct sd_rsp *, void *);
 int store_read_obj(const struct sd_req *, struct sd_rsp *, void *);
 int store_remove_obj(const struct sd_req *, struct sd_rsp *, void *);
+int store_discard_obj(const struct sd_req *, struct sd_rsp *, void *);
+int store_objs(const struct sd_req *, struct sd_rsp *, void *);
 
 int store_file_write(void *buffer, size_t len);
 void *store_file_read(void);
 
 #define NR_GW_WORKER_THREAD 4
 #define NR_IO_WORKER_THREAD 4
+#define MAX_NET_THREADS 64
+#define DEFAULT_RECOVERY_WINDOW 8
+#define MAX_RECOVERY_WINDOW 64
+#define DIRTY_LOG_EPOCHS 8
+#define DIRTY_LIST_LEN (1U << 20)
+
+#define EPOLL_SIZE 4096
 
 int epoch_log_read(uint32_t epoch, char *buf, int len);
 int epoch_log_read_nr(uint32_t epoch, char *buf, int len);
@@ -285,13 +405,23 @@ int remove_epoch(int epoch);
 int set_cluster_ctime(uint64_t ctime);
 uint64_t get_cluster_ctime(void);
 int stat_sheep(uint64_t *store_size, uint64_t *store_free, uint32_t epoch);
+int get_auto_vnodes(void);
 int get_obj_list(const struct sd_list_req *hdr, struct sd_list_rsp *rsp, void *data);
 
 int start_recovery(uint32_t epoch);
+void recover_from_checkpoint(uint32_t epoch);
 void resume_recovery_work(void);
+void add_foreground_latency(uint64_t lat);
+void set_recovery_throttle(const struct sd_recovery_throttle *t);
+void get_recovery_stat(struct sd_recovery_stat *stat);
 int is_recoverying_oid(uint64_t oid);
 int node_in_recovery(void);
 
+void start_dirty_log(uint32_t epoch);
+void add_dirty_obj(uint64_t oid, uint32_t epoch);
+int get_dirty_list(const struct sd_list_req *hdr, struct sd_list_rsp *rsp,
+		   void *data);
+
 int write_object(struct sd_vnode *e,
 		 int vnodes, int zones, uint32_t node_version,
 		 uint64_t oid, char *data, unsigned int datalen,
@@ -303,14 +433,33 @@ int read_object(struct sd_vnode *e,
 int remove_object(struct sd_vnode *e,
 		  int vnodes, int zones, uint32_t node_version,
 		  uint64_t oid, int nr);
+int forward_objs(struct sd_vnode *e, int nr_vnodes, int nr_zones,
+		 uint32_t epoch, uint8_t opcode, int copies,
+		 struct sd_obj_seg *segs, int nr_segs, void *data);
+int forward_objs_req(struct request *req);
+void fail_recoverying_segs(struct request *req);
+int is_access_to_recoverying_segs(struct request *req);
+int objs_req_has_oid(struct request *req, uint64_t oid);
 int merge_objlist(uint64_t *list1, int nr_list1, uint64_t *list2, int nr_list2);
 
-void del_sheep_fd(int fd);
-int get_sheep_fd(uint8_t *addr, uint16_t port, int node_idx, uint32_t epoch);
+struct peer_req *peer_send_req(uint8_t *addr, uint16_t port,
+			       struct sd_req *hdr, void *data, unsigned wlen,
+			       void *rbuf, unsigned rlen);
+int peer_wait_req(struct peer_req **reqs, int nr, int timeout);
+int peer_finish_req(struct peer_req *req, struct sd_rsp *rsp);
+void peer_cancel_req(struct peer_req *req, int fatal);
 
 int rmdir_r(char *dir_path);
 
 int prealloc(int fd, uint32_t size);
+int punch_hole(int fd, off_t offset, off_t len);
+int write_sparse_obj(int fd, void *buf);
+
+int init_uring(void);
+int store_open(const char *path, int flags, mode_t mode);
+ssize_t store_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t store_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int store_fallocate(int fd, int mode, off_t offset, off_t len);
 
 /* Operations */
 
@@ -319,6 +468,7 @@ int is_cluster_op(struct sd_op_template *op);
 int is_local_op(struct sd_op_template *op);
 int is_io_op(struct sd_op_template *op);
 int is_force_op(struct sd_op_template *op);
+int is_vectored_op(struct sd_op_template *op);
 int has_process_work(struct sd_op_template *op);
 int has_process_main(struct sd_op_template *op);
 int do_process_work(struct sd_op_template *op, const struct sd_req *req,
@@ -346,6 +496,11 @@ static inline int sys_flag_nohalt(void)
 	return sys->flags & SD_FLAG_NOHALT;
 }
 
+static inline int sys_flag_chain_write(void)
+{
+	return sys->flags & SD_FLAG_CHAIN_WRITE;
+}
+
 static inline int sys_stat_ok(void)
 {
 	return sys->status & SD_STATUS_OK;
@@ -432,5 +587,7 @@ int object_cache_init(const char *p);
 int object_is_cached(uint64_t oid);
 void object_cache_delete(uint32_t vid);
 int object_cache_flush_and_delete(struct object_cache *oc);
+int object_cache_discard(struct object_cache *oc, uint32_t idx,
+			 uint64_t offset, uint32_t length);
 
 #endif
@@ -116,7 +116,7 @@ static int simple_store_open(uint64_t oid, struct siocb *iocb, int create)
 
 	strbuf_addf(&path, "%s%08u/%016" PRIx64, obj_path, iocb->epoch, oid);
 
-	ret = open(path.buf, flags, def_fmode);
+	ret = store_open(path.buf, flags, def_fmode);
 	if (ret < 0) {
 		if (errno == ENOENT) {
 			struct stat s;
@@ -140,7 +140,7 @@ static int simple_store_open(uint64_t oid, struct siocb *iocb, int create)
 		/*
 		 * Preallocate the whole object to get a better filesystem layout.
 		 */
-		ret = fallocate(iocb->fd, 0, 0, iocb->length);
+		ret = store_fallocate(iocb->fd, 0, 0, iocb->length);
 		if (ret < 0) {
 			if (errno != ENOSYS && errno != EOPNOTSUPP) {
 				ret = SD_RES_EIO;
@@ -164,7 +164,14 @@ out:
 
 static int simple_store_write(uint64_t oid, struct siocb *iocb)
 {
-	int size = xpwrite(iocb->fd, iocb->buf, iocb->length, iocb->offset);
+	int size;
+
+	if (iocb->pipe)
+		size = xsplice_pwrite(iocb->pipe, iocb->fd, iocb->length,
+				      iocb->offset);
+	else
+		size = store_pwrite(iocb->fd, iocb->buf, iocb->length,
+				    iocb->offset);
 	if (size != iocb->length)
 		return SD_RES_EIO;
 	return SD_RES_SUCCESS;
@@ -172,7 +179,8 @@ static int simple_store_write(uint64_t oid, struct siocb *iocb)
 
 static int simple_store_read(uint64_t oid, struct siocb *iocb)
 {
-	int size = xpread(iocb->fd, iocb->buf, iocb->length, iocb->offset);
+	int size = store_pread(iocb->fd, iocb->buf, iocb->length,
+			       iocb->offset);
 	if (size != iocb->length)
 		return SD_RES_EIO;
 	return SD_RES_SUCCESS;
@@ -282,7 +290,7 @@ static int simple_store_link(uint64_t oid, struct siocb *iocb, int tgt_epoch)
 static int simple_store_atomic_put(uint64_t oid, struct siocb *iocb)
 {
 	char path[PATH_MAX], tmp_path[PATH_MAX];
-	int flags = O_DSYNC | O_RDWR | O_CREAT;
+	int flags = O_DSYNC | O_RDWR | O_CREAT | O_TRUNC;
 	int ret = SD_RES_EIO, epoch = iocb->epoch, fd;
 	uint32_t len = iocb->length;
 
@@ -297,11 +305,17 @@ static int simple_store_atomic_put(uint64_t oid, struct siocb *iocb)
 		goto out;
 	}
 
-	ret = write(fd, iocb->buf, len);
-	if (ret != len) {
-		eprintf("failed to write object. %m\n");
-		ret = SD_RES_EIO;
-		goto out_close;
+	if (iocb->flags & SD_FLAG_CMD_SPARSE) {
+		ret = write_sparse_obj(fd, iocb->buf);
+		if (ret != SD_RES_SUCCESS)
+			goto out_close;
+	} else {
+		ret = write(fd, iocb->buf, len);
+		if (ret != len) {
+			eprintf("failed to write object. %m\n");
+			ret = SD_RES_EIO;
+			goto out_close;
+		}
 	}
 
 
@@ -15,7 +15,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <poll.h>
 #include <sys/xattr.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
@@ -34,6 +33,8 @@ struct sheepdog_config {
 	uint16_t flags;
 	uint8_t copies;
 	uint8_t store[STORE_LEN];
+	uint8_t placement[PLACEMENT_LEN];
+	struct sd_recovery_throttle throttle;
 };
 
 char *obj_path;
@@ -41,6 +42,7 @@ static char *epoch_path;
 static char *mnt_path;
 static char *jrnl_path;
 static char *config_path;
+static char *recovery_path;
 
 struct objlist_cache {
 	struct rb_root root;
@@ -177,43 +179,188 @@ out:
 	return ret;
 }
 
+/*
+ * Derive the number of vnodes of this node from the capacity of the file
+ * system holding the object directory, so that nodes with bigger disks
+ * store proportionally more objects.  The count is relative to the nodes
+ * with the default count, which weigh as SD_AUTO_VNODES_CAPACITY.  Small
+ * disks still get SD_MIN_AUTO_VNODES, since the objects spread unevenly
+ * over a node with few vnodes.
+ */
+int get_auto_vnodes(void)
+{
+	struct statvfs vs;
+	uint64_t capacity;
+	int nr_vnodes;
+
+	if (statvfs(obj_path, &vs)) {
+		eprintf("%m\n");
+		return -1;
+	}
+
+	capacity = (uint64_t)vs.f_frsize * vs.f_blocks;
+	/* the larger ones get the maximum, and the product can't overflow */
+	if (capacity / SD_AUTO_VNODES_CAPACITY >=
+	    SD_MAX_AUTO_VNODES / SD_DEFAULT_VNODES)
+		nr_vnodes = SD_MAX_AUTO_VNODES;
+	else
+		nr_vnodes = (capacity * SD_DEFAULT_VNODES +
+			     SD_AUTO_VNODES_CAPACITY / 2) /
+			SD_AUTO_VNODES_CAPACITY;
+	nr_vnodes = max(nr_vnodes, SD_MIN_AUTO_VNODES);
+
+	vprintf(SDOG_INFO, "%" PRIu64 " bytes of store capacity, %d vnodes\n",
+		capacity, nr_vnodes);
+
+	return nr_vnodes;
+}
+
+/* the first entry after oid, called with obj_list_cache.lock held */
+static struct rb_node *objlist_cache_next(uint64_t oid)
+{
+	struct rb_node *n = obj_list_cache.root.rb_node, *next = NULL;
+	struct objlist_cache_entry *entry;
+
+	while (n) {
+		entry = rb_entry(n, struct objlist_cache_entry, node);
+		if (oid < entry->oid) {
+			next = n;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+
+	return next;
+}
+
+static int get_max_copies(struct sd_node *entries, int nr);
+
+/* Returns true if the node holds one of the copies of the object */
+static int is_obj_holder(struct sd_vnode *vnodes, int nr_vnodes, int copies,
+			 uint64_t oid, struct sd_node *node)
+{
+	int i, idxs[SD_MAX_REDUNDANCY];
+
+	copies = obj_to_vnodes(vnodes, nr_vnodes, oid, copies, idxs);
+	for (i = 0; i < copies; i++)
+		if (vnodes[idxs[i]].port == node->port &&
+		    !memcmp(vnodes[idxs[i]].addr, node->addr, sizeof(node->addr)))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * List the objects after hdr->cursor in the order of their ids, as many
+ * as fit in the buffer.  The cursor of the response is where the next
+ * page starts, or 0 after the last page.
+ */
 int get_obj_list(const struct sd_list_req *hdr, struct sd_list_rsp *rsp, void *data)
 {
-	uint64_t *list = (uint64_t *)data;
-	int nr = 0;
+	uint64_t *list = (uint64_t *)data, cursor = 0;
+	int nr = 0, max_nr = hdr->data_length / sizeof(uint64_t);
+	int nr_nodes, nr_vnodes = 0, copies = 0;
 	int res = SD_RES_SUCCESS;
+	struct sd_node *nodes = NULL, *dst = NULL;
+	struct sd_vnode *vnodes = NULL;
 	struct objlist_cache_entry *entry;
 	struct rb_node *p;
 
+	if (!max_nr)
+		return SD_RES_INVALID_PARMS;
+
+	if (hdr->flags & SD_FLAG_CMD_FILTER) {
+		nodes = xmalloc(sizeof(*nodes) * SD_MAX_NODES);
+		nr_nodes = epoch_log_read_nr(hdr->dst_epoch, (char *)nodes,
+					     sizeof(*nodes) * SD_MAX_NODES);
+		if (nr_nodes <= 0) {
+			res = SD_RES_OLD_NODE_VER;
+			goto out;
+		}
+		if (hdr->dst_idx >= nr_nodes) {
+			res = SD_RES_INVALID_PARMS;
+			goto out;
+		}
+
+		vnodes = xmalloc(sizeof(*vnodes) * SD_MAX_VNODES);
+		nr_vnodes = nodes_to_vnodes(nodes, nr_nodes, vnodes);
+		copies = get_max_copies(nodes, nr_nodes);
+		dst = nodes + hdr->dst_idx;
+	}
+
 	pthread_rwlock_rdlock(&obj_list_cache.lock);
-	for (p = rb_first(&obj_list_cache.root); p; p = rb_next(p)) {
+	for (p = objlist_cache_next(hdr->cursor); p && nr < max_nr;
+	     p = rb_next(p)) {
 		entry = rb_entry(p, struct objlist_cache_entry, node);
+		cursor = entry->oid;
+		if (dst && !is_obj_holder(vnodes, nr_vnodes, copies,
+					  entry->oid, dst))
+			continue;
 		list[nr++] = entry->oid;
 	}
 	pthread_rwlock_unlock(&obj_list_cache.lock);
 
+	rsp->cursor = p ? cursor : 0;
 	rsp->data_length = nr * sizeof(uint64_t);
-
+out:
+	free(nodes);
+	free(vnodes);
 	return res;
 }
 
+static int read_sparse_obj(uint64_t oid, struct siocb *iocb, void *buf,
+			   uint32_t *len);
+
+/*
+ * Check the extent map of len bytes of data read from a peer with
+ * SD_FLAG_CMD_SPARSE: the extents must be within the object, and their
+ * data must be all there.
+ */
+static int check_extent_map(void *buf, uint32_t len)
+{
+	struct sd_extent_map *map = buf;
+	uint64_t total = sizeof(*map);
+	uint32_t i;
+
+	if (len < sizeof(*map) || map->nr_extents > SD_MAX_EXTENTS)
+		goto bad;
+
+	for (i = 0; i < map->nr_extents; i++) {
+		if ((uint64_t)map->extents[i].offset +
+		    map->extents[i].length > SD_DATA_OBJ_SIZE)
+			goto bad;
+		total += map->extents[i].length;
+	}
+	if (total > len)
+		goto bad;
+
+	return 0;
+bad:
+	eprintf("bad extent map, %"PRIu32" extents in %"PRIu32" bytes\n",
+		len < sizeof(*map) ? 0 : map->nr_extents, len);
+	return -1;
+}
+
+/* read a data object into buf in the format of SD_FLAG_CMD_SPARSE */
 static int read_copy_from_cluster(struct request *req, uint32_t epoch,
 				  uint64_t oid, char *buf)
 {
-	int i, n, nr, ret;
+	int i, n, nr, ret, copies, idxs[SD_MAX_REDUNDANCY];
 	unsigned wlen, rlen;
 	char name[128];
 	struct sd_vnode *e;
 	struct sd_obj_req hdr;
 	struct sd_obj_rsp *rsp = (struct sd_obj_rsp *)&hdr;
 	struct siocb iocb;
+	uint32_t len;
 	int fd;
 
 	e = req->entry;
 	nr = req->nr_vnodes;
+	copies = obj_to_vnodes(e, nr, oid, req->nr_zones, idxs);
 
-	for (i = 0; i < nr; i++) {
-		n = obj_to_sheep(e, nr, oid, i);
+	for (i = 0; i < copies; i++) {
+		n = idxs[i];
 
 		addr_to_str(name, sizeof(name), e[n].addr, 0);
 
@@ -224,13 +371,10 @@ static int read_copy_from_cluster(struct request *req, uint32_t epoch,
 			if (ret != SD_RES_SUCCESS)
 				continue;
 
-			iocb.buf = buf;
-			iocb.length = SD_DATA_OBJ_SIZE;
-			iocb.offset = 0;
-			ret = sd_store->read(oid, &iocb);
+			ret = read_sparse_obj(oid, &iocb, buf, &len);
+			sd_store->close(oid, &iocb);
 			if (ret != SD_RES_SUCCESS)
 				continue;
-			sd_store->close(oid, &iocb);
 			goto out;
 		}
 
@@ -243,9 +387,9 @@ static int read_copy_from_cluster(struct request *req, uint32_t epoch,
 		hdr.oid = oid;
 		hdr.epoch = epoch;
 
-		rlen = SD_DATA_OBJ_SIZE;
+		rlen = SD_SPARSE_OBJ_SIZE;
 		wlen = 0;
-		hdr.flags = SD_FLAG_CMD_IO_LOCAL;
+		hdr.flags = SD_FLAG_CMD_IO_LOCAL | SD_FLAG_CMD_SPARSE;
 		hdr.data_length = rlen;
 		hdr.offset = 0;
 
@@ -258,6 +402,9 @@ static int read_copy_from_cluster(struct request *req, uint32_t epoch,
 
 		switch (rsp->result) {
 		case SD_RES_SUCCESS:
+			if (!(rsp->flags & SD_FLAG_CMD_SPARSE) ||
+			    check_extent_map(buf, rlen) < 0)
+				break;
 			ret = SD_RES_SUCCESS;
 			goto out;
 		case SD_RES_OLD_NODE_VER:
@@ -276,75 +423,506 @@ out:
 
 static int do_local_io(struct request *req, uint32_t epoch);
 
+/*
+ * Load and latency of the peers as seen by the gateway, used to choose
+ * the replica to read from.  The slots are indexed by node_idx and are
+ * reset when a different node shows up at the index after a membership
+ * change.
+ */
+struct peer_stat {
+	uint8_t addr[16];
+	uint16_t port;
+	unsigned nr_outstanding;
+	uint64_t latency;	/* moving average in microseconds */
+	time_t error_time;
+};
+
+/* how long a peer is avoided after a network error or EIO */
+#define PEER_ERROR_TIMEOUT 10
+
+/*
+ * Histogram of the latency of remote reads in power of two microseconds,
+ * halved every READ_LATENCY_DECAY samples to follow recent behaviour.
+ */
+#define NR_LATENCY_BUCKETS 32
+#define READ_LATENCY_DECAY 4096
+
+static struct peer_stat peer_stats[SD_MAX_NODES];
+static uint32_t read_latency_hist[NR_LATENCY_BUCKETS];
+static uint32_t nr_read_latency;
+static struct sd_gateway_stat gateway_stat;
+static pthread_mutex_t peer_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* called with peer_stat_lock held */
+static struct peer_stat *get_peer_stat(struct sd_vnode *v)
+{
+	struct peer_stat *ps = peer_stats + v->node_idx;
+
+	if (memcmp(ps->addr, v->addr, sizeof(ps->addr)) || ps->port != v->port) {
+		memset(ps, 0, sizeof(*ps));
+		memcpy(ps->addr, v->addr, sizeof(ps->addr));
+		ps->port = v->port;
+	}
+
+	return ps;
+}
+
+/* called with peer_stat_lock held */
+static void add_read_latency(uint64_t lat)
+{
+	int i, b = 0;
+
+	while (lat >> b && b < NR_LATENCY_BUCKETS - 1)
+		b++;
+	read_latency_hist[b]++;
+
+	if (++nr_read_latency < READ_LATENCY_DECAY)
+		return;
+
+	nr_read_latency = 0;
+	for (i = 0; i < NR_LATENCY_BUCKETS; i++) {
+		read_latency_hist[i] /= 2;
+		nr_read_latency += read_latency_hist[i];
+	}
+}
+
+/*
+ * The delay after which a read is hedged, in microseconds, i.e. the
+ * configured percentile of the recent read latency.  Returns 0 when
+ * hedging is disabled or we haven't seen enough reads yet.
+ */
+static uint64_t get_hedge_delay(void)
+{
+	uint64_t target, sum = 0, delay = 0;
+	int i;
+
+	if (!sys->hedge_percentile)
+		return 0;
+
+	pthread_mutex_lock(&peer_stat_lock);
+	if (nr_read_latency >= 64) {
+		target = (uint64_t)nr_read_latency * sys->hedge_percentile / 100;
+		for (i = 0; i < NR_LATENCY_BUCKETS; i++) {
+			sum += read_latency_hist[i];
+			if (sum > target)
+				break;
+		}
+		delay = 1ULL << min(i, NR_LATENCY_BUCKETS - 1);
+	}
+	gateway_stat.hedge_delay = delay;
+	pthread_mutex_unlock(&peer_stat_lock);
+
+	return delay;
+}
+
+void get_gateway_stat(struct sd_gateway_stat *stat)
+{
+	struct buffer_stat bstat;
+
+	pthread_mutex_lock(&peer_stat_lock);
+	*stat = gateway_stat;
+	pthread_mutex_unlock(&peer_stat_lock);
+
+	get_buffer_stat(&bstat);
+	stat->buf_in_use = bstat.in_use;
+	stat->buf_cached = bstat.cached;
+}
+
+void account_gateway_writes(int nr_coalesced)
+{
+	pthread_mutex_lock(&peer_stat_lock);
+	gateway_stat.nr_client_writes += 1 + nr_coalesced;
+	gateway_stat.nr_coalesced_writes += nr_coalesced;
+	pthread_mutex_unlock(&peer_stat_lock);
+}
+
+/*
+ * The expected cost of sending a read to the peer.  A peer which failed
+ * recently is tried only after all the healthy ones.
+ */
+static uint64_t peer_load(struct sd_vnode *v)
+{
+	struct peer_stat *ps;
+	uint64_t load;
+
+	pthread_mutex_lock(&peer_stat_lock);
+	ps = get_peer_stat(v);
+	if (ps->error_time && time(NULL) - ps->error_time < PEER_ERROR_TIMEOUT)
+		load = UINT64_MAX;
+	else
+		load = (ps->nr_outstanding + 1) * (ps->latency + 1);
+	pthread_mutex_unlock(&peer_stat_lock);
+
+	return load;
+}
+
+static void peer_start(struct sd_vnode *v)
+{
+	pthread_mutex_lock(&peer_stat_lock);
+	get_peer_stat(v)->nr_outstanding++;
+	pthread_mutex_unlock(&peer_stat_lock);
+}
+
+/*
+ * Account the end of a read sent with peer_start().  If start is NULL,
+ * the read was cancelled and gives no latency sample.
+ */
+static void peer_done(struct sd_vnode *v, struct timespec *start, int failed)
+{
+	struct peer_stat *ps;
+	struct timespec end;
+	uint64_t lat = 0;
+
+	if (start) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		lat = (end.tv_sec - start->tv_sec) * 1000000 +
+			(end.tv_nsec - start->tv_nsec) / 1000;
+	}
+
+	pthread_mutex_lock(&peer_stat_lock);
+	ps = get_peer_stat(v);
+	if (ps->nr_outstanding)
+		ps->nr_outstanding--;
+	if (failed)
+		ps->error_time = time(NULL);
+	else if (start) {
+		ps->error_time = 0;
+		/* exponentially weighted with the factor of 1/8 */
+		if (ps->latency)
+			ps->latency = (ps->latency * 7 + lat) / 8;
+		else
+			ps->latency = lat;
+		add_read_latency(lat);
+	}
+	pthread_mutex_unlock(&peer_stat_lock);
+}
+
+/*
+ * Order the replicas to read from: the local one first, then the remote
+ * ones from the least loaded.
+ */
+void sort_read_replicas(struct sd_vnode *e, int *idxs, int nr)
+{
+	uint64_t loads[SD_MAX_REDUNDANCY], load;
+	int i, j, idx;
+
+	for (i = 0; i < nr; i++) {
+		if (is_myself(e[idxs[i]].addr, e[idxs[i]].port))
+			load = 0;
+		else
+			load = peer_load(e + idxs[i]);
+
+		idx = idxs[i];
+		for (j = i; j > 0 && loads[j - 1] > load; j--) {
+			loads[j] = loads[j - 1];
+			idxs[j] = idxs[j - 1];
+		}
+		loads[j] = load;
+		idxs[j] = idx;
+	}
+}
+
+struct remote_read {
+	struct sd_vnode *vnode;
+	struct peer_req *req;
+	void *buf;
+	int hedge;
+	struct timespec start;
+};
+
+static int start_remote_read(struct remote_read *rr, struct sd_vnode *v,
+			     struct sd_obj_req *req_hdr, void *buf, int hedge)
+{
+	struct sd_obj_req hdr = *req_hdr;
+
+	hdr.flags |= SD_FLAG_CMD_IO_LOCAL;
+
+	rr->vnode = v;
+	rr->buf = buf;
+	rr->hedge = hedge;
+	clock_gettime(CLOCK_MONOTONIC, &rr->start);
+	peer_start(v);
+
+	rr->req = peer_send_req(v->addr, v->port, (struct sd_req *)&hdr, NULL,
+				0, buf, hdr.data_length);
+	if (!rr->req) {
+		peer_done(v, &rr->start, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int finish_remote_read(struct remote_read *rr, struct sd_obj_rsp *rsp)
+{
+	struct sd_obj_rsp hdr;
+	int ret;
+
+	ret = peer_finish_req(rr->req, (struct sd_rsp *)&hdr);
+	if (ret == SD_RES_SUCCESS) {
+		memcpy(rsp, &hdr, sizeof(hdr));
+		ret = hdr.result;
+	}
+
+	peer_done(rr->vnode, &rr->start,
+		  ret == SD_RES_NETWORK_ERROR || ret == SD_RES_EIO);
+
+	return ret;
+}
+
+/*
+ * Drop a read we are no longer interested in.  A read which timed out
+ * takes its connection down with it.
+ */
+static void cancel_remote_read(struct remote_read *rr, int failed)
+{
+	peer_cancel_req(rr->req, failed);
+	peer_done(rr->vnode, failed ? &rr->start : NULL, failed);
+}
+
+/*
+ * Read an object from the remote replicas idxs[] in order.  A network
+ * error or EIO fails over to the next replica.
+ *
+ * With hedging enabled, if the replica being read from hasn't answered
+ * within the hedge delay, the read is also sent to the next replica into
+ * a buffer of its own.  The first reply wins, and the other read is
+ * cancelled.
+ */
+int read_remote_replicas(struct sd_vnode *e, int *idxs, int nr,
+			 struct sd_obj_req *hdr, void *data,
+			 struct sd_obj_rsp *rsp)
+{
+	struct remote_read reads[2], won;
+	struct peer_req *reqs[2];
+	int i, timeout, hedge, next = 0, nr_reads = 0;
+	int ret = SD_RES_NETWORK_ERROR;
+	uint64_t delay = get_hedge_delay();
+	void *buf, *hedge_buf = NULL;
+
+	pthread_mutex_lock(&peer_stat_lock);
+	gateway_stat.nr_reads++;
+	pthread_mutex_unlock(&peer_stat_lock);
+
+	if (delay && nr > 1 && hdr->data_length) {
+		hedge_buf = alloc_buffer(hdr->data_length);
+		if (!hedge_buf)
+			delay = 0;
+	}
+
+	for (;;) {
+		if (!nr_reads) {
+			if (next == nr)
+				break;
+			if (start_remote_read(reads, e + idxs[next++], hdr,
+					      data, 0) == 0)
+				nr_reads = 1;
+			continue;
+		}
+
+		hedge = delay && nr_reads == 1 && next < nr;
+		if (hedge)
+			timeout = max(delay / 1000, (uint64_t)1);
+		else
+			timeout = DEFAULT_SOCKET_TIMEOUT * 1000;
+
+		for (i = 0; i < nr_reads; i++)
+			reqs[i] = reads[i].req;
+
+		i = peer_wait_req(reqs, nr_reads, timeout);
+		if (i < 0 && hedge) {
+			buf = reads[0].buf == data ? hedge_buf : data;
+			if (start_remote_read(reads + 1, e + idxs[next++], hdr,
+					      buf, 1) == 0) {
+				nr_reads = 2;
+				pthread_mutex_lock(&peer_stat_lock);
+				gateway_stat.nr_hedges++;
+				pthread_mutex_unlock(&peer_stat_lock);
+			}
+			continue;
+		}
+		if (i < 0) {
+			eprintf("no reply from the replicas\n");
+			while (nr_reads)
+				cancel_remote_read(reads + --nr_reads, 1);
+			ret = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+
+		ret = finish_remote_read(reads + i, rsp);
+		won = reads[i];
+		reads[i] = reads[--nr_reads];
+		if (ret == SD_RES_NETWORK_ERROR || ret == SD_RES_EIO)
+			continue;
+
+		if (won.hedge) {
+			pthread_mutex_lock(&peer_stat_lock);
+			gateway_stat.nr_hedge_wins++;
+			pthread_mutex_unlock(&peer_stat_lock);
+		}
+
+		/* the losing read may be receiving into data, stop it first */
+		while (nr_reads)
+			cancel_remote_read(reads + --nr_reads, 0);
+		if (won.buf != data)
+			memcpy(data, won.buf,
+			       min(hdr->data_length, rsp->data_length));
+		break;
+	}
+
+	while (nr_reads)
+		cancel_remote_read(reads + --nr_reads, 0);
+	free_buffer(hedge_buf, hdr->data_length);
+
+	return ret;
+}
+
+/*
+ * Read from the local replica if we have one, otherwise from the least
+ * loaded peers.
+ */
 static int forward_read_obj_req(struct request *req)
 {
-	int i, n, nr, fd, ret;
-	unsigned wlen, rlen;
-	struct sd_obj_req hdr = *(struct sd_obj_req *)&req->rq;
-	struct sd_obj_rsp *rsp = (struct sd_obj_rsp *)&hdr;
+	int nr, copies, idxs[SD_MAX_REDUNDANCY];
+	struct sd_obj_req *hdr = (struct sd_obj_req *)&req->rq;
 	struct sd_vnode *e;
-	uint64_t oid = hdr.oid;
-	int copies;
+	int ret, local = 0;
 
 	e = req->entry;
 	nr = req->nr_vnodes;
 
-	copies = hdr.copies;
+	copies = hdr->copies;
 
 	/* temporary hack */
 	if (!copies)
 		copies = sys->nr_sobjs;
 	if (copies > req->nr_zones)
 		copies = req->nr_zones;
+	copies = obj_to_vnodes(e, nr, hdr->oid, copies, idxs);
 
-	hdr.flags |= SD_FLAG_CMD_IO_LOCAL;
-
-	/* TODO: we can do better; we need to check this first */
-	for (i = 0; i < copies; i++) {
-		n = obj_to_sheep(e, nr, oid, i);
+	sort_read_replicas(e, idxs, copies);
 
-		if (is_myself(e[n].addr, e[n].port)) {
-			ret = do_local_io(req, hdr.epoch);
-			goto out;
-		}
+	if (is_myself(e[idxs[0]].addr, e[idxs[0]].port)) {
+		ret = do_local_io(req, hdr->epoch);
+		if (ret != SD_RES_EIO)
+			return ret;
+		eprintf("failed to read %" PRIx64 " locally\n", hdr->oid);
+		if (copies == 1)
+			return ret;
+		local = 1;
 	}
 
-	n = obj_to_sheep(e, nr, oid, 0);
+	return read_remote_replicas(e, idxs + local, copies - local, hdr,
+				    req->data, (struct sd_obj_rsp *)&req->rp);
+}
 
-	fd = get_sheep_fd(e[n].addr, e[n].port, e[n].node_idx, hdr.epoch);
-	if (fd < 0) {
-		ret = SD_RES_NETWORK_ERROR;
-		goto out;
+static void account_remote_write(uint64_t len)
+{
+	pthread_mutex_lock(&peer_stat_lock);
+	gateway_stat.nr_writes++;
+	gateway_stat.write_tx_bytes += len;
+	pthread_mutex_unlock(&peer_stat_lock);
+}
+
+static int get_write_copies(struct request *req)
+{
+	struct sd_obj_req *hdr = (struct sd_obj_req *)&req->rq;
+	int copies = hdr->copies;
+
+	/* temporary hack */
+	if (!copies)
+		copies = sys->nr_sobjs;
+	if (copies > req->nr_zones)
+		copies = req->nr_zones;
+
+	return copies;
+}
+
+/* the position of this node in the replica chain of the object, or -1 */
+int get_chain_pos(struct request *req, int *idxs, int *copies)
+{
+	struct sd_obj_req *hdr = (struct sd_obj_req *)&req->rq;
+	struct sd_vnode *e = req->entry;
+	int i;
+
+	*copies = obj_to_vnodes(e, req->nr_vnodes, hdr->oid,
+				get_write_copies(req), idxs);
+	for (i = 0; i < *copies; i++)
+		if (is_myself(e[idxs[i]].addr, e[idxs[i]].port))
+			return i;
+
+	return -1;
+}
+
+/*
+ * Send the write to the next replica of the chain, and write locally
+ * meanwhile if we hold a replica.  The reply of the next replica covers
+ * the rest of the chain.
+ */
+static int chain_write(struct request *req, struct sd_vnode *next,
+		       int local, uint32_t epoch)
+{
+	int ret = SD_RES_SUCCESS;
+	char name[128];
+	struct sd_obj_req hdr = *(struct sd_obj_req *)&req->rq;
+	struct sd_obj_rsp rsp;
+	struct peer_req *preq;
+
+	hdr.flags |= SD_FLAG_CMD_IO_LOCAL | SD_FLAG_CMD_CHAIN;
+
+	preq = peer_send_req(next->addr, next->port, (struct sd_req *)&hdr,
+			     req->data, hdr.data_length, NULL, 0);
+	if (!preq) {
+		addr_to_str(name, sizeof(name), next->addr, next->port);
+		eprintf("failed to send a request to %s\n", name);
+		return SD_RES_NETWORK_ERROR;
 	}
 
-	wlen = 0;
-	rlen = hdr.data_length;
+	if (local)
+		ret = do_local_io(req, epoch);
 
-	ret = exec_req(fd, (struct sd_req *)&hdr, req->data, &wlen, &rlen);
+	if (peer_wait_req(&preq, 1, DEFAULT_SOCKET_TIMEOUT * 1000) < 0) {
+		eprintf("timeout\n");
+		peer_cancel_req(preq, 1);
+		return SD_RES_NETWORK_ERROR;
+	}
 
-	if (ret) { /* network errors */
-		del_sheep_fd(fd);
-		ret = SD_RES_NETWORK_ERROR;
-	} else {
-		memcpy(&req->rp, rsp, sizeof(*rsp));
-		ret = rsp->result;
+	if (peer_finish_req(preq, (struct sd_rsp *)&rsp) != SD_RES_SUCCESS) {
+		eprintf("failed to read a response\n");
+		return SD_RES_NETWORK_ERROR;
 	}
-out:
+
+	if (ret == SD_RES_SUCCESS)
+		ret = rsp.result;
+	if (ret != SD_RES_SUCCESS)
+		eprintf("fail %"PRIx64" %"PRIu32"\n", hdr.oid, ret);
+
 	return ret;
 }
 
+/* called by a replica for a write with SD_FLAG_CMD_CHAIN */
+int forward_chain_write(struct request *req, uint32_t epoch)
+{
+	int pos, copies, idxs[SD_MAX_REDUNDANCY];
+
+	pos = get_chain_pos(req, idxs, &copies);
+	if (pos < 0 || pos == copies - 1)
+		return do_local_io(req, epoch);
+
+	return chain_write(req, req->entry + idxs[pos + 1], 1, epoch);
+}
+
 int forward_write_obj_req(struct request *req)
 {
-	int i, n, nr, fd, ret, pollret;
-	unsigned wlen;
+	int i, n, nr, ret, idxs[SD_MAX_REDUNDANCY];
 	char name[128];
 	struct sd_obj_req hdr = *(struct sd_obj_req *)&req->rq;
 	struct sd_obj_rsp *rsp = (struct sd_obj_rsp *)&req->rp;
 	struct sd_vnode *e;
 	uint64_t oid = hdr.oid;
 	int copies;
-	struct pollfd pfds[SD_MAX_REDUNDANCY];
-	int nr_fds, local = 0;
+	struct peer_req *preqs[SD_MAX_REDUNDANCY];
+	int nr_reqs, local = 0;
 
 	dprintf("%"PRIx64"\n", oid);
 	e = req->entry;
@@ -357,51 +935,61 @@ int forward_write_obj_req(struct request *req)
 		copies = sys->nr_sobjs;
 	if (copies > req->nr_zones)
 		copies = req->nr_zones;
+	copies = obj_to_vnodes(e, nr, oid, copies, idxs);
+
+	/*
+	 * Chain the write unless we hold a replica other than the first
+	 * one; a write forwarded back to us would wait for our own request
+	 * on the object.
+	 */
+	if (sys_flag_chain_write() && copies > 1) {
+		if (is_myself(e[idxs[0]].addr, e[idxs[0]].port)) {
+			account_remote_write(hdr.data_length);
+			return chain_write(req, e + idxs[1], 1, hdr.epoch);
+		}
+
+		for (i = 1; i < copies; i++)
+			if (is_myself(e[idxs[i]].addr, e[idxs[i]].port))
+				break;
+		if (i == copies) {
+			account_remote_write(hdr.data_length);
+			return chain_write(req, e + idxs[0], 0, hdr.epoch);
+		}
+	}
 
-	nr_fds = 0;
-	memset(pfds, 0, sizeof(pfds));
-	for (i = 0; i < ARRAY_SIZE(pfds); i++)
-		pfds[i].fd = -1;
+	nr_reqs = 0;
 
 	hdr.flags |= SD_FLAG_CMD_IO_LOCAL;
 
-	wlen = hdr.data_length;
-
 	for (i = 0; i < copies; i++) {
-		n = obj_to_sheep(e, nr, oid, i);
-
-		addr_to_str(name, sizeof(name), e[n].addr, 0);
+		n = idxs[i];
 
 		if (is_myself(e[n].addr, e[n].port)) {
 			local = 1;
 			continue;
 		}
 
-		fd = get_sheep_fd(e[n].addr, e[n].port, e[n].node_idx, hdr.epoch);
-		if (fd < 0) {
-			eprintf("failed to connect to %s:%"PRIu32"\n", name, e[n].port);
-			ret = SD_RES_NETWORK_ERROR;
-			goto out;
-		}
-
-		ret = send_req(fd, (struct sd_req *)&hdr, req->data, &wlen);
-		if (ret) { /* network errors */
-			del_sheep_fd(fd);
+		preqs[nr_reqs] = peer_send_req(e[n].addr, e[n].port,
+					       (struct sd_req *)&hdr, req->data,
+					       hdr.data_length, NULL, 0);
+		if (!preqs[nr_reqs]) {
+			addr_to_str(name, sizeof(name), e[n].addr, 0);
+			eprintf("failed to send a request to %s:%"PRIu32"\n",
+				name, e[n].port);
 			ret = SD_RES_NETWORK_ERROR;
-			dprintf("fail %"PRIu32"\n", ret);
 			goto out;
 		}
-
-		pfds[nr_fds].fd = fd;
-		pfds[nr_fds].events = POLLIN;
-		nr_fds++;
+		nr_reqs++;
 	}
 
+	if (nr_reqs)
+		account_remote_write((uint64_t)hdr.data_length * nr_reqs);
+
 	if (local) {
 		ret = do_local_io(req, hdr.epoch);
 		rsp->result = ret;
 
-		if (nr_fds == 0) {
+		if (nr_reqs == 0) {
 			eprintf("exit %"PRIu32"\n", ret);
 			goto out;
 		}
@@ -413,61 +1001,31 @@ int forward_write_obj_req(struct request *req)
 	}
 
 	ret = SD_RES_SUCCESS;
-again:
-	pollret = poll(pfds, nr_fds, DEFAULT_SOCKET_TIMEOUT * 1000);
-	if (pollret < 0) {
-		if (errno == EINTR)
-			goto again;
-
-		ret = SD_RES_EIO;
-	} else if (pollret == 0) { /* poll time out */
-		eprintf("timeout\n");
-
-		for (i = 0; i < nr_fds; i++)
-			del_sheep_fd(pfds[i].fd);
-
-		ret = SD_RES_NETWORK_ERROR;
-		goto out;
-	}
-
-	for (i = 0; i < nr_fds; i++) {
-		if (pfds[i].fd < 0)
-			break;
-
-		if (pfds[i].revents & POLLERR || pfds[i].revents & POLLHUP || pfds[i].revents & POLLNVAL) {
-			del_sheep_fd(pfds[i].fd);
+	while (nr_reqs) {
+		i = peer_wait_req(preqs, nr_reqs, DEFAULT_SOCKET_TIMEOUT * 1000);
+		if (i < 0) {
+			eprintf("timeout\n");
+			while (nr_reqs)
+				peer_cancel_req(preqs[--nr_reqs], 1);
 			ret = SD_RES_NETWORK_ERROR;
-			break;
+			goto out;
 		}
 
-		if (!(pfds[i].revents & POLLIN))
-			continue;
-
-		if (do_read(pfds[i].fd, rsp, sizeof(*rsp))) {
-			eprintf("failed to read a response: %m\n");
-			del_sheep_fd(pfds[i].fd);
+		if (peer_finish_req(preqs[i], (struct sd_rsp *)rsp)) {
+			eprintf("failed to read a response\n");
 			ret = SD_RES_NETWORK_ERROR;
-			break;
-		}
-
-		if (rsp->result != SD_RES_SUCCESS) {
+		} else if (rsp->result != SD_RES_SUCCESS) {
 			eprintf("fail %"PRIu32"\n", rsp->result);
 			ret = rsp->result;
 		}
+		preqs[i] = preqs[--nr_reqs];
 
-		break;
-	}
-	if (i < nr_fds) {
-		nr_fds--;
-		memmove(pfds + i, pfds + i + 1, sizeof(*pfds) * (nr_fds - i));
-	}
-
-	dprintf("%"PRIx64" %"PRIu32"\n", oid, nr_fds);
-
-	if (nr_fds > 0) {
-		goto again;
+		dprintf("%"PRIx64" %"PRIu32"\n", oid, nr_reqs);
 	}
 out:
+	while (nr_reqs)
+		peer_cancel_req(preqs[--nr_reqs], 0);
+
 	return ret;
 }
 
@@ -596,6 +1154,262 @@ int store_remove_obj(const struct sd_req *req, struct sd_rsp *rsp, void *data)
 		eprintf("%m\n");
 		return SD_RES_EIO;
 	}
+	add_dirty_obj(hdr->oid, epoch);
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Drop the data of the range, which reads as zeros afterwards.  It is
+ * written with zeros if the file system can't punch holes.
+ */
+int punch_hole(int fd, off_t offset, off_t len)
+{
+	void *buf;
+	int ret;
+
+	ret = store_fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      offset, len);
+	if (ret == 0)
+		return SD_RES_SUCCESS;
+	if (errno != ENOSYS && errno != EOPNOTSUPP) {
+		eprintf("%m\n");
+		return SD_RES_EIO;
+	}
+
+	buf = zalloc_buffer(len);
+	if (!buf)
+		return SD_RES_NO_MEM;
+
+	ret = SD_RES_SUCCESS;
+	if (store_pwrite(fd, buf, len, offset) != len) {
+		eprintf("%m\n");
+		ret = SD_RES_EIO;
+	}
+	free_buffer(buf, len);
+
+	return ret;
+}
+
+/*
+ * Write the extents of data read with SD_FLAG_CMD_SPARSE to an object
+ * file.  The file is sized to the whole object first, so the holes
+ * between the extents stay holes.
+ */
+int write_sparse_obj(int fd, void *buf)
+{
+	struct sd_extent_map *map = buf;
+	char *p = (char *)buf + sizeof(*map);
+	uint32_t i, len;
+
+	if (ftruncate(fd, SD_DATA_OBJ_SIZE) < 0) {
+		eprintf("%m\n");
+		return SD_RES_EIO;
+	}
+
+	for (i = 0; i < map->nr_extents; i++) {
+		len = map->extents[i].length;
+		if (store_pwrite(fd, p, len, map->extents[i].offset) != len) {
+			eprintf("%m\n");
+			return SD_RES_EIO;
+		}
+		p += len;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+int store_discard_obj(const struct sd_req *req, struct sd_rsp *rsp, void *data)
+{
+	struct sd_discard_req *hdr = (struct sd_discard_req *)req;
+	struct siocb iocb;
+	int ret;
+
+	if (hdr->offset + hdr->length > SD_DATA_OBJ_SIZE)
+		return SD_RES_INVALID_PARMS;
+
+	memset(&iocb, 0, sizeof(iocb));
+	iocb.epoch = hdr->epoch;
+	iocb.flags = hdr->flags;
+	ret = sd_store->open(hdr->oid, &iocb, 0);
+	if (ret == SD_RES_NO_OBJ)
+		return SD_RES_SUCCESS; /* nothing to discard */
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (iocb.fd > 0)
+		ret = punch_hole(iocb.fd, hdr->offset, hdr->length);
+	if (ret == SD_RES_SUCCESS)
+		add_dirty_obj(hdr->oid, hdr->epoch);
+
+	sd_store->close(hdr->oid, &iocb);
+	return ret;
+}
+
+/*
+ * Leave the data of a replica read in the object file, to be sent with
+ * sendfile() by the thread of the client.  The data is read ahead here, so
+ * that the thread doesn't wait for the disk.  The object stays busy until
+ * the data is sent, see is_sending_obj().
+ */
+static int prepare_sendfile(struct request *req, struct siocb *iocb)
+{
+	struct sd_obj_req *hdr = (struct sd_obj_req *)&req->rq;
+	struct stat st;
+	int fd, flags;
+
+	/* the store didn't open the object, e.g. farm reading an old epoch */
+	if (iocb->fd <= 0)
+		return -1;
+
+	if (fstat(iocb->fd, &st) < 0 ||
+	    st.st_size < hdr->offset + hdr->data_length)
+		return -1;
+
+	fd = dup(iocb->fd);
+	if (fd < 0)
+		return -1;
+
+	/* sendfile reads through the page cache */
+	flags = fcntl(fd, F_GETFL);
+	if (flags & O_DIRECT)
+		fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+	readahead(fd, hdr->offset, hdr->data_length);
+
+	req->file_fd = fd;
+	req->file_offset = hdr->offset;
+	add_sendfile_req(req);
+
+	return 0;
+}
+
+/* find the data extents of an object file with SEEK_DATA and SEEK_HOLE */
+static int map_extents(int fd, struct sd_extent_map *map)
+{
+	struct sd_extent *ext = map->extents;
+	off_t data, hole = 0;
+
+	map->nr_extents = 0;
+	while (hole < SD_DATA_OBJ_SIZE) {
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data < 0)
+			/* no data up to the end of the file */
+			return errno == ENXIO ? 0 : -1;
+		if (data >= SD_DATA_OBJ_SIZE)
+			break;
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return -1;
+
+		/* keep the extents aligned for O_DIRECT */
+		data &= ~(off_t)(SECTOR_SIZE - 1);
+		hole = roundup(hole, SECTOR_SIZE);
+		if (hole > SD_DATA_OBJ_SIZE)
+			hole = SD_DATA_OBJ_SIZE;
+
+		if (map->nr_extents == SD_MAX_EXTENTS) {
+			/* too fragmented, the last extent takes the rest */
+			ext[-1].length = SD_DATA_OBJ_SIZE - ext[-1].offset;
+			break;
+		}
+		ext->offset = data;
+		ext->length = hole - data;
+		ext++;
+		map->nr_extents++;
+	}
+
+	return 0;
+}
+
+#define ZERO_BLOCK_SIZE 4096
+
+static int is_zero_block(const char *p)
+{
+	return !p[0] && !memcmp(p, p + 1, ZERO_BLOCK_SIZE - 1);
+}
+
+/*
+ * Make the extents of an object read whole into data out of the blocks
+ * which aren't zero, and pack them.  Returns the length of the packed
+ * data.
+ */
+static uint32_t pack_zero_blocks(struct sd_extent_map *map, char *data)
+{
+	struct sd_extent *ext = map->extents - 1;
+	uint32_t off, end, len = 0;
+	int in_extent = 0;
+
+	map->nr_extents = 0;
+	for (off = 0; off < SD_DATA_OBJ_SIZE; off += ZERO_BLOCK_SIZE) {
+		if (is_zero_block(data + off)) {
+			in_extent = 0;
+			continue;
+		}
+
+		if (!in_extent) {
+			if (map->nr_extents == SD_MAX_EXTENTS) {
+				/* too fragmented, the last extent takes the rest */
+				end = ext->offset + ext->length;
+				memmove(data + len, data + end,
+					SD_DATA_OBJ_SIZE - end);
+				ext->length = SD_DATA_OBJ_SIZE - ext->offset;
+				return len + SD_DATA_OBJ_SIZE - end;
+			}
+			ext++;
+			ext->offset = off;
+			ext->length = 0;
+			map->nr_extents++;
+			in_extent = 1;
+		}
+
+		if (len != off)
+			memmove(data + len, data + off, ZERO_BLOCK_SIZE);
+		ext->length += ZERO_BLOCK_SIZE;
+		len += ZERO_BLOCK_SIZE;
+	}
+
+	return len;
+}
+
+/*
+ * Read a data object in the format of SD_FLAG_CMD_SPARSE into buf, which
+ * must hold SD_SPARSE_OBJ_SIZE bytes.  If the store didn't open a file,
+ * e.g. farm reading an old epoch, or the file system can't find the
+ * holes, the whole object is read and its zero blocks are left out.
+ */
+static int read_sparse_obj(uint64_t oid, struct siocb *iocb, void *buf,
+			   uint32_t *len)
+{
+	struct sd_extent_map *map = buf;
+	char *p = (char *)buf + sizeof(*map);
+	uint32_t i;
+	int ret;
+
+	memset(map, 0, sizeof(*map));
+	if (iocb->fd <= 0 || map_extents(iocb->fd, map) < 0) {
+		iocb->buf = p;
+		iocb->offset = 0;
+		iocb->length = SD_DATA_OBJ_SIZE;
+		ret = sd_store->read(oid, iocb);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+
+		*len = sizeof(*map) + pack_zero_blocks(map, p);
+		return SD_RES_SUCCESS;
+	}
+
+	for (i = 0; i < map->nr_extents; i++) {
+		iocb->buf = p;
+		iocb->offset = map->extents[i].offset;
+		iocb->length = map->extents[i].length;
+		ret = sd_store->read(oid, iocb);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		p += iocb->length;
+	}
+
+	*len = p - (char *)buf;
 
 	return SD_RES_SUCCESS;
 }
@@ -616,13 +1430,46 @@ int store_read_obj(const struct sd_req *req, struct sd_rsp *rsp, void *data)
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
+	if (hdr->flags & SD_FLAG_CMD_SPARSE) {
+		if (!is_data_obj(hdr->oid) ||
+		    hdr->data_length < SD_SPARSE_OBJ_SIZE) {
+			ret = SD_RES_INVALID_PARMS;
+			goto out;
+		}
+		if (!request->data) {
+			request->data = alloc_buffer(hdr->data_length);
+			if (!request->data) {
+				ret = SD_RES_NO_MEM;
+				goto out;
+			}
+		}
+
+		ret = read_sparse_obj(hdr->oid, &iocb, request->data,
+				      &rsps->data_length);
+		if (ret == SD_RES_SUCCESS)
+			rsps->flags |= SD_FLAG_CMD_SPARSE;
+		goto out;
+	}
+
+	/* the buffer is left out for reads which can be sent with sendfile */
+	if (!request->data && hdr->data_length) {
+		if (prepare_sendfile(request, &iocb) == 0)
+			goto done;
+
+		request->data = alloc_buffer(hdr->data_length);
+		if (!request->data) {
+			ret = SD_RES_NO_MEM;
+			goto out;
+		}
+	}
+
 	iocb.buf = request->data;
 	iocb.length = hdr->data_length;
 	iocb.offset = hdr->offset;
 	ret = sd_store->read(hdr->oid, &iocb);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
-
+done:
 	rsps->data_length = hdr->data_length;
 	rsps->copies = sys->nr_sobjs;
 out:
@@ -675,7 +1522,11 @@ int store_write_obj(const struct sd_req *req, struct sd_rsp *rsp, void *data)
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
+	if (request->pipe)
+		iocb.pipe = request->pipe->fd[0];
 	ret = do_write_obj(&iocb, hdr, epoch, request->data);
+	if (ret == SD_RES_SUCCESS)
+		add_dirty_obj(hdr->oid, epoch);
 
 	sd_store->close(hdr->oid, &iocb);
 	return ret;
@@ -685,7 +1536,6 @@ int store_create_and_write_obj(const struct sd_req *req, struct sd_rsp *rsp, voi
 {
 	struct sd_obj_req *hdr = (struct sd_obj_req *)req;
 	struct request *request = (struct request *)data;
-	struct sd_obj_req cow_hdr;
 	int ret;
 	uint32_t epoch = hdr->epoch;
 	char *buf = NULL;
@@ -709,33 +1559,37 @@ int store_create_and_write_obj(const struct sd_req *req, struct sd_rsp *rsp, voi
 	if (hdr->flags & SD_FLAG_CMD_COW) {
 		dprintf("%" PRIu64 ", %" PRIx64 "\n", hdr->oid, hdr->cow_oid);
 
-		buf = zalloc(SD_DATA_OBJ_SIZE);
-		if (!buf) {
-			eprintf("can not allocate memory\n");
-			goto out;
-		}
+		/* only the data of the parent is copied, then the new data */
 		if (hdr->data_length != SD_DATA_OBJ_SIZE) {
+			buf = alloc_buffer(SD_SPARSE_OBJ_SIZE);
+			if (!buf) {
+				eprintf("can not allocate memory\n");
+				ret = SD_RES_NO_MEM;
+				goto out;
+			}
 			ret = read_copy_from_cluster(request, hdr->epoch, hdr->cow_oid, buf);
 			if (ret != SD_RES_SUCCESS) {
 				eprintf("failed to read cow object\n");
 				goto out;
 			}
+			ret = write_sparse_obj(iocb.fd, buf);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
 		}
 
-		memcpy(buf + hdr->offset, request->data, hdr->data_length);
-		memcpy(&cow_hdr, hdr, sizeof(cow_hdr));
-		cow_hdr.offset = 0;
-		cow_hdr.data_length = SD_DATA_OBJ_SIZE;
-
-		ret = do_write_obj(&iocb, &cow_hdr, epoch, buf);
-	} else
 		ret = do_write_obj(&iocb, hdr, epoch, request->data);
+	} else {
+		if (request->pipe)
+			iocb.pipe = request->pipe->fd[0];
+		ret = do_write_obj(&iocb, hdr, epoch, request->data);
+	}
 
-	if (SD_RES_SUCCESS == ret)
+	if (SD_RES_SUCCESS == ret) {
 		check_and_insert_objlist_cache(hdr->oid);
+		add_dirty_obj(hdr->oid, epoch);
+	}
 out:
-	if (buf)
-		free(buf);
+	free_buffer(buf, SD_SPARSE_OBJ_SIZE);
 	sd_store->close(hdr->oid, &iocb);
 	return ret;
 }
@@ -768,12 +1622,11 @@ static int fix_object_consistency(struct request *req)
 	else
 		data_length = SD_DATA_OBJ_SIZE;
 
-	buf = valloc(data_length);
+	buf = zalloc_buffer(data_length);
 	if (buf == NULL) {
 		eprintf("failed to allocate memory\n");
 		goto out;
 	}
-	memset(buf, 0, data_length);
 
 	req->data = buf;
 	hdr->offset = 0;
@@ -797,7 +1650,7 @@ static int fix_object_consistency(struct request *req)
 		goto out;
 	}
 out:
-	free(buf);
+	free_buffer(buf, data_length);
 	req->data = data;
 	req->op = get_sd_op(old_opcode);
 	*((struct sd_obj_req *)&req->rq) = req_bak;
@@ -831,6 +1684,92 @@ static int handle_gateway_request(struct request *req)
 	return object_cache_rw(cache, idx, req);
 }
 
+/*
+ * A discard of part of an object is forwarded to the replicas like a
+ * write, and punches a hole in the cached object too.  A discard of a
+ * whole object clears its entry in the inode if the VDI still refers to
+ * it, and removes the replicas.  The objects of snapshots may be shared
+ * with their children, so they are never discarded.
+ */
+static int forward_discard_obj_req(struct request *req)
+{
+	struct sd_discard_req *hdr = (struct sd_discard_req *)&req->rq;
+	uint32_t vid = oid_to_vid(hdr->oid), idx = data_oid_to_idx(hdr->oid);
+	uint32_t zero = 0;
+	uint64_t vdi_oid = vid_to_vdi_oid(vid);
+	struct object_cache *cache;
+	struct sd_obj_seg segs[2];
+	struct {
+		uint64_t snap_ctime;
+		uint32_t data_vdi_id;
+	} __attribute__((packed)) inode;
+	int ret, copies = get_write_copies(req);
+
+	if (!is_data_obj(hdr->oid) || !hdr->length ||
+	    hdr->offset + hdr->length > SD_DATA_OBJ_SIZE ||
+	    (hdr->offset | hdr->length) % SECTOR_SIZE)
+		return SD_RES_INVALID_PARMS;
+
+	/* the inode is updated in the cluster, so push the cached one */
+	cache = find_object_cache(vid, 0);
+	if (cache && hdr->length == SD_DATA_OBJ_SIZE) {
+		object_cache_flush_and_delete(cache);
+		cache = NULL;
+	}
+
+	memset(segs, 0, sizeof(segs));
+	segs[0].oid = vdi_oid;
+	segs[0].offset = offsetof(struct sheepdog_inode, snap_ctime);
+	segs[0].length = sizeof(inode.snap_ctime);
+	segs[1].oid = vdi_oid;
+	segs[1].offset = SD_INODE_HEADER_SIZE + sizeof(zero) * idx;
+	segs[1].length = sizeof(inode.data_vdi_id);
+
+	ret = forward_objs(req->entry, req->nr_vnodes, req->nr_zones,
+			   hdr->epoch, SD_OP_READ_OBJS, copies, segs, 2,
+			   &inode);
+	if (ret == SD_RES_SUCCESS)
+		ret = segs[0].result;
+	if (ret == SD_RES_SUCCESS)
+		ret = segs[1].result;
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (inode.snap_ctime)
+		return SD_RES_INVALID_PARMS;
+
+	if (hdr->length < SD_DATA_OBJ_SIZE) {
+		if (cache) {
+			ret = object_cache_discard(cache, idx, hdr->offset,
+						   hdr->length);
+			if (ret != SD_RES_SUCCESS)
+				return ret;
+		}
+		return forward_write_obj_req(req);
+	}
+
+	if (inode.data_vdi_id == vid) {
+		segs[0] = segs[1];
+		ret = forward_objs(req->entry, req->nr_vnodes, req->nr_zones,
+				   hdr->epoch, SD_OP_WRITE_OBJS, copies, segs,
+				   1, &zero);
+		if (ret == SD_RES_SUCCESS)
+			ret = segs[0].result;
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	memset(segs, 0, sizeof(segs[0]));
+	segs[0].oid = hdr->oid;
+	ret = forward_objs(req->entry, req->nr_vnodes, req->nr_zones,
+			   hdr->epoch, SD_OP_REMOVE_OBJS, copies, segs, 1,
+			   NULL);
+	if (ret == SD_RES_SUCCESS && segs[0].result != SD_RES_NO_OBJ)
+		ret = segs[0].result;
+
+	return ret;
+}
+
 static int bypass_object_cache(struct sd_obj_req *hdr)
 {
 	uint64_t oid = hdr->oid;
@@ -881,8 +1820,14 @@ void do_io_request(struct work *work)
 	if (hdr->flags & SD_FLAG_CMD_RECOVERY)
 		epoch = hdr->tgt_epoch;
 
-	if (hdr->flags & SD_FLAG_CMD_IO_LOCAL) {
+	if (hdr->flags & SD_FLAG_CMD_CHAIN) {
+		ret = forward_chain_write(req, epoch);
+	} else if (hdr->flags & SD_FLAG_CMD_IO_LOCAL) {
 		ret = do_local_io(req, epoch);
+	} else if (is_vectored_op(req->op)) {
+		ret = forward_objs_req(req);
+	} else if (opcode == SD_OP_DISCARD_OBJ) {
+		ret = forward_discard_obj_req(req);
 	} else {
 		if (bypass_object_cache(hdr)) {
 			/* fix object consistency when we read the object for the first time */
@@ -1140,18 +2085,17 @@ static int get_max_copies(struct sd_node *entries, int nr)
 /*
  * contains_node - checks that the node id is included in the target nodes
  *
- * The target nodes to store replicated objects are the first N nodes
- * from the base_idx'th on the consistent hash ring, where N is the
- * number of copies of objects.
+ * The target nodes to store replicated objects are the vnodes in idxs,
+ * which the placement driver returns for the object.
  */
 static int contains_node(struct sd_vnode *key,
 			 struct sd_vnode *entry,
-			 int nr, int base_idx, int copies)
+			 int *idxs, int copies)
 {
 	int i;
 
 	for (i = 0; i < copies; i++) {
-		int idx = get_nth_node(entry, nr, base_idx, i);
+		int idx = idxs[i];
 		if (memcmp(key->addr, entry[idx].addr, sizeof(key->addr)) == 0
 		    && key->port == entry[idx].port)
 			return idx;
@@ -1164,20 +2108,40 @@ enum rw_state {
 	RW_RUN,
 };
 
+/* the objects recovered are checkpointed in batches */
+#define RECOVERY_CKPT_BATCH 256
+#define RECOVERY_CKPT_INTERVAL 5	/* seconds */
+
 struct recovery_work {
 	enum rw_state state;
 
 	uint32_t epoch;
-	uint32_t done;
+	uint32_t next;		/* the next object to start recovering */
+	uint32_t nr_done;
+	struct timespec start;
 
 	struct timer timer;
 	int retry;
 	struct work work;
 
+	/* the objects being recovered, up to throttle_window */
+	int nr_inflight;
+	struct list_head inflight_list;
+
 	int nr_blocking;
 	int count;
 	uint64_t *oids;
 
+	/* a rejoin, see fill_delta_obj_list() */
+	uint32_t delta_epoch;
+	int nr_dirty;
+	uint64_t *dirty;
+
+	/* the objects recovered since the last checkpoint */
+	int nr_ckpt;
+	uint64_t ckpt_oids[RECOVERY_CKPT_BATCH];
+	time_t ckpt_time;
+
 	int old_nr_nodes;
 	struct sd_node old_nodes[SD_MAX_NODES];
 	int cur_nr_nodes;
@@ -1188,6 +2152,20 @@ struct recovery_work {
 	struct sd_vnode cur_vnodes[SD_MAX_VNODES];
 };
 
+/* an object being recovered by a worker of the recovery work queue */
+struct recovery_obj {
+	struct recovery_work *rw;
+	uint64_t oid;
+	struct sd_vnode *src;	/* the node recovered from first */
+	int retry;
+	int failed;
+	unsigned nr_bytes;	/* read from the replicas */
+
+	struct timer timer;
+	struct work work;
+	struct list_head list;
+};
+
 static struct recovery_work *next_rw;
 static struct recovery_work *recovering_work;
 
@@ -1202,14 +2180,11 @@ static struct recovery_work *recovering_work;
  *
  * For example, consider the number of redundancy is 5, the consistent
  * hash ring is {A, B, C, D, E, F}, and the node G is newly added.
- * The parameters of this function are
- *   old_entry = {A, B, C, D, E, F},    old_nr = 6, old_idx = 3
- *   cur_entry = {A, B, C, D, E, F, G}, cur_nr = 7, cur_idx = 3
- *
- * In this case:
- *   the previous target nodes: {D, E, F, A, B}
+ * If the object is placed on the 3rd node, the parameters of this
+ * function are
+ *   old_idxs = {D, E, F, A, B}
  *     (the first 5 nodes from the 3rd node on the previous hash ring)
- *   the current target nodes : {D, E, F, G, A}
+ *   cur_idxs = {D, E, F, G, A}
  *     (the first 5 nodes from the 3rd node on the current hash ring)
  *
  * The correspondence between copy_idx and return value are as follows:
@@ -1224,36 +2199,36 @@ static struct recovery_work *recovering_work;
  * node G recovers from the node B.
  */
 static int find_tgt_node(struct sd_vnode *old_entry,
-			 int old_nr, int old_idx, int old_copies,
+			 int *old_idxs, int old_copies,
 			 struct sd_vnode *cur_entry,
-			 int cur_nr, int cur_idx, int cur_copies,
+			 int *cur_idxs, int cur_copies,
 			 int copy_idx)
 {
 	int i, j, idx;
 
-	dprintf("%"PRIu32", %"PRIu32", %"PRIu32", %"PRIu32", %"PRIu32", %"PRIu32", %"PRIu32"\n",
-		old_idx, old_nr, old_copies, cur_idx, cur_nr, cur_copies, copy_idx);
+	dprintf("%"PRIu32", %"PRIu32", %"PRIu32", %"PRIu32", %"PRIu32"\n",
+		old_idxs[0], old_copies, cur_idxs[0], cur_copies, copy_idx);
 
 	/* If the same node is in the previous target nodes, return its index */
-	idx = contains_node(cur_entry + get_nth_node(cur_entry, cur_nr, cur_idx, copy_idx),
-			    old_entry, old_nr, old_idx, old_copies);
+	idx = contains_node(cur_entry + cur_idxs[copy_idx],
+			    old_entry, old_idxs, old_copies);
 	if (idx >= 0) {
-		dprintf("%"PRIu32", %"PRIu32", %"PRIu32", %"PRIu32"\n", idx, copy_idx, cur_idx, cur_nr);
+		dprintf("%"PRIu32", %"PRIu32", %"PRIu32"\n", idx, copy_idx, cur_idxs[0]);
 		return idx;
 	}
 
 	for (i = 0, j = 0; ; i++, j++) {
 		if (i < copy_idx) {
 			/* Skip if the node can recover from its local */
-			idx = contains_node(cur_entry + get_nth_node(cur_entry, cur_nr, cur_idx, i),
-					    old_entry, old_nr, old_idx, old_copies);
+			idx = contains_node(cur_entry + cur_idxs[i],
+					    old_entry, old_idxs, old_copies);
 			if (idx >= 0)
 				continue;
 
 			/* Find the next target which needs to recover from remote */
 			while (j < old_copies &&
-			       contains_node(old_entry + get_nth_node(old_entry, old_nr, old_idx, j),
-					     cur_entry, cur_nr, cur_idx, cur_copies) >= 0)
+			       contains_node(old_entry + old_idxs[j],
+					     cur_entry, cur_idxs, cur_copies) >= 0)
 				j++;
 		}
 		if (j == old_copies) {
@@ -1262,15 +2237,14 @@ static int find_tgt_node(struct sd_vnode *old_entry,
 			 * is smaller than the number of copies.  We can select
 			 * any node in this case, so select the first one.
 			 */
-			return old_idx;
+			return old_idxs[0];
 		}
 
 		if (i == copy_idx) {
 			/* Found the target node correspoinding to copy_idx */
 			dprintf("%"PRIu32", %"PRIu32", %"PRIu32"\n",
-				get_nth_node(old_entry, old_nr, old_idx, j),
-				copy_idx, (cur_idx + i) % cur_nr);
-			return get_nth_node(old_entry, old_nr, old_idx, j);
+				old_idxs[j], copy_idx, cur_idxs[i]);
+			return old_idxs[j];
 		}
 
 	}
@@ -1299,36 +2273,47 @@ static void *get_vnodes_from_epoch(int epoch, int *nr, int *copies)
 	return buf;
 }
 
+static int oid_cmp(const void *a, const void *b)
+{
+	uint64_t oid1 = *(const uint64_t *)a, oid2 = *(const uint64_t *)b;
+
+	if (oid1 < oid2)
+		return -1;
+	if (oid1 > oid2)
+		return 1;
+	return 0;
+}
+
+static unsigned get_objsize(uint64_t oid)
+{
+	if (is_vdi_obj(oid))
+		return SD_INODE_SIZE;
+	if (is_vdi_attr_obj(oid))
+		return SD_ATTR_OBJ_SIZE;
+	return SD_DATA_OBJ_SIZE;
+}
+
 static int recover_object_from_replica(uint64_t oid,
 				       struct sd_vnode *entry,
-				       int epoch, int tgt_epoch)
+				       int epoch, int tgt_epoch,
+				       unsigned *nr_bytes)
 {
 	struct sd_obj_req hdr;
 	struct sd_obj_rsp *rsp = (struct sd_obj_rsp *)&hdr;
 	char name[128];
-	unsigned wlen = 0, rlen;
+	unsigned wlen = 0, rlen, buf_len = 0;
 	int fd, ret = -1;
-	void *buf;
+	void *buf = NULL;
 	struct siocb iocb = { 0 };
 
-	if (is_vdi_obj(oid))
-		rlen = SD_INODE_SIZE;
-	else if (is_vdi_attr_obj(oid))
-		rlen = SD_ATTR_OBJ_SIZE;
-	else
-		rlen = SD_DATA_OBJ_SIZE;
-
-	buf = valloc(rlen);
-	if (!buf) {
-		eprintf("%m\n");
-		goto out;
-	}
+	rlen = get_objsize(oid);
 
 	if (is_myself(entry->addr, entry->port)) {
 		iocb.epoch = epoch;
 		iocb.length = rlen;
 		ret = sd_store->link(oid, &iocb, tgt_epoch);
 		if (ret == SD_RES_SUCCESS) {
+			*nr_bytes += rlen;
 			ret = 0;
 			goto done;
 		} else {
@@ -1337,6 +2322,18 @@ static int recover_object_from_replica(uint64_t oid,
 		}
 	}
 
+	/* the holes of data objects are neither sent nor written */
+	if (is_data_obj(oid))
+		buf_len = SD_SPARSE_OBJ_SIZE;
+	else
+		buf_len = rlen;
+
+	buf = alloc_buffer(buf_len);
+	if (!buf) {
+		eprintf("%m\n");
+		goto out;
+	}
+
 	addr_to_str(name, sizeof(name), entry->addr, 0);
 	fd = connect_to(name, entry->port);
 	dprintf("%s, %d\n", name, entry->port);
@@ -1351,8 +2348,11 @@ static int recover_object_from_replica(uint64_t oid,
 	hdr.oid = oid;
 	hdr.epoch = epoch;
 	hdr.flags = SD_FLAG_CMD_RECOVERY | SD_FLAG_CMD_IO_LOCAL;
+	if (is_data_obj(oid))
+		hdr.flags |= SD_FLAG_CMD_SPARSE;
 	hdr.tgt_epoch = tgt_epoch;
-	hdr.data_length = rlen;
+	hdr.data_length = buf_len;
+	rlen = buf_len;
 
 	ret = exec_req(fd, (struct sd_req *)&hdr, buf, &wlen, &rlen);
 
@@ -1367,7 +2367,13 @@ static int recover_object_from_replica(uint64_t oid,
 	rsp = (struct sd_obj_rsp *)&hdr;
 
 	if (rsp->result == SD_RES_SUCCESS) {
+		if (rsp->flags & SD_FLAG_CMD_SPARSE &&
+		    check_extent_map(buf, rlen) < 0) {
+			ret = -1;
+			goto out;
+		}
 		iocb.epoch = epoch;
+		iocb.flags = rsp->flags & SD_FLAG_CMD_SPARSE;
 		iocb.length = rlen;
 		iocb.buf = buf;
 		ret = sd_store->atomic_put(oid, &iocb);
@@ -1375,9 +2381,11 @@ static int recover_object_from_replica(uint64_t oid,
 			ret = -1;
 			goto out;
 		}
+		*nr_bytes += rlen;
 	} else if (rsp->result == SD_RES_NEW_NODE_VER ||
 			rsp->result == SD_RES_OLD_NODE_VER ||
-			rsp->result == SD_RES_NETWORK_ERROR) {
+			rsp->result == SD_RES_NETWORK_ERROR ||
+			rsp->result == SD_RES_WAIT_FOR_JOIN) {
 		dprintf("retrying: %"PRIx32", %"PRIx64"\n", rsp->result, oid);
 		ret = 1;
 		goto out;
@@ -1389,7 +2397,7 @@ static int recover_object_from_replica(uint64_t oid,
 done:
 	dprintf("recovered oid %"PRIx64" from %d to epoch %d\n", oid, tgt_epoch, epoch);
 out:
-	free(buf);
+	free_buffer(buf, buf_len);
 	return ret;
 }
 
@@ -1413,25 +2421,23 @@ static void rollback_old_cur(struct sd_vnode *old, int *old_nr, int *old_copies,
  * the routine will try to recovery it from the nodes it has stayed,
  * at least, *theoretically* on consistent hash ring.
  */
-static int do_recover_object(struct recovery_work *rw, int copy_idx)
+static int do_recover_object(struct recovery_work *rw, uint64_t oid,
+			     int copy_idx, unsigned *nr_bytes)
 {
-	struct sd_vnode *old, *cur;
-	uint64_t oid = rw->oids[rw->done];
+	struct sd_vnode *old = rw->old_vnodes, *cur = rw->cur_vnodes;
+	struct sd_vnode *old_buf = NULL, *cur_buf = NULL;
 	int old_nr = rw->old_nr_vnodes, cur_nr = rw->cur_nr_vnodes;
 	int epoch = rw->epoch, tgt_epoch = rw->epoch - 1;
 	struct sd_vnode *tgt_entry;
-	int old_idx, cur_idx, tgt_idx, old_copies, cur_copies, ret;
+	int old_idxs[SD_MAX_REDUNDANCY], cur_idxs[SD_MAX_REDUNDANCY];
+	int tgt_idx, old_copies, cur_copies, ret;
 
-	old = xmalloc(sizeof(*old) * SD_MAX_VNODES);
-	cur = xmalloc(sizeof(*cur) * SD_MAX_VNODES);
-	memcpy(old, rw->old_vnodes, sizeof(*old) * old_nr);
-	memcpy(cur, rw->cur_vnodes, sizeof(*cur) * cur_nr);
 	old_copies = get_max_copies(rw->old_nodes, rw->old_nr_nodes);
 	cur_copies = get_max_copies(rw->cur_nodes, rw->cur_nr_nodes);
 
 again:
-	old_idx = obj_to_sheep(old, old_nr, oid, 0);
-	cur_idx = obj_to_sheep(cur, cur_nr, oid, 0);
+	old_copies = obj_to_vnodes(old, old_nr, oid, old_copies, old_idxs);
+	cur_copies = obj_to_vnodes(cur, cur_nr, oid, cur_copies, cur_idxs);
 
 	dprintf("try recover object %"PRIx64" from epoch %"PRIu32"\n", oid, tgt_epoch);
 
@@ -1442,8 +2448,8 @@ again:
 		goto err;
 	}
 
-	tgt_idx = find_tgt_node(old, old_nr, old_idx, old_copies,
-			cur, cur_nr, cur_idx, cur_copies, copy_idx);
+	tgt_idx = find_tgt_node(old, old_idxs, old_copies,
+			cur, cur_idxs, cur_copies, copy_idx);
 	if (tgt_idx < 0) {
 		eprintf("cannot find target node %"PRIx64"\n", oid);
 		ret = -1;
@@ -1451,7 +2457,8 @@ again:
 	}
 	tgt_entry = old + tgt_idx;
 
-	ret = recover_object_from_replica(oid, tgt_entry, epoch, tgt_epoch);
+	ret = recover_object_from_replica(oid, tgt_entry, epoch, tgt_epoch,
+					  nr_bytes);
 	if (ret < 0) {
 		struct sd_vnode *new_old;
 		int new_old_nr, new_old_copies;
@@ -1468,26 +2475,35 @@ again:
 			ret = -1;
 			goto err;
 		}
+
+		/* the node lists of rw are shared by the workers */
+		if (!old_buf) {
+			old_buf = xmalloc(sizeof(*old) * SD_MAX_VNODES);
+			cur_buf = xmalloc(sizeof(*cur) * SD_MAX_VNODES);
+			memcpy(old_buf, old, sizeof(*old) * old_nr);
+			old = old_buf;
+			cur = cur_buf;
+		}
 		rollback_old_cur(old, &old_nr, &old_copies, cur, &cur_nr, &cur_copies,
 				new_old, new_old_nr, new_old_copies);
 		free(new_old);
 		goto again;
-	} else if (ret > 0) {
-		ret = 0;
-		rw->retry = 1;
 	}
 err:
-	free(old);
-	free(cur);
+	free(old_buf);
+	free(cur_buf);
 	return ret;
 }
 
 static int get_replica_idx(struct recovery_work *rw, uint64_t oid, int *copy_nr)
 {
-	int i, ret = -1;
+	int i, ret = -1, idxs[SD_MAX_REDUNDANCY];
+
 	*copy_nr = get_max_copies(rw->cur_nodes, rw->cur_nr_nodes);
+	*copy_nr = obj_to_vnodes(rw->cur_vnodes, rw->cur_nr_vnodes, oid,
+				 *copy_nr, idxs);
 	for (i = 0; i < *copy_nr; i++) {
-		int n = obj_to_sheep(rw->cur_vnodes, rw->cur_nr_vnodes, oid, i);
+		int n = idxs[i];
 		if (is_myself(rw->cur_vnodes[n].addr, rw->cur_vnodes[n].port)) {
 			ret = i;
 			break;
@@ -1496,18 +2512,50 @@ static int get_replica_idx(struct recovery_work *rw, uint64_t oid, int *copy_nr)
 	return ret;
 }
 
+/*
+ * The node which do_recover_object() tries first for the object.  Returns
+ * NULL if this node doesn't hold the object in the current epoch.
+ */
+static struct sd_vnode *recovery_source(struct recovery_work *rw,
+					uint64_t oid)
+{
+	int old_idxs[SD_MAX_REDUNDANCY], cur_idxs[SD_MAX_REDUNDANCY];
+	int old_copies, cur_copies, copy_idx, idx;
+
+	copy_idx = get_replica_idx(rw, oid, &cur_copies);
+	if (copy_idx < 0)
+		return NULL;
+
+	old_copies = get_max_copies(rw->old_nodes, rw->old_nr_nodes);
+	old_copies = obj_to_vnodes(rw->old_vnodes, rw->old_nr_vnodes, oid,
+				   old_copies, old_idxs);
+	obj_to_vnodes(rw->cur_vnodes, rw->cur_nr_vnodes, oid, cur_copies,
+		      cur_idxs);
+
+	idx = find_tgt_node(rw->old_vnodes, old_idxs, old_copies,
+			    rw->cur_vnodes, cur_idxs, cur_copies, copy_idx);
+	if (idx < 0)
+		return NULL;
+
+	return rw->old_vnodes + idx;
+}
+
 static void recover_object(struct work *work)
 {
-	struct recovery_work *rw = container_of(work, struct recovery_work, work);
-	uint64_t oid = rw->oids[rw->done];
+	struct recovery_obj *robj = container_of(work, struct recovery_obj,
+						 work);
+	struct recovery_work *rw = robj->rw;
+	uint64_t oid = robj->oid;
 	uint32_t epoch = rw->epoch;
 	int i, copy_idx, copy_nr, ret;
 	struct siocb iocb = { 0 };
 
+	robj->retry = 0;
+
 	if (!sys->nr_sobjs)
 		return;
 
-	eprintf("done:%"PRIu32" count:%"PRIu32", oid:%"PRIx64"\n", rw->done, rw->count, oid);
+	dprintf("oid:%"PRIx64"\n", oid);
 
 	iocb.epoch = epoch;
 	ret = sd_store->open(oid, &iocb, 0);
@@ -1517,39 +2565,415 @@ static void recover_object(struct work *work)
 		return;
 	}
 
+	if (rw->delta_epoch &&
+	    !bsearch(&oid, rw->dirty, rw->nr_dirty, sizeof(oid), oid_cmp)) {
+		/* not written while this node was away */
+		iocb.length = get_objsize(oid);
+		ret = sd_store->link(oid, &iocb, rw->delta_epoch);
+		if (ret == SD_RES_SUCCESS) {
+			robj->nr_bytes += iocb.length;
+			return;
+		}
+		dprintf("%"PRIx64" is not at epoch %"PRIu32"\n", oid,
+			rw->delta_epoch);
+	}
+
 	copy_idx = get_replica_idx(rw, oid, &copy_nr);
 	if (copy_idx < 0) {
 		ret = -1;
 		goto err;
 	}
-	ret = do_recover_object(rw, copy_idx);
+	ret = do_recover_object(rw, oid, copy_idx, &robj->nr_bytes);
 	if (ret < 0) {
 		for (i = 0; i < copy_nr; i++) {
 			if (i == copy_idx)
 				continue;
-			ret = do_recover_object(rw, i);
-			if (ret == 0)
+			ret = do_recover_object(rw, oid, i, &robj->nr_bytes);
+			if (ret >= 0)
 				break;
 		}
 	}
+	if (ret > 0)
+		robj->retry = 1;
 err:
-	if (ret < 0)
+	if (ret < 0) {
 		eprintf("failed to recover object %"PRIx64"\n", oid);
+		robj->failed = 1;
+	}
 }
 
 static struct recovery_work *suspended_recovery_work;
 
+static void run_recovery(struct recovery_work *rw);
+
+/*
+ * Recovery throttling
+ *
+ * Token buckets limit the objects and the bytes recovered per second,
+ * and hold up to a second worth of tokens.  The bytes of an object are
+ * known only when it is done, so they are charged then and the bucket
+ * may go into debt.  When the foreground thresholds are set, the window
+ * of objects in flight is halved every interval the foreground requests
+ * go above them, and grows back by one every interval they do not.
+ */
+#define THROTTLE_INTERVAL 100000	/* usec */
+
+static int64_t obj_tokens;	/* in millionths of an object */
+static int64_t byte_tokens;
+static struct timespec last_refill;
+static int throttle_window;	/* objects allowed in flight */
+static struct timer throttle_timer;
+static int throttle_timer_pending;
+static uint64_t nr_throttled;
+
+/* latency of the foreground requests done in the current interval */
+static uint64_t fg_latency_sum, fg_latency;
+static uint32_t nr_fg_latency;
+
+/* called in the main thread when a foreground request is done */
+void add_foreground_latency(uint64_t lat)
+{
+	fg_latency_sum += lat;
+	nr_fg_latency++;
+}
+
+void set_recovery_throttle(const struct sd_recovery_throttle *t)
+{
+	sys->recovery_throttle = *t;
+
+	/* start with full buckets */
+	memset(&last_refill, 0, sizeof(last_refill));
+	obj_tokens = 0;
+	byte_tokens = 0;
+	throttle_window = sys->recovery_window;
+
+	vprintf(SDOG_INFO, "recovery throttle: %"PRIu64" bytes/s, %"PRIu32
+		" objects/s, latency %"PRIu32" ms, queue depth %"PRIu32"\n",
+		t->bytes_per_sec, t->objs_per_sec, t->max_latency,
+		t->max_queue_depth);
+}
+
+static void refill_tokens(void)
+{
+	struct sd_recovery_throttle *t = &sys->recovery_throttle;
+	struct timespec now;
+	int64_t elapsed, cap;
+	int overloaded;
+
+	if (!throttle_window)
+		throttle_window = sys->recovery_window;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (int64_t)(now.tv_sec - last_refill.tv_sec) * 1000000 +
+		(now.tv_nsec - last_refill.tv_nsec) / 1000;
+	if (elapsed < THROTTLE_INTERVAL)
+		return;
+	last_refill = now;
+	if (elapsed > 1000000)
+		elapsed = 1000000;
+
+	cap = (int64_t)t->objs_per_sec * 1000000;
+	obj_tokens = min(obj_tokens + (int64_t)t->objs_per_sec * elapsed, cap);
+
+	/* an object must fit in the bucket */
+	cap = max((int64_t)t->bytes_per_sec, (int64_t)SD_DATA_OBJ_SIZE);
+	byte_tokens = min(byte_tokens +
+			  (int64_t)t->bytes_per_sec * elapsed / 1000000, cap);
+
+	fg_latency = nr_fg_latency ? fg_latency_sum / nr_fg_latency : 0;
+	fg_latency_sum = 0;
+	nr_fg_latency = 0;
+
+	overloaded = (t->max_latency &&
+		      fg_latency > (uint64_t)t->max_latency * 1000) ||
+		(t->max_queue_depth &&
+		 (uint32_t)sys->nr_outstanding_io > t->max_queue_depth);
+	if (overloaded) {
+		if (throttle_window > 1)
+			dprintf("foreground latency %"PRIu64" us, %d requests "
+				"in flight, backing off\n", fg_latency,
+				sys->nr_outstanding_io);
+		throttle_window = max(throttle_window / 2, 1);
+	} else if (throttle_window < sys->recovery_window)
+		throttle_window++;
+}
+
+static void throttle_timer_fn(void *data)
+{
+	throttle_timer_pending = 0;
+
+	if (recovering_work)
+		run_recovery(recovering_work);
+}
+
+/* Returns true if the recovery has to wait before starting an object */
+static int recovery_throttled(struct recovery_work *rw)
+{
+	struct sd_recovery_throttle *t = &sys->recovery_throttle;
+
+	refill_tokens();
+
+	/* the objects done in flight run the recovery again */
+	if (rw->nr_inflight >= throttle_window)
+		return 1;
+
+	if ((t->objs_per_sec && obj_tokens < 1000000) ||
+	    (t->bytes_per_sec && byte_tokens <= 0)) {
+		if (!throttle_timer_pending) {
+			throttle_timer_pending = 1;
+			nr_throttled++;
+			throttle_timer.callback = throttle_timer_fn;
+			throttle_timer.data = NULL;
+			add_timer(&throttle_timer, 1);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+void get_recovery_stat(struct sd_recovery_stat *stat)
+{
+	struct recovery_work *rw = recovering_work;
+
+	memset(stat, 0, sizeof(*stat));
+	stat->throttle = sys->recovery_throttle;
+	if (rw) {
+		stat->epoch = rw->epoch;
+		stat->nr_done = rw->nr_done;
+		stat->nr_objs = rw->count;
+	}
+	stat->window = throttle_window ? throttle_window : sys->recovery_window;
+	stat->latency = fg_latency;
+	stat->nr_throttled = nr_throttled;
+}
+
+/*
+ * Recovery checkpoint
+ *
+ * The object list of the recovery is written to the checkpoint file once
+ * it is ready, and the objects recovered are appended to it in batches.
+ * If sheep restarts while the cluster stays at the epoch, the recovery
+ * resumes with the objects of the list which were not appended.  The
+ * file is removed when the recovery finishes, and replaced when the
+ * recovery of another epoch starts.
+ */
+struct recovery_ckpt_header {
+	uint32_t epoch;
+	uint32_t nr_oids;	/* the object list which follows */
+};
+
+static int write_checkpoint_file(uint32_t epoch, uint64_t *oids, int nr)
+{
+	struct recovery_ckpt_header hdr;
+	size_t len = sizeof(uint64_t) * nr;
+	char tmp[PATH_MAX];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", recovery_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, def_fmode);
+	if (fd < 0) {
+		eprintf("failed to open %s, %m\n", tmp);
+		return -1;
+	}
+
+	hdr.epoch = epoch;
+	hdr.nr_oids = nr;
+	if (xwrite(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    xwrite(fd, oids, len) != len || fsync(fd) < 0) {
+		eprintf("failed to write %s, %m\n", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp, recovery_path) < 0) {
+		eprintf("failed to rename %s, %m\n", tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called in the worker before the object list is made.  The checkpoint
+ * without a list isn't resumed, but tells a node which stops meanwhile
+ * that it didn't finish the recovery.
+ */
+static void begin_checkpoint(struct recovery_work *rw)
+{
+	write_checkpoint_file(rw->epoch, NULL, 0);
+}
+
+/* called in the worker when the object list is ready */
+static void write_checkpoint(struct recovery_work *rw)
+{
+	if (!rw->count) {
+		unlink(recovery_path);
+		return;
+	}
+
+	if (write_checkpoint_file(rw->epoch, rw->oids, rw->count) == 0)
+		rw->ckpt_time = time(NULL);
+}
+
+static void flush_checkpoint(struct recovery_work *rw)
+{
+	int fd;
+
+	fd = open(recovery_path, O_WRONLY | O_APPEND);
+	if (fd >= 0) {
+		if (xwrite(fd, rw->ckpt_oids,
+			   sizeof(uint64_t) * rw->nr_ckpt) < 0)
+			eprintf("failed to write %s, %m\n", recovery_path);
+		close(fd);
+	}
+
+	rw->nr_ckpt = 0;
+	rw->ckpt_time = time(NULL);
+}
+
+static void checkpoint_obj(struct recovery_work *rw, uint64_t oid)
+{
+	rw->ckpt_oids[rw->nr_ckpt++] = oid;
+
+	if (rw->nr_ckpt == RECOVERY_CKPT_BATCH ||
+	    time(NULL) - rw->ckpt_time >= RECOVERY_CKPT_INTERVAL)
+		flush_checkpoint(rw);
+}
+
+/*
+ * Load the objects left to recover from the checkpoint of the epoch of
+ * the recovery.  Returns -1 if there is no such checkpoint.
+ */
+static int load_checkpoint(struct recovery_work *rw)
+{
+	struct recovery_ckpt_header hdr;
+	struct stat st;
+	uint64_t *list = NULL, *done = NULL;
+	size_t nr_done;
+	int fd, i, nr = 0, ret = -1;
+
+	fd = open(recovery_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || xread(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out;
+	if (hdr.epoch != rw->epoch) {
+		dprintf("the checkpoint is of epoch %"PRIu32"\n", hdr.epoch);
+		goto out;
+	}
+	if (!hdr.nr_oids) {
+		dprintf("the object list wasn't ready\n");
+		goto out;
+	}
+	if (st.st_size < sizeof(hdr) + sizeof(uint64_t) * hdr.nr_oids)
+		goto out;
+
+	/* a batch may have been written partly */
+	nr_done = (st.st_size - sizeof(hdr)) / sizeof(uint64_t) - hdr.nr_oids;
+
+	list = xmalloc(sizeof(uint64_t) * hdr.nr_oids);
+	done = xmalloc(sizeof(uint64_t) * nr_done);
+	if (xread(fd, list, sizeof(uint64_t) * hdr.nr_oids) !=
+	    sizeof(uint64_t) * hdr.nr_oids ||
+	    xread(fd, done, sizeof(uint64_t) * nr_done) !=
+	    sizeof(uint64_t) * nr_done)
+		goto out;
+
+	/* keeps the order of the list */
+	qsort(done, nr_done, sizeof(uint64_t), oid_cmp);
+	for (i = 0; i < hdr.nr_oids; i++)
+		if (!bsearch(list + i, done, nr_done, sizeof(uint64_t), oid_cmp))
+			list[nr++] = list[i];
+
+	vprintf(SDOG_INFO, "resuming the recovery of epoch %"PRIu32", %d of "
+		"%"PRIu32" objects left\n", rw->epoch, nr, hdr.nr_oids);
+
+	rw->oids = list;
+	rw->count = nr;
+	rw->ckpt_time = time(NULL);
+	list = NULL;
+	ret = 0;
+out:
+	close(fd);
+	free(list);
+	free(done);
+	return ret;
+}
+
+/*
+ * Called when the cluster starts again at the epoch it stopped at, to
+ * resume the recovery this node was doing then.
+ */
+void recover_from_checkpoint(uint32_t epoch)
+{
+	struct recovery_ckpt_header hdr;
+	int fd, ret;
+
+	fd = open(recovery_path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	ret = xread(fd, &hdr, sizeof(hdr));
+	close(fd);
+
+	if (ret != sizeof(hdr) || hdr.epoch != epoch) {
+		dprintf("dropping the recovery checkpoint\n");
+		unlink(recovery_path);
+		return;
+	}
+
+	if (!recovering_work)
+		start_recovery(epoch);
+}
+
 static void recover_timer(void *data)
 {
 	struct recovery_work *rw = (struct recovery_work *)data;
-	uint64_t oid = rw->oids[rw->done];
 
-	if (is_access_to_busy_objects(oid)) {
-		suspended_recovery_work = rw;
+	queue_work(sys->recovery_wqueue, &rw->work);
+}
+
+static void recover_object_timer(void *data)
+{
+	struct recovery_obj *robj = data;
+
+	if (is_access_to_busy_objects(robj->oid)) {
+		add_timer(&robj->timer, 1);
 		return;
 	}
 
-	queue_work(sys->recovery_wqueue, &rw->work);
+	queue_work(sys->recovery_wqueue, &robj->work);
+}
+
+static void recover_object_done(struct work *work)
+{
+	struct recovery_obj *robj = container_of(work, struct recovery_obj,
+						 work);
+	struct recovery_work *rw = robj->rw;
+
+	/* the peer is in another epoch, try again later */
+	if (robj->retry && !next_rw) {
+		robj->timer.callback = recover_object_timer;
+		robj->timer.data = robj;
+		add_timer(&robj->timer, 2);
+		return;
+	}
+
+	list_del(&robj->list);
+	rw->nr_inflight--;
+	rw->nr_done++;
+	if (!robj->failed)
+		checkpoint_obj(rw, robj->oid);
+	if (sys->recovery_throttle.bytes_per_sec)
+		byte_tokens -= robj->nr_bytes;
+	free(robj);
+
+	resume_pending_requests();
+	run_recovery(rw);
 }
 
 void resume_recovery_work(void)
@@ -1562,12 +2986,11 @@ void resume_recovery_work(void)
 
 	rw = suspended_recovery_work;
 
-	oid =  rw->oids[rw->done];
+	oid =  rw->oids[rw->next];
 	if (is_access_to_busy_objects(oid))
 		return;
 
-	suspended_recovery_work = NULL;
-	queue_work(sys->recovery_wqueue, &rw->work);
+	run_recovery(rw);
 }
 
 int node_in_recovery(void)
@@ -1580,6 +3003,7 @@ int is_recoverying_oid(uint64_t oid)
 	uint64_t hval = fnv_64a_buf(&oid, sizeof(uint64_t), FNV1A_64_INIT);
 	uint64_t min_hval;
 	struct recovery_work *rw = recovering_work;
+	struct recovery_obj *robj;
 	int ret, i;
 	struct siocb iocb;
 
@@ -1589,11 +3013,10 @@ int is_recoverying_oid(uint64_t oid)
 	if (!rw)
 		return 0; /* there is no thread working for object recovery */
 
-	min_hval = fnv_64a_buf(&rw->oids[rw->done + rw->nr_blocking], sizeof(uint64_t), FNV1A_64_INIT);
-
 	if (before(rw->epoch, sys->epoch))
 		return 1;
 
+	/* the list is being filled */
 	if (rw->state == RW_INIT)
 		return 1;
 
@@ -1606,77 +3029,116 @@ int is_recoverying_oid(uint64_t oid)
 		return 0;
 	}
 
+	list_for_each_entry(robj, &rw->inflight_list, list)
+		if (robj->oid == oid)
+			return 1;
+
 	/* the first 'rw->nr_blocking' objects were already scheduled to be done earlier */
 	for (i = 0; i < rw->nr_blocking; i++)
-		if (rw->oids[rw->done + i] == oid)
+		if (rw->oids[rw->next + i] == oid)
 			return 1;
 
+	if (rw->next + rw->nr_blocking >= rw->count)
+		goto out;
+
+	min_hval = fnv_64a_buf(&rw->oids[rw->next + rw->nr_blocking], sizeof(uint64_t), FNV1A_64_INIT);
 	if (min_hval <= hval) {
 		uint64_t *p;
-		p = bsearch(&oid, rw->oids + rw->done + rw->nr_blocking,
-			    rw->count - rw->done - rw->nr_blocking, sizeof(oid), obj_cmp);
+		p = bsearch(&oid, rw->oids + rw->next + rw->nr_blocking,
+			    rw->count - rw->next - rw->nr_blocking, sizeof(oid), obj_cmp);
 		if (p) {
 			dprintf("recover the object %" PRIx64 " first\n", oid);
-			if (rw->nr_blocking == 0)
-				rw->nr_blocking = 1; /* the first oid may be processed now */
-			if (p > rw->oids + rw->done + rw->nr_blocking) {
+			if (p > rw->oids + rw->next + rw->nr_blocking) {
 				/* this object should be recovered earlier */
-				memmove(rw->oids + rw->done + rw->nr_blocking + 1,
-					rw->oids + rw->done + rw->nr_blocking,
-					sizeof(uint64_t) * (p - (rw->oids + rw->done + rw->nr_blocking)));
-				rw->oids[rw->done + rw->nr_blocking] = oid;
-				rw->nr_blocking++;
+				memmove(rw->oids + rw->next + rw->nr_blocking + 1,
+					rw->oids + rw->next + rw->nr_blocking,
+					sizeof(uint64_t) * (p - (rw->oids + rw->next + rw->nr_blocking)));
+				rw->oids[rw->next + rw->nr_blocking] = oid;
 			}
+			rw->nr_blocking++;
 			return 1;
 		}
 	}
-
+out:
 	dprintf("the object %" PRIx64 " is not found\n", oid);
 	return 0;
 }
 
-static void do_recover_main(struct work *work)
+#define RECOVERY_LOOKAHEAD 64
+
+static int nr_inflight_from(struct recovery_work *rw, struct sd_vnode *src)
 {
-	struct recovery_work *rw = container_of(work, struct recovery_work, work);
-	uint64_t oid;
+	struct recovery_obj *robj;
+	int nr = 0;
 
-	if (rw->state == RW_INIT)
-		rw->state = RW_RUN;
-	else if (!rw->retry) {
-		rw->done++;
-		if (rw->nr_blocking > 0)
-			rw->nr_blocking--;
-	}
+	list_for_each_entry(robj, &rw->inflight_list, list)
+		if (robj->src && robj->src->port == src->port &&
+		    !memcmp(robj->src->addr, src->addr, sizeof(src->addr)))
+			nr++;
 
-	oid = rw->oids[rw->done];
+	return nr;
+}
 
-	if (rw->retry && !next_rw) {
-		rw->retry = 0;
+/*
+ * Move the object to recover next to rw->oids[rw->next].  The objects
+ * which requests wait for go first.  The rest are sorted by hash, so
+ * neighbours mostly live on the same nodes; look ahead for an object
+ * whose source has less than its share of the window in flight, to
+ * spread the recovery over the source nodes.
+ */
+static struct sd_vnode *pick_next_object(struct recovery_work *rw)
+{
+	int i, end, limit;
+	struct sd_vnode *src, *first;
+	uint64_t oid;
 
-		rw->timer.callback = recover_timer;
-		rw->timer.data = rw;
-		add_timer(&rw->timer, 2);
-		return;
-	}
+	first = recovery_source(rw, rw->oids[rw->next]);
+	if (rw->nr_blocking || !first)
+		return first;
 
-	if (rw->done < rw->count && !next_rw) {
-		rw->work.fn = recover_object;
+	limit = DIV_ROUND_UP(throttle_window, rw->old_nr_nodes);
+	end = rw->next + RECOVERY_LOOKAHEAD;
+	if (end > rw->count)
+		end = rw->count;
 
-		if (is_access_to_busy_objects(oid)) {
-			suspended_recovery_work = rw;
-			return;
-		}
-		resume_pending_requests();
-		queue_work(sys->recovery_wqueue, &rw->work);
-		return;
+	for (i = rw->next, src = first; i < end;) {
+		if (!src || nr_inflight_from(rw, src) < limit)
+			break;
+		if (++i < end)
+			src = recovery_source(rw, rw->oids[i]);
 	}
+	if (i == end || i == rw->next)
+		return first;
+
+	/* keeps the rest sorted for is_recoverying_oid() */
+	oid = rw->oids[i];
+	memmove(rw->oids + rw->next + 1, rw->oids + rw->next,
+		sizeof(uint64_t) * (i - rw->next));
+	rw->oids[rw->next] = oid;
+
+	return src;
+}
+
+static void finish_recovery(struct recovery_work *rw)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	vprintf(SDOG_INFO, "recovered %"PRIu32" of %d objects of epoch %"PRIu32
+		" in %.3f seconds\n", rw->nr_done, rw->count, rw->epoch,
+		(end.tv_sec - rw->start.tv_sec) +
+		(end.tv_nsec - rw->start.tv_nsec) / 1e9);
 
 	dprintf("recovery complete: new epoch %"PRIu32"\n", rw->epoch);
+	unlink(recovery_path);
 	recovering_work = NULL;
+	if (suspended_recovery_work == rw)
+		suspended_recovery_work = NULL;
 
 	sys->recovered_epoch = rw->epoch;
 
 	free(rw->oids);
+	free(rw->dirty);
 	free(rw);
 
 	if (next_rw) {
@@ -1696,18 +3158,103 @@ static void do_recover_main(struct work *work)
 	resume_pending_requests();
 }
 
-static int request_obj_list(struct sd_node *e, uint32_t epoch,
-			   uint8_t *buf, size_t buf_size)
+/*
+ * Keep the objects the throttle allows in flight, up to
+ * sys->recovery_window, and finish the recovery when they are all done.
+ * A new epoch stops starting objects, and the recovery moves on to it once
+ * the objects in flight are done.
+ */
+static void run_recovery(struct recovery_work *rw)
+{
+	struct recovery_obj *robj;
+	struct sd_vnode *src;
+	uint64_t oid;
+
+	if (rw->state != RW_RUN)
+		return;
+
+	suspended_recovery_work = NULL;
+
+	while (!next_rw && rw->next < rw->count && !recovery_throttled(rw)) {
+		src = pick_next_object(rw);
+		oid = rw->oids[rw->next];
+
+		if (is_access_to_busy_objects(oid)) {
+			suspended_recovery_work = rw;
+			return;
+		}
+
+		if (sys->recovery_throttle.objs_per_sec)
+			obj_tokens -= 1000000;
+
+		robj = xzalloc(sizeof(*robj));
+		robj->rw = rw;
+		robj->oid = oid;
+		robj->src = src;
+		robj->work.fn = recover_object;
+		robj->work.done = recover_object_done;
+		list_add_tail(&robj->list, &rw->inflight_list);
+		rw->nr_inflight++;
+
+		rw->next++;
+		if (rw->nr_blocking > 0)
+			rw->nr_blocking--;
+
+		queue_work(sys->recovery_wqueue, &robj->work);
+	}
+
+	if (rw->nr_inflight || (!next_rw && rw->next < rw->count))
+		return;
+
+	finish_recovery(rw);
+}
+
+/* called when the object list is ready */
+static void do_recover_main(struct work *work)
+{
+	struct recovery_work *rw = container_of(work, struct recovery_work, work);
+
+	if (rw->retry && !next_rw) {
+		rw->retry = 0;
+
+		rw->timer.callback = recover_timer;
+		rw->timer.data = rw;
+		add_timer(&rw->timer, 2);
+		return;
+	}
+
+	rw->state = RW_RUN;
+
+	resume_pending_requests();
+	run_recovery(rw);
+}
+
+/*
+ * The objects listed by a node, a page at a time.  The pages come sorted
+ * by oid and only have the objects this node holds in the new epoch.
+ */
+struct obj_list_stream {
+	struct sd_node *node;
+	uint64_t *oids;
+	int nr, pos;
+	uint64_t cursor;	/* where the next page starts, 0 at the end */
+};
+
+#define OBJ_LIST_PAGE 8192	/* oids */
+
+static int request_obj_list(struct recovery_work *rw, int my_idx,
+			    struct obj_list_stream *s)
 {
 	int fd, ret;
 	unsigned wlen, rlen;
 	char name[128];
 	struct sd_list_req hdr;
 	struct sd_list_rsp *rsp;
+	struct sd_node *e = s->node;
 
 	addr_to_str(name, sizeof(name), e->addr, 0);
 
-	dprintf("%s %"PRIu32"\n", name, e->port);
+	dprintf("%s %"PRIu32" %"PRIx64"\n", name, e->port, s->cursor);
 
 	fd = connect_to(name, e->port);
 	if (fd < 0) {
@@ -1716,15 +3263,18 @@ static int request_obj_list(struct sd_node *e, uint32_t epoch,
 	}
 
 	wlen = 0;
-	rlen = buf_size;
+	rlen = OBJ_LIST_PAGE * sizeof(uint64_t);
 
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.opcode = SD_OP_GET_OBJ_LIST;
-	hdr.tgt_epoch = epoch - 1;
-	hdr.flags = 0;
+	hdr.tgt_epoch = rw->epoch - 1;
+	hdr.flags = SD_FLAG_CMD_FILTER;
+	hdr.dst_idx = my_idx;
+	hdr.dst_epoch = rw->epoch;
+	hdr.cursor = s->cursor;
 	hdr.data_length = rlen;
 
-	ret = exec_req(fd, (struct sd_req *)&hdr, buf, &wlen, &rlen);
+	ret = exec_req(fd, (struct sd_req *)&hdr, s->oids, &wlen, &rlen);
 
 	close(fd);
 
@@ -1735,9 +3285,13 @@ static int request_obj_list(struct sd_node *e, uint32_t epoch,
 		return -1;
 	}
 
-	dprintf("%"PRIu64"\n", rsp->data_length / sizeof(uint64_t));
+	s->nr = rsp->data_length / sizeof(uint64_t);
+	s->pos = 0;
+	s->cursor = rsp->cursor;
+
+	dprintf("%d\n", s->nr);
 
-	return rsp->data_length / sizeof(uint64_t);
+	return 0;
 }
 
 int merge_objlist(uint64_t *list1, int nr_list1, uint64_t *list2, int nr_list2)
@@ -1757,33 +3311,6 @@ int merge_objlist(uint64_t *list1, int nr_list1, uint64_t *list2, int nr_list2)
 	return nr_list1;
 }
 
-static int screen_obj_list(struct recovery_work *rw,  uint64_t *list, int list_nr)
-{
-	int ret, i, cp, idx;
-	struct strbuf buf = STRBUF_INIT;
-	struct sd_vnode *nodes = rw->cur_vnodes;
-	int nodes_nr = rw->cur_nr_vnodes;
-	int nr_objs = get_max_copies(rw->cur_nodes, rw->cur_nr_nodes);
-
-	for (i = 0; i < list_nr; i++) {
-		for (cp = 0; cp < nr_objs; cp++) {
-			idx = obj_to_sheep(nodes, nodes_nr, list[i], cp);
-			if (is_myself(nodes[idx].addr, nodes[idx].port))
-				break;
-		}
-		if (cp == nr_objs)
-			continue;
-		strbuf_add(&buf, &list[i], sizeof(uint64_t));
-	}
-	memcpy(list, buf.buf, buf.len);
-
-	ret = buf.len / sizeof(uint64_t);
-	dprintf("%d\n", ret);
-	strbuf_release(&buf);
-
-	return ret;
-}
-
 #define MAX_RETRY_CNT  6
 
 static int newly_joined(struct sd_node *node, struct recovery_work *rw)
@@ -1800,58 +3327,305 @@ static int newly_joined(struct sd_node *node, struct recovery_work *rw)
 	return 0;
 }
 
+/*
+ * Fetch the next page of the stream.  A node which keeps failing is
+ * given up on, and its stream ends.  Returns -1 if a new epoch came.
+ */
+static int next_obj_list_page(struct recovery_work *rw, int my_idx,
+			      struct obj_list_stream *s)
+{
+	int retry_cnt = 0;
+
+	while (request_obj_list(rw, my_idx, s) < 0) {
+		if (++retry_cnt > MAX_RETRY_CNT) {
+			eprintf("failed to get object list\n");
+			eprintf("some objects may be lost\n");
+			s->nr = s->pos = 0;
+			s->cursor = 0;
+			return 0;
+		}
+		if (next_rw) {
+			dprintf("go to the next recovery\n");
+			return -1;
+		}
+		dprintf("trying to get object list again\n");
+		sleep(1);
+	}
+
+	return 0;
+}
+
+static inline uint64_t stream_head(struct obj_list_stream *s)
+{
+	return s->oids[s->pos];
+}
+
+/* restore the order of the min-heap of streams from the top down */
+static void sift_down(struct obj_list_stream **heap, int nr, int i)
+{
+	struct obj_list_stream *tmp;
+	int child;
+
+	while ((child = i * 2 + 1) < nr) {
+		if (child + 1 < nr &&
+		    stream_head(heap[child + 1]) < stream_head(heap[child]))
+			child++;
+		if (stream_head(heap[i]) <= stream_head(heap[child]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void add_obj(struct recovery_work *rw, uint64_t oid, int *nr_alloc)
+{
+	if (rw->count == *nr_alloc) {
+		*nr_alloc = *nr_alloc ? *nr_alloc * 2 : OBJ_LIST_PAGE;
+		rw->oids = xrealloc(rw->oids, sizeof(uint64_t) * *nr_alloc);
+	}
+	rw->oids[rw->count++] = oid;
+}
+
+/*
+ * Merge the object lists of the nodes into rw->oids.  The lists come
+ * sorted by oid, so they are merged through a min-heap of their heads a
+ * page at a time, and the duplicates are next to each other.  The
+ * result is sorted by hash at the end for the recovery.
+ */
 static int fill_obj_list(struct recovery_work *rw)
 {
-	int i;
-	uint8_t *buf = NULL;
-	size_t buf_size = SD_DATA_OBJ_SIZE; /* FIXME */
-	int retry_cnt;
+	int i, my_idx, nr_heap = 0, nr_alloc = 0;
 	struct sd_node *cur = rw->cur_nodes;
 	int cur_nr = rw->cur_nr_nodes;
+	struct obj_list_stream *streams, **heap, *s;
+	uint64_t oid;
+
+	for (my_idx = 0; my_idx < cur_nr; my_idx++)
+		if (is_myself(cur[my_idx].addr, cur[my_idx].port))
+			break;
+	if (my_idx == cur_nr)
+		return 0;
+
+	streams = xzalloc(sizeof(*streams) * cur_nr);
+	heap = xzalloc(sizeof(*heap) * cur_nr);
 
-	buf = malloc(buf_size);
-	if (!buf) {
-		eprintf("out of memory\n");
-		rw->retry = 1;
-		return -1;
-	}
 	for (i = 0; i < cur_nr; i++) {
-		int buf_nr;
 		struct sd_node *node = cur + i;
 
 		if (newly_joined(node, rw))
 			/* new node doesn't have a list file */
 			continue;
 
-		retry_cnt = 0;
-	retry:
-		buf_nr = request_obj_list(node, rw->epoch, buf, buf_size);
-		if (buf_nr < 0) {
-			retry_cnt++;
-			if (retry_cnt > MAX_RETRY_CNT) {
-				eprintf("failed to get object list\n");
-				eprintf("some objects may be lost\n");
-				continue;
-			} else {
-				if (next_rw) {
-					dprintf("go to the next recovery\n");
-					break;
-				}
-				dprintf("trying to get object list again\n");
-				sleep(1);
-				goto retry;
-			}
-		}
-		buf_nr = screen_obj_list(rw, (uint64_t *)buf, buf_nr);
-		if (buf_nr)
-			rw->count = merge_objlist(rw->oids, rw->count, (uint64_t *)buf, buf_nr);
+		s = streams + i;
+		s->node = node;
+		s->oids = xmalloc(OBJ_LIST_PAGE * sizeof(uint64_t));
+		if (next_obj_list_page(rw, my_idx, s) < 0)
+			goto out;
+		if (s->nr)
+			heap[nr_heap++] = s;
+	}
+
+	for (i = nr_heap / 2 - 1; i >= 0; i--)
+		sift_down(heap, nr_heap, i);
+
+	while (nr_heap) {
+		s = heap[0];
+		oid = stream_head(s);
+		if (!rw->count || rw->oids[rw->count - 1] != oid)
+			add_obj(rw, oid, &nr_alloc);
+
+		/* the pages may be empty after the filtering */
+		s->pos++;
+		while (s->pos == s->nr && s->cursor)
+			if (next_obj_list_page(rw, my_idx, s) < 0)
+				goto out;
+		if (s->pos == s->nr)
+			heap[0] = heap[--nr_heap];
+		sift_down(heap, nr_heap, 0);
 	}
+out:
+	qsort(rw->oids, rw->count, sizeof(uint64_t), obj_cmp);
 
 	dprintf("%d\n", rw->count);
-	free(buf);
+	for (i = 0; i < cur_nr; i++)
+		free(streams[i].oids);
+	free(streams);
+	free(heap);
+	return 0;
+}
+
+/*
+ * Delta rejoin
+ *
+ * A node which comes back to the nodes it left still holds the objects
+ * it had then, and only those written or removed while it was away can
+ * be behind.  The other nodes logged them, so the node recovers them as
+ * usual and links the others from the epoch it left, without the object
+ * lists of the other nodes.
+ */
+
+/* append the objects the node logged from epoch to rw->epoch - 1 */
+static int request_dirty_list(struct recovery_work *rw, struct sd_node *e,
+			      uint32_t epoch, uint64_t *buf, int *nr_alloc)
+{
+	int fd, ret, nr;
+	unsigned wlen = 0, rlen = DIRTY_LIST_LEN;
+	char name[128];
+	struct sd_list_req hdr;
+	struct sd_list_rsp *rsp = (struct sd_list_rsp *)&hdr;
+
+	addr_to_str(name, sizeof(name), e->addr, 0);
+
+	fd = connect_to(name, e->port);
+	if (fd < 0) {
+		eprintf("%s %"PRIu32"\n", name, e->port);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = SD_OP_GET_DIRTY_LIST;
+	hdr.tgt_epoch = epoch;
+	hdr.dst_epoch = rw->epoch - 1;
+	hdr.data_length = rlen;
+
+	ret = exec_req(fd, (struct sd_req *)&hdr, buf, &wlen, &rlen);
+
+	close(fd);
+
+	if (ret || rsp->result != SD_RES_SUCCESS) {
+		dprintf("%s %"PRIu32", %"PRIu32", %"PRIu32"\n", name, e->port,
+			ret, rsp->result);
+		return -1;
+	}
+
+	nr = rsp->data_length / sizeof(uint64_t);
+	if (rw->nr_dirty + nr > *nr_alloc) {
+		*nr_alloc = rw->nr_dirty + nr;
+		rw->dirty = xrealloc(rw->dirty, sizeof(uint64_t) * *nr_alloc);
+	}
+	memcpy(rw->dirty + rw->nr_dirty, buf, sizeof(uint64_t) * nr);
+	rw->nr_dirty += nr;
+
 	return 0;
 }
 
+/*
+ * Make the object list of a rejoin from the objects of this node and the
+ * dirty objects of the others.  Returns -1 if this node wasn't away, or
+ * if it should do a full recovery.
+ */
+static int fill_delta_obj_list(struct recovery_work *rw)
+{
+	struct sd_node *nodes, *me = NULL;
+	uint64_t *buf = NULL, oid;
+	int i, nr, nr_own, copies, nr_alloc = 0, ret = -1;
+	uint32_t epoch;
+	struct rb_node *p;
+
+	for (i = 0; i < rw->cur_nr_nodes; i++)
+		if (is_myself(rw->cur_nodes[i].addr, rw->cur_nodes[i].port))
+			me = rw->cur_nodes + i;
+	if (!me)
+		return -1;
+
+	/* find the last epoch this node was in */
+	nodes = xmalloc(sizeof(*nodes) * SD_MAX_NODES);
+	for (epoch = rw->epoch - 1; epoch > 0; epoch--) {
+		if (rw->epoch - epoch > DIRTY_LOG_EPOCHS)
+			goto out;
+
+		nr = epoch_log_read_nr(epoch, (char *)nodes,
+				       sizeof(*nodes) * SD_MAX_NODES);
+		if (nr < 0) {
+			nr = epoch_log_read_remote(epoch, (char *)nodes,
+						   sizeof(*nodes) * SD_MAX_NODES);
+			nr /= sizeof(*nodes);
+		}
+		if (nr <= 0)
+			goto out;
+
+		for (i = 0; i < nr; i++)
+			if (!node_cmp(nodes + i, me))
+				break;
+		if (i < nr)
+			break;
+	}
+	if (!epoch || epoch == rw->epoch - 1)
+		goto out;
+
+	/* it holds the same objects only if the nodes are the same */
+	if (nr != rw->cur_nr_nodes)
+		goto out;
+	for (i = 0; i < nr; i++)
+		if (node_cmp(nodes + i, rw->cur_nodes + i))
+			goto out;
+
+	/*
+	 * The others can take writes in the last epoch of this node after it
+	 * died and before its leave is processed, so the log of that epoch is
+	 * needed too.  Without it, e.g. if that epoch started with the
+	 * format, the recovery is a full one.
+	 */
+	buf = xmalloc(DIRTY_LIST_LEN);
+	for (i = 0; i < rw->cur_nr_nodes; i++) {
+		if (rw->cur_nodes + i == me)
+			continue;
+		if (request_dirty_list(rw, rw->cur_nodes + i, epoch, buf,
+				       &nr_alloc) < 0) {
+			vprintf(SDOG_INFO, "no dirty object log from epoch "
+				"%"PRIu32", doing a full recovery\n", epoch);
+			goto out;
+		}
+	}
+
+	qsort(rw->dirty, rw->nr_dirty, sizeof(uint64_t), oid_cmp);
+	for (i = 0, nr = 0; i < rw->nr_dirty; i++)
+		if (!nr || rw->dirty[nr - 1] != rw->dirty[i])
+			rw->dirty[nr++] = rw->dirty[i];
+	rw->nr_dirty = nr;
+
+	copies = get_max_copies(rw->cur_nodes, rw->cur_nr_nodes);
+	nr_alloc = 0;
+
+	pthread_rwlock_rdlock(&obj_list_cache.lock);
+	for (p = rb_first(&obj_list_cache.root); p; p = rb_next(p)) {
+		oid = rb_entry(p, struct objlist_cache_entry, node)->oid;
+		if (is_obj_holder(rw->cur_vnodes, rw->cur_nr_vnodes, copies,
+				  oid, me))
+			add_obj(rw, oid, &nr_alloc);
+	}
+	pthread_rwlock_unlock(&obj_list_cache.lock);
+
+	/* the objects created while this node was away */
+	nr_own = rw->count;
+	for (i = 0; i < rw->nr_dirty; i++) {
+		oid = rw->dirty[i];
+		if (is_obj_holder(rw->cur_vnodes, rw->cur_nr_vnodes, copies,
+				  oid, me) &&
+		    !bsearch(&oid, rw->oids, nr_own, sizeof(oid), oid_cmp))
+			add_obj(rw, oid, &nr_alloc);
+	}
+
+	qsort(rw->oids, rw->count, sizeof(uint64_t), obj_cmp);
+
+	vprintf(SDOG_INFO, "rejoining from epoch %"PRIu32", %d objects, %d "
+		"written while away\n", epoch, rw->count, rw->nr_dirty);
+
+	rw->delta_epoch = epoch;
+	ret = 0;
+out:
+	if (ret) {
+		free(rw->dirty);
+		rw->dirty = NULL;
+		rw->nr_dirty = 0;
+	}
+	free(buf);
+	free(nodes);
+	return ret;
+}
+
 /* setup node list and virtual node list */
 static int init_rw(struct recovery_work *rw)
 {
@@ -1881,6 +3655,7 @@ static int init_rw(struct recovery_work *rw)
 static void do_recovery_work(struct work *work)
 {
 	struct recovery_work *rw = container_of(work, struct recovery_work, work);
+	int unfinished;
 
 	dprintf("%u\n", rw->epoch);
 
@@ -1890,11 +3665,24 @@ static void do_recovery_work(struct work *work)
 	if (rw->cur_nr_nodes == 0)
 		init_rw(rw);
 
+	if (load_checkpoint(rw) == 0)
+		return;
+
+	/* a checkpoint left means the last recovery wasn't finished */
+	unfinished = access(recovery_path, F_OK) == 0;
+	begin_checkpoint(rw);
+
+	if (!unfinished && fill_delta_obj_list(rw) == 0)
+		goto out;
+
 	if (fill_obj_list(rw) < 0) {
 		eprintf("fatal recovery error\n");
 		rw->count = 0;
 		return;
 	}
+out:
+	if (!next_rw)
+		write_checkpoint(rw);
 }
 
 int start_recovery(uint32_t epoch)
@@ -1906,9 +3694,10 @@ int start_recovery(uint32_t epoch)
 		return -1;
 
 	rw->state = RW_INIT;
-	rw->oids = malloc(1 << 20); /* FIXME */
 	rw->epoch = epoch;
 	rw->count = 0;
+	INIT_LIST_HEAD(&rw->inflight_list);
+	clock_gettime(CLOCK_MONOTONIC, &rw->start);
 
 	rw->work.fn = do_recovery_work;
 	rw->work.done = do_recover_main;
@@ -1923,6 +3712,7 @@ int start_recovery(uint32_t epoch)
 		if (next_rw) {
 			/* skip the previous epoch recovery */
 			free(next_rw->oids);
+			free(next_rw->dirty);
 			free(next_rw);
 		}
 		next_rw = rw;
@@ -2074,6 +3864,16 @@ static int init_config_path(const char *base_path)
 	return 0;
 }
 
+#define RECOVERY_PATH "/recovery"
+
+static int init_recovery_path(const char *base_path)
+{
+	recovery_path = zalloc(strlen(base_path) + strlen(RECOVERY_PATH) + 1);
+	sprintf(recovery_path, "%s" RECOVERY_PATH, base_path);
+
+	return 0;
+}
+
 static int init_objlist_cache(void)
 {
 	int i;
@@ -2108,6 +3908,7 @@ int init_store(const char *d)
 {
 	int ret;
 	uint8_t driver_name[STORE_LEN];
+	uint8_t placement_name[PLACEMENT_LEN];
 
 	ret = init_obj_path(d);
 	if (ret)
@@ -2129,6 +3930,10 @@ int init_store(const char *d)
 	if (ret)
 		return ret;
 
+	ret = init_recovery_path(d);
+	if (ret)
+		return ret;
+
 	ret = get_cluster_store(driver_name);
 	if (ret != SD_RES_SUCCESS)
 		return 1;
@@ -2143,6 +3948,23 @@ int init_store(const char *d)
 	} else
 		dprintf("no store found\n");
 
+	ret = get_cluster_placement(placement_name);
+	if (ret != SD_RES_SUCCESS)
+		return 1;
+
+	/* clusters formatted before placement drivers use the default one */
+	if (strlen((char *)placement_name)) {
+		sd_placement = find_placement_driver((char *)placement_name);
+		if (!sd_placement) {
+			eprintf("placement %s not supported\n", placement_name);
+			return 1;
+		}
+	}
+
+	ret = get_cluster_throttle(&sys->recovery_throttle);
+	if (ret != SD_RES_SUCCESS)
+		return 1;
+
 	ret = init_objlist_cache();
 	if (ret)
 		return ret;
@@ -2316,3 +4138,109 @@ int get_cluster_store(uint8_t *buf)
 out:
 	return ret;
 }
+
+int set_cluster_placement(const uint8_t *name)
+{
+	int fd, ret = SD_RES_EIO, len;
+	void *jd;
+
+	fd = open(config_path, O_DSYNC | O_WRONLY);
+	if (fd < 0)
+		goto out;
+
+	len = strlen((char *)name) + 1;
+	jd = jrnl_begin((void *)name, len,
+			offsetof(struct sheepdog_config, placement),
+			config_path, jrnl_path);
+	if (!jd) {
+		ret = SD_RES_EIO;
+		goto err;
+	}
+	ret = xpwrite(fd, name, len,
+		      offsetof(struct sheepdog_config, placement));
+	if (ret != len)
+		ret = SD_RES_EIO;
+	else
+		ret = SD_RES_SUCCESS;
+	jrnl_end(jd);
+err:
+	close(fd);
+out:
+	return ret;
+}
+
+int get_cluster_placement(uint8_t *buf)
+{
+	int fd, ret = SD_RES_EIO;
+
+	fd = open(config_path, O_RDONLY);
+	if (fd < 0)
+		goto out;
+
+	memset(buf, 0, PLACEMENT_LEN);
+	ret = pread(fd, buf, PLACEMENT_LEN,
+		    offsetof(struct sheepdog_config, placement));
+
+	if (ret == -1)
+		ret = SD_RES_EIO;
+	else
+		ret = SD_RES_SUCCESS;
+
+	close(fd);
+out:
+	return ret;
+}
+
+int set_cluster_throttle(const struct sd_recovery_throttle *t)
+{
+	int fd, ret = SD_RES_EIO, len = sizeof(*t);
+	void *jd;
+
+	fd = open(config_path, O_DSYNC | O_WRONLY);
+	if (fd < 0)
+		goto out;
+
+	jd = jrnl_begin((void *)t, len,
+			offsetof(struct sheepdog_config, throttle),
+			config_path, jrnl_path);
+	if (!jd) {
+		ret = SD_RES_EIO;
+		goto err;
+	}
+	ret = xpwrite(fd, t, len, offsetof(struct sheepdog_config, throttle));
+	if (ret != len)
+		ret = SD_RES_EIO;
+	else
+		ret = SD_RES_SUCCESS;
+	jrnl_end(jd);
+err:
+	close(fd);
+out:
+	return ret;
+}
+
+/* the config of a cluster formatted before the throttle has none */
+int get_cluster_throttle(struct sd_recovery_throttle *t)
+{
+	int fd, ret = SD_RES_EIO;
+
+	fd = open(config_path, O_RDONLY);
+	if (fd < 0)
+		goto out;
+
+	memset(t, 0, sizeof(*t));
+	ret = pread(fd, t, sizeof(*t),
+		    offsetof(struct sheepdog_config, throttle));
+
+	if (ret == -1)
+		ret = SD_RES_EIO;
+	else {
+		if (ret != sizeof(*t))
+			memset(t, 0, sizeof(*t));
+		ret = SD_RES_SUCCESS;
+	}
+
+	close(fd);
+out:
+	return ret;
+}
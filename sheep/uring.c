@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Store I/O engine
+ *
+ * The store drivers open, read, write and preallocate the objects with
+ * the store_*() functions below.  Called from a work of an async work
+ * queue, they are submitted to an io_uring and the work yields its
+ * thread until a reaper thread sees the completion, so a few threads
+ * can keep deep queues on the disks.  Anywhere else, or when io_uring
+ * isn't available, they are plain system calls.
+ */
+#include "../include/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "sheep_priv.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 256
+/* a waiter wakes up this often, though only a completion ends its wait */
+#define URING_WAIT_TIMEOUT 10 /* seconds */
+
+struct uring_req {
+	struct async_waiter *waiter;
+	int done;
+	int res;
+};
+
+static struct {
+	int fd;
+	unsigned entries;
+
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* protects the submission queue */
+	pthread_mutex_t sq_lock;
+	/* protects the requests */
+	pthread_mutex_t lock;
+	int inflight;
+
+	uint8_t supported[IORING_OP_LAST];
+} ring = {
+	.sq_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int use_uring;
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned to_submit,
+				 unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int io_uring_register(int fd, unsigned opcode, void *arg,
+				    unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int probe_ops(void)
+{
+	struct io_uring_probe *probe;
+	int i, nr = IORING_OP_LAST;
+
+	probe = zalloc(sizeof(*probe) + nr * sizeof(probe->ops[0]));
+	if (!probe)
+		return -1;
+
+	if (io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, nr) < 0) {
+		free(probe);
+		return -1;
+	}
+
+	for (i = 0; i < probe->ops_len && i < nr; i++)
+		ring.supported[i] = !!(probe->ops[i].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+
+	return ring.supported[IORING_OP_READ] &&
+		ring.supported[IORING_OP_WRITE] ? 0 : -1;
+}
+
+static int map_rings(struct io_uring_params *p)
+{
+	size_t sq_len, cq_len;
+	void *sq, *cq;
+
+	sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = max(sq_len, cq_len);
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring.fd,
+			  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -1;
+	}
+
+	ring.sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		return -1;
+
+	ring.sq_tail = (unsigned *)((char *)sq + p->sq_off.tail);
+	ring.sq_mask = *(unsigned *)((char *)sq + p->sq_off.ring_mask);
+	ring.sq_array = (unsigned *)((char *)sq + p->sq_off.array);
+
+	ring.cq_head = (unsigned *)((char *)cq + p->cq_off.head);
+	ring.cq_tail = (unsigned *)((char *)cq + p->cq_off.tail);
+	ring.cq_mask = *(unsigned *)((char *)cq + p->cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+static void *reaper_routine(void *arg)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_req *req;
+	unsigned head, tail;
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;) {
+		if (io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR) {
+			eprintf("failed to wait for completions: %m\n");
+			sleep(1);
+			continue;
+		}
+
+		pthread_mutex_lock(&ring.lock);
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = ring.cqes + (head & ring.cq_mask);
+			req = (struct uring_req *)(uintptr_t)cqe->user_data;
+
+			req->res = cqe->res;
+			req->done = 1;
+			if (req->waiter)
+				async_wakeup(req->waiter);
+			ring.inflight--;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	return NULL;
+}
+
+int init_uring(void)
+{
+	struct io_uring_params p;
+	pthread_t thread;
+	int ret;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = io_uring_setup(URING_ENTRIES, &p);
+	if (ring.fd < 0) {
+		vprintf(SDOG_INFO, "io_uring is not available, %m\n");
+		return -1;
+	}
+	ring.entries = p.sq_entries;
+
+	if (map_rings(&p) < 0 || probe_ops() < 0) {
+		vprintf(SDOG_INFO, "io_uring is not usable\n");
+		goto err;
+	}
+
+	ret = pthread_create(&thread, NULL, reaper_routine, NULL);
+	if (ret) {
+		eprintf("failed to create a reaper thread: %s\n", strerror(ret));
+		goto err;
+	}
+
+	use_uring = 1;
+	vprintf(SDOG_INFO, "store I/O with io_uring\n");
+
+	return 0;
+err:
+	close(ring.fd);
+	return -1;
+}
+
+/* returns 0 if the operation can be submitted from here */
+static int uring_usable(uint8_t opcode)
+{
+	return use_uring && ring.supported[opcode] && in_async_work() ? 0 : -1;
+}
+
+static int uring_submit(struct io_uring_sqe *sqe, struct uring_req *req)
+{
+	unsigned tail, idx;
+	int ret;
+
+	pthread_mutex_lock(&ring.sq_lock);
+
+	pthread_mutex_lock(&ring.lock);
+	if (ring.inflight >= ring.entries) {
+		pthread_mutex_unlock(&ring.lock);
+		pthread_mutex_unlock(&ring.sq_lock);
+		return -1;
+	}
+	ring.inflight++;
+	pthread_mutex_unlock(&ring.lock);
+
+	tail = *ring.sq_tail;
+	idx = tail & ring.sq_mask;
+	ring.sqes[idx] = *sqe;
+	ring.sqes[idx].user_data = (uintptr_t)req;
+	ring.sq_array[idx] = idx;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = io_uring_enter(ring.fd, 1, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret != 1) {
+		/* not consumed by the kernel, so take it back */
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&ring.lock);
+		ring.inflight--;
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	pthread_mutex_unlock(&ring.sq_lock);
+
+	return ret == 1 ? 0 : -1;
+}
+
+/*
+ * Returns 0 and the result of the operation in *res, or -1 if it couldn't
+ * be submitted.
+ */
+static int uring_do(struct io_uring_sqe *sqe, int *res)
+{
+	struct uring_req req = { 0 };
+	struct async_waiter waiter;
+	struct timespec deadline;
+
+	if (uring_submit(sqe, &req) < 0)
+		return -1;
+
+	pthread_mutex_lock(&ring.lock);
+	while (!req.done) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += URING_WAIT_TIMEOUT;
+		async_wait_prepare(&waiter, &deadline);
+		req.waiter = &waiter;
+		pthread_mutex_unlock(&ring.lock);
+
+		async_wait(&waiter);
+
+		pthread_mutex_lock(&ring.lock);
+		req.waiter = NULL;
+	}
+	pthread_mutex_unlock(&ring.lock);
+
+	*res = req.res;
+	return 0;
+}
+
+static int uring_rw(uint8_t opcode, int fd, void *buf, size_t count,
+		    off_t offset, int *res)
+{
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = opcode;
+	sqe.fd = fd;
+	sqe.addr = (uintptr_t)buf;
+	sqe.len = count;
+	sqe.off = offset;
+
+	return uring_do(&sqe, res);
+}
+
+/* like xpread() and xpwrite() */
+static ssize_t uring_xrw(uint8_t opcode, int fd, void *buf, size_t count,
+			 off_t offset)
+{
+	char *p = buf;
+	ssize_t total = 0;
+	int ret;
+
+	while (count > 0) {
+		if (uring_rw(opcode, fd, p, count, offset, &ret) < 0) {
+			if (opcode == IORING_OP_READ)
+				ret = pread(fd, p, count, offset);
+			else
+				ret = pwrite(fd, p, count, offset);
+			if (ret < 0)
+				ret = -errno;
+		}
+
+		if (ret == -EINTR || ret == -EAGAIN)
+			continue;
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+
+		count -= ret;
+		p += ret;
+		total += ret;
+		offset += ret;
+	}
+
+	return total;
+}
+
+#else
+
+int init_uring(void)
+{
+	return -1;
+}
+
+#endif
+
+int store_open(const char *path, int flags, mode_t mode)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_sqe sqe;
+	int ret;
+
+	if (uring_usable(IORING_OP_OPENAT) == 0) {
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_OPENAT;
+		sqe.fd = AT_FDCWD;
+		sqe.addr = (uintptr_t)path;
+		sqe.len = mode;
+		sqe.open_flags = flags;
+
+		if (uring_do(&sqe, &ret) == 0) {
+			if (ret < 0) {
+				errno = -ret;
+				return -1;
+			}
+			return ret;
+		}
+	}
+#endif
+	return open(path, flags, mode);
+}
+
+ssize_t store_pread(int fd, void *buf, size_t count, off_t offset)
+{
+#ifdef HAVE_IO_URING
+	if (uring_usable(IORING_OP_READ) == 0)
+		return uring_xrw(IORING_OP_READ, fd, buf, count, offset);
+#endif
+	return xpread(fd, buf, count, offset);
+}
+
+ssize_t store_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+#ifdef HAVE_IO_URING
+	if (uring_usable(IORING_OP_WRITE) == 0)
+		return uring_xrw(IORING_OP_WRITE, fd, (void *)buf, count,
+				 offset);
+#endif
+	return xpwrite(fd, buf, count, offset);
+}
+
+int store_fallocate(int fd, int mode, off_t offset, off_t len)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_sqe sqe;
+	int ret;
+
+	if (uring_usable(IORING_OP_FALLOCATE) == 0) {
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_FALLOCATE;
+		sqe.fd = fd;
+		sqe.off = offset;
+		sqe.addr = len;
+		sqe.len = mode;
+
+		if (uring_do(&sqe, &ret) == 0) {
+			if (ret < 0) {
+				errno = -ret;
+				return -1;
+			}
+			return 0;
+		}
+	}
+#endif
+	return fallocate(fd, mode, offset, len);
+}
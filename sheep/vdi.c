@@ -10,6 +10,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/time.h>
 
 #include "sheepdog_proto.h"
@@ -151,6 +152,42 @@ out:
 	return ret;
 }
 
+/*
+ * The inode headers are read with one request per batch, and the batches
+ * grow up to this, as the VDI looked for is often the first one.
+ */
+#define MAX_VDI_SCAN_BATCH 64
+
+#define MAX_SCAN_RETRIES 6
+
+/*
+ * Read a batch of inode headers.  The inodes being recovered on all their
+ * replicas are read again a bit later; reading them made the nodes
+ * recover them first.
+ */
+static int read_inode_headers(struct sd_vnode *entries, int nr_vnodes,
+			      int nr_zones, uint32_t epoch, int copies,
+			      struct sd_obj_seg *segs, int nr, char *buf)
+{
+	int i, ret, retry = 0;
+
+	for (;;) {
+		ret = forward_objs(entries, nr_vnodes, nr_zones, epoch,
+				   SD_OP_READ_OBJS, copies, segs, nr, buf);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+
+		for (i = 0; i < nr; i++)
+			if (segs[i].result == SD_RES_NEW_NODE_VER)
+				break;
+		if (i == nr || ++retry > MAX_SCAN_RETRIES)
+			return SD_RES_SUCCESS;
+
+		dprintf("inode %" PRIx64 " is being recovered\n", segs[i].oid);
+		sleep(1);
+	}
+}
+
 static int find_first_vdi(uint32_t epoch, unsigned long start, unsigned long end,
 			  char *name, char *tag, uint32_t snapid, uint32_t *vid,
 			  unsigned long *deleted_nr, uint32_t *next_snap,
@@ -158,12 +195,16 @@ static int find_first_vdi(uint32_t epoch, unsigned long start, unsigned long end
 {
 	struct sd_vnode *entries = NULL;
 	struct sheepdog_inode *inode = NULL;
-	unsigned long i;
+	struct sd_obj_seg segs[MAX_VDI_SCAN_BATCH];
+	char *buf;
+	unsigned long i, left = start - end + 1;
 	int nr_vnodes, nr_zones, nr_reqs;
+	int n = 0, nr = 0, batch = 1;
 	int ret, vdi_found = 0;
 
 	inode = malloc(SD_INODE_HEADER_SIZE);
-	if (!inode) {
+	buf = malloc(SD_INODE_HEADER_SIZE * MAX_VDI_SCAN_BATCH);
+	if (!inode || !buf) {
 		eprintf("failed to allocate memory\n");
 		ret = SD_RES_NO_MEM;
 		goto out;
@@ -177,14 +218,31 @@ static int find_first_vdi(uint32_t epoch, unsigned long start, unsigned long end
 	if (nr_reqs > nr_zones)
 		nr_reqs = nr_zones;
 
-	for (i = start; i >= end; i--) {
-		ret = read_object(entries, nr_vnodes, nr_zones, epoch,
-				  vid_to_vdi_oid(i), (char *)inode,
-				  SD_INODE_HEADER_SIZE, 0, nr_reqs);
-		if (ret != SD_RES_SUCCESS) {
+	for (i = start; left; i--, left--) {
+		if (n == nr) {
+			nr = left < batch ? left : batch;
+			memset(segs, 0, sizeof(segs[0]) * nr);
+			for (n = 0; n < nr; n++) {
+				segs[n].oid = vid_to_vdi_oid(i - n);
+				segs[n].length = SD_INODE_HEADER_SIZE;
+			}
+			ret = read_inode_headers(entries, nr_vnodes, nr_zones,
+						 epoch, nr_reqs, segs, nr, buf);
+			if (ret != SD_RES_SUCCESS) {
+				ret = SD_RES_EIO;
+				goto out;
+			}
+			if (batch < MAX_VDI_SCAN_BATCH)
+				batch *= 2;
+			n = 0;
+		}
+
+		if (segs[n].result != SD_RES_SUCCESS) {
 			ret = SD_RES_EIO;
 			goto out;
 		}
+		memcpy(inode, buf + SD_INODE_HEADER_SIZE * n++,
+		       SD_INODE_HEADER_SIZE);
 
 		if (inode->name[0] == '\0') {
 			*deleted_nr = i;
@@ -215,6 +273,7 @@ static int find_first_vdi(uint32_t epoch, unsigned long start, unsigned long end
 		ret = SD_RES_NO_VDI;
 out:
 	free(inode);
+	free(buf);
 	free_ordered_sd_vnode_list(entries);
 
 	return ret;
@@ -436,8 +495,9 @@ static void delete_one(struct work *work)
 	uint32_t vdi_id = *(dw->buf + dw->count - dw->done - 1);
 	struct sd_vnode *entries = NULL;
 	int nr_vnodes, nr_zones;
-	int ret, i;
+	int ret, i, nr = 0;
 	struct sheepdog_inode *inode = NULL;
+	struct sd_obj_seg *segs = NULL;
 
 	eprintf("%d %d, %16x\n", dw->done, dw->count, vdi_id);
 
@@ -465,17 +525,28 @@ static void delete_one(struct work *work)
 		goto out;
 	}
 
-	for (i = 0; i < MAX_DATA_OBJS; i++) {
-		if (!inode->data_vdi_id[i])
-			continue;
+	segs = zalloc(sizeof(*segs) * SD_MAX_SEGS);
+	if (!segs) {
+		eprintf("failed to allocate memory\n");
+		goto out;
+	}
 
-		remove_object(entries, nr_vnodes, nr_zones, dw->epoch,
-			      vid_to_data_oid(inode->data_vdi_id[i], i),
-			      inode->nr_copies);
+	for (i = 0; i < MAX_DATA_OBJS; i++) {
+		if (inode->data_vdi_id[i])
+			segs[nr++].oid = vid_to_data_oid(inode->data_vdi_id[i],
+							 i);
+
+		if (nr == SD_MAX_SEGS || (nr && i == MAX_DATA_OBJS - 1)) {
+			forward_objs(entries, nr_vnodes, nr_zones, dw->epoch,
+				     SD_OP_REMOVE_OBJS, inode->nr_copies, segs,
+				     nr, NULL);
+			nr = 0;
+		}
 	}
 out:
 	free_ordered_sd_vnode_list(entries);
 	free(inode);
+	free(segs);
 }
 
 static void delete_one_done(struct work *work)
@@ -0,0 +1,614 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Vectored object I/O
+ *
+ * SD_OP_READ_OBJS, SD_OP_WRITE_OBJS and SD_OP_REMOVE_OBJS carry a list of
+ * object segments.  The gateway splits the list by the nodes owning the
+ * objects and sends each node one request with its segments, so reading
+ * or removing many objects costs a round trip per node instead of one per
+ * object.  Every segment gets its own result.
+ *
+ * A read segment goes to one replica, and to the next one if it fails
+ * with a network error, EIO or because the replica is still recovering
+ * the object.  A write or remove segment goes to all the replicas, and
+ * gets the first error of them.  Only existing objects are written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sheep_priv.h"
+
+/* the replicas of a segment, and where its data is */
+struct seg_state {
+	int idxs[SD_MAX_REDUNDANCY];
+	int nr_idxs;
+	int next;
+	size_t off;
+};
+
+/* a segment to be sent to a node */
+struct seg_send {
+	int seg;
+	int tgt;
+};
+
+/* a node and the segments sent to it */
+struct objs_target {
+	struct sd_vnode *v;
+	struct seg_send *sends;
+	int nr_sends;
+	int local;
+
+	void *buf;
+	unsigned buf_len;
+	struct peer_req *req;
+};
+
+static inline int has_data(uint8_t opcode)
+{
+	return opcode != SD_OP_REMOVE_OBJS;
+}
+
+/*
+ * Returns the length of the data of the segments, or -1 if the request
+ * is malformed.
+ */
+static int64_t get_objs_data_length(struct sd_objs_req *hdr,
+				    struct sd_obj_seg *segs)
+{
+	uint64_t segs_len, len = 0;
+	int i;
+
+	if (!hdr->nr_segs || hdr->nr_segs > SD_MAX_SEGS)
+		return -1;
+
+	segs_len = objs_data_offset(hdr->nr_segs);
+	if (segs_len > hdr->data_length)
+		return -1;
+
+	if (!has_data(hdr->opcode))
+		return 0;
+
+	for (i = 0; i < hdr->nr_segs; i++)
+		len += segs[i].length;
+
+	if (len > SD_MAX_SEGS_DATA)
+		return -1;
+	if (hdr->opcode == SD_OP_WRITE_OBJS &&
+	    segs_len + len != hdr->data_length)
+		return -1;
+
+	return len;
+}
+
+static int do_local_seg(uint8_t opcode, struct sd_obj_seg *seg, void *data,
+			int copies, uint32_t epoch)
+{
+	struct sd_obj_req hdr;
+	struct sd_obj_rsp rsp;
+
+	switch (opcode) {
+	case SD_OP_READ_OBJS:
+		return read_object_local(seg->oid, data, seg->length,
+					 seg->offset, copies, epoch);
+	case SD_OP_WRITE_OBJS:
+		return write_object_local(seg->oid, data, seg->length,
+					  seg->offset, 0, copies, epoch, 0);
+	case SD_OP_REMOVE_OBJS:
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.opcode = SD_OP_REMOVE_OBJ;
+		hdr.epoch = epoch;
+		hdr.oid = seg->oid;
+		return store_remove_obj((struct sd_req *)&hdr,
+					(struct sd_rsp *)&rsp, NULL);
+	}
+
+	return SD_RES_INVALID_PARMS;
+}
+
+static inline int can_read_next(int result)
+{
+	return result == SD_RES_NETWORK_ERROR || result == SD_RES_EIO ||
+		result == SD_RES_NEW_NODE_VER;
+}
+
+static void set_seg_result(uint8_t opcode, struct sd_obj_seg *seg, int ret)
+{
+	if (opcode == SD_OP_READ_OBJS || seg->result == SD_RES_SUCCESS)
+		seg->result = ret;
+}
+
+static int send_objs(struct objs_target *t, uint8_t opcode, uint32_t epoch,
+		     int copies, struct sd_obj_seg *segs,
+		     struct seg_state *st, char *data)
+{
+	struct sd_objs_req hdr;
+	struct sd_obj_seg *s;
+	unsigned segs_len = objs_data_offset(t->nr_sends), wlen, rlen;
+	char *p;
+	int i, n;
+
+	t->buf_len = segs_len;
+	if (has_data(opcode))
+		for (i = 0; i < t->nr_sends; i++)
+			t->buf_len += segs[t->sends[i].seg].length;
+
+	t->buf = alloc_buffer(t->buf_len);
+	if (!t->buf)
+		return SD_RES_NO_MEM;
+
+	s = t->buf;
+	p = (char *)t->buf + segs_len;
+	for (i = 0; i < t->nr_sends; i++) {
+		n = t->sends[i].seg;
+		s[i] = segs[n];
+		s[i].result = SD_RES_SUCCESS;
+		if (opcode == SD_OP_WRITE_OBJS) {
+			memcpy(p, data + st[n].off, segs[n].length);
+			p += segs[n].length;
+		}
+	}
+
+	wlen = opcode == SD_OP_WRITE_OBJS ? t->buf_len : segs_len;
+	rlen = opcode == SD_OP_READ_OBJS ? t->buf_len : segs_len;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = opcode;
+	hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_IO_LOCAL;
+	hdr.epoch = epoch;
+	hdr.data_length = wlen;
+	hdr.nr_segs = t->nr_sends;
+	hdr.copies = copies;
+
+	/* the response is received over the request, sent by then */
+	t->req = peer_send_req(t->v->addr, t->v->port, (struct sd_req *)&hdr,
+			       t->buf, wlen, t->buf, rlen);
+	if (!t->req)
+		return SD_RES_NETWORK_ERROR;
+
+	return SD_RES_SUCCESS;
+}
+
+static void finish_objs(struct objs_target *t, uint8_t opcode, int ret,
+			struct sd_obj_seg *segs, struct seg_state *st,
+			char *data)
+{
+	struct sd_obj_seg *s = t->buf;
+	char *p = (char *)t->buf + objs_data_offset(t->nr_sends);
+	int i, n, r;
+
+	for (i = 0; i < t->nr_sends; i++) {
+		n = t->sends[i].seg;
+		r = ret == SD_RES_SUCCESS ? s[i].result : ret;
+		set_seg_result(opcode, segs + n, r);
+
+		if (opcode != SD_OP_READ_OBJS)
+			continue;
+		if (r == SD_RES_SUCCESS)
+			memcpy(data + st[n].off, p, segs[n].length);
+		p += segs[n].length;
+	}
+}
+
+static int same_addr(struct sd_vnode *a, struct sd_vnode *b)
+{
+	return !memcmp(a->addr, b->addr, sizeof(a->addr)) &&
+		a->port == b->port;
+}
+
+static int send_cmp(const void *a, const void *b)
+{
+	const struct seg_send *s1 = a, *s2 = b;
+
+	if (s1->tgt != s2->tgt)
+		return s1->tgt - s2->tgt;
+
+	return s1->seg - s2->seg;
+}
+
+/*
+ * Send the segments to their nodes, and wait for all of them.  The
+ * segments of this node are done here, unless the node is recovering.
+ * Recovery doesn't start while a request is outstanding, so the segments
+ * are sent to ourselves then, to be checked by the main thread.
+ */
+static int do_objs_round(struct sd_vnode *e, uint8_t opcode, uint32_t epoch,
+			 int copies, struct sd_obj_seg *segs,
+			 struct seg_state *st, char *data,
+			 struct seg_send *sends, int nr_sends)
+{
+	struct objs_target *tgts, **waits;
+	struct peer_req **reqs;
+	struct sd_rsp rsp;
+	int i, j, n, nr_tgts = 0, nr_reqs = 0, ret;
+	struct sd_vnode *v;
+
+	tgts = zalloc(sizeof(*tgts) * nr_sends);
+	waits = zalloc(sizeof(*waits) * nr_sends);
+	reqs = zalloc(sizeof(*reqs) * nr_sends);
+	if (!tgts || !waits || !reqs) {
+		ret = SD_RES_NO_MEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_sends; i++) {
+		v = e + sends[i].tgt;
+		for (j = 0; j < nr_tgts; j++)
+			if (same_addr(tgts[j].v, v))
+				break;
+		if (j == nr_tgts)
+			tgts[nr_tgts++].v = v;
+		sends[i].tgt = j;
+	}
+
+	qsort(sends, nr_sends, sizeof(*sends), send_cmp);
+	for (i = 0; i < nr_sends; i++) {
+		if (!tgts[sends[i].tgt].sends)
+			tgts[sends[i].tgt].sends = sends + i;
+		tgts[sends[i].tgt].nr_sends++;
+	}
+
+	for (i = 0; i < nr_tgts; i++) {
+		v = tgts[i].v;
+		tgts[i].local = is_myself(v->addr, v->port) &&
+			!node_in_recovery();
+		if (tgts[i].local)
+			continue;
+
+		ret = send_objs(tgts + i, opcode, epoch, copies, segs, st,
+				data);
+		if (ret != SD_RES_SUCCESS) {
+			for (j = 0; j < tgts[i].nr_sends; j++)
+				set_seg_result(opcode,
+					       segs + tgts[i].sends[j].seg,
+					       ret);
+			continue;
+		}
+		waits[nr_reqs] = tgts + i;
+		reqs[nr_reqs++] = tgts[i].req;
+	}
+
+	for (i = 0; i < nr_tgts; i++) {
+		if (!tgts[i].local)
+			continue;
+
+		for (j = 0; j < tgts[i].nr_sends; j++) {
+			n = tgts[i].sends[j].seg;
+			ret = do_local_seg(opcode, segs + n, data + st[n].off,
+					   copies, epoch);
+			set_seg_result(opcode, segs + n, ret);
+		}
+	}
+
+	while (nr_reqs) {
+		i = peer_wait_req(reqs, nr_reqs, DEFAULT_SOCKET_TIMEOUT * 1000);
+		if (i < 0) {
+			eprintf("no reply from the nodes\n");
+			while (nr_reqs--) {
+				peer_cancel_req(reqs[nr_reqs], 1);
+				finish_objs(waits[nr_reqs], opcode,
+					    SD_RES_NETWORK_ERROR, segs, st,
+					    data);
+			}
+			break;
+		}
+
+		ret = peer_finish_req(reqs[i], &rsp);
+		if (ret == SD_RES_SUCCESS)
+			ret = rsp.result;
+		if (ret == SD_RES_SUCCESS && rsp.data_length <
+		    (opcode == SD_OP_READ_OBJS ? waits[i]->buf_len :
+		     objs_data_offset(waits[i]->nr_sends)))
+			ret = SD_RES_NETWORK_ERROR;
+		finish_objs(waits[i], opcode, ret, segs, st, data);
+
+		nr_reqs--;
+		reqs[i] = reqs[nr_reqs];
+		waits[i] = waits[nr_reqs];
+	}
+
+	ret = SD_RES_SUCCESS;
+out:
+	if (tgts)
+		for (i = 0; i < nr_tgts; i++)
+			free_buffer(tgts[i].buf, tgts[i].buf_len);
+	free(tgts);
+	free(waits);
+	free(reqs);
+
+	return ret;
+}
+
+/*
+ * Do the segments on the nodes of the vnode list e.  data holds the data
+ * of the segments in order, and the result of each segment is left in it.
+ * Returns SD_RES_SUCCESS unless nothing could be done.
+ */
+int forward_objs(struct sd_vnode *e, int nr_vnodes, int nr_zones,
+		 uint32_t epoch, uint8_t opcode, int copies,
+		 struct sd_obj_seg *segs, int nr_segs, void *data)
+{
+	struct seg_state *st;
+	struct seg_send *sends;
+	int i, j, nr_sends, ret = SD_RES_NO_MEM;
+	size_t off = 0;
+
+	if (copies > nr_zones)
+		copies = nr_zones;
+
+	st = zalloc(sizeof(*st) * nr_segs);
+	sends = zalloc(sizeof(*sends) * nr_segs * copies);
+	if (!st || !sends)
+		goto out;
+
+	for (i = 0; i < nr_segs; i++) {
+		st[i].nr_idxs = obj_to_vnodes(e, nr_vnodes, segs[i].oid,
+					      copies, st[i].idxs);
+		st[i].off = off;
+		if (has_data(opcode))
+			off += segs[i].length;
+
+		if (opcode == SD_OP_READ_OBJS) {
+			sort_read_replicas(e, st[i].idxs, st[i].nr_idxs);
+			segs[i].result = SD_RES_NETWORK_ERROR;
+		} else
+			segs[i].result = SD_RES_SUCCESS;
+	}
+
+	for (;;) {
+		nr_sends = 0;
+		for (i = 0; i < nr_segs; i++) {
+			if (st[i].next == st[i].nr_idxs)
+				continue;
+
+			if (opcode != SD_OP_READ_OBJS) {
+				for (j = 0; j < st[i].nr_idxs; j++) {
+					sends[nr_sends].seg = i;
+					sends[nr_sends++].tgt = st[i].idxs[j];
+				}
+				st[i].next = st[i].nr_idxs;
+				continue;
+			}
+
+			if (!can_read_next(segs[i].result))
+				continue;
+			sends[nr_sends].seg = i;
+			sends[nr_sends++].tgt = st[i].idxs[st[i].next++];
+		}
+		if (!nr_sends)
+			break;
+
+		ret = do_objs_round(e, opcode, epoch, copies, segs, st, data,
+				    sends, nr_sends);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	ret = SD_RES_SUCCESS;
+out:
+	free(st);
+	free(sends);
+
+	return ret;
+}
+
+/*
+ * The cached objects may be newer than the ones in the cluster, so they
+ * are pushed first for reads, and dropped from the cache for updates,
+ * like for the requests bypassing the cache.
+ */
+static void flush_object_caches(uint8_t opcode, struct sd_obj_seg *segs,
+				int nr_segs)
+{
+	struct object_cache *cache;
+	uint32_t vid, last_vid = 0;
+	int i;
+
+	for (i = 0; i < nr_segs; i++) {
+		vid = oid_to_vid(segs[i].oid);
+		if (i && vid == last_vid)
+			continue;
+		last_vid = vid;
+
+		cache = find_object_cache(vid, 0);
+		if (!cache)
+			continue;
+
+		if (opcode == SD_OP_READ_OBJS)
+			object_cache_push(cache);
+		else
+			object_cache_flush_and_delete(cache);
+	}
+}
+
+/*
+ * Grow the data buffer of a request for a response larger than the
+ * request data.
+ */
+static int grow_request_data(struct request *req, unsigned len)
+{
+	void *data;
+
+	if (len <= req->data_length)
+		return 0;
+
+	data = alloc_buffer(len);
+	if (!data)
+		return -1;
+
+	memcpy(data, req->data, req->data_length);
+	free_buffer(req->data, req->data_length);
+	add_outstanding_data(len - req->data_length);
+
+	req->data = data;
+	req->data_length = len;
+
+	return 0;
+}
+
+/* the gateway side */
+int forward_objs_req(struct request *req)
+{
+	struct sd_objs_req *hdr = (struct sd_objs_req *)&req->rq;
+	struct sd_obj_seg *segs = req->data;
+	unsigned segs_len = objs_data_offset(hdr->nr_segs);
+	int64_t len;
+	int i, copies, ret;
+
+	len = get_objs_data_length(hdr, segs);
+	if (len < 0)
+		return SD_RES_INVALID_PARMS;
+
+	flush_object_caches(hdr->opcode, segs, hdr->nr_segs);
+
+	if (hdr->opcode == SD_OP_READ_OBJS) {
+		if (grow_request_data(req, segs_len + len) < 0)
+			return SD_RES_NO_MEM;
+		segs = req->data;
+	}
+
+	copies = hdr->copies;
+	if (!copies)
+		copies = sys->nr_sobjs;
+
+	ret = forward_objs(req->entry, req->nr_vnodes, req->nr_zones,
+			   hdr->epoch, hdr->opcode, copies, segs, hdr->nr_segs,
+			   (char *)segs + segs_len);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* retry the whole request on epoch changes, like a single one */
+	for (i = 0; i < hdr->nr_segs; i++)
+		if (segs[i].result == SD_RES_OLD_NODE_VER ||
+		    segs[i].result == SD_RES_NEW_NODE_VER ||
+		    segs[i].result == SD_RES_NETWORK_ERROR)
+			return segs[i].result;
+
+	req->rp.data_length = segs_len;
+	if (hdr->opcode == SD_OP_READ_OBJS)
+		req->rp.data_length += len;
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Fail the segments on the objects being recovered.  Called in the main
+ * thread, which keeps track of the recovery.
+ */
+void fail_recoverying_segs(struct request *req)
+{
+	struct sd_objs_req *hdr = (struct sd_objs_req *)&req->rq;
+	struct sd_obj_seg *segs = req->data;
+	int i;
+
+	if (!node_in_recovery() || !segs ||
+	    get_objs_data_length(hdr, segs) < 0)
+		return;
+
+	for (i = 0; i < hdr->nr_segs; i++)
+		if (is_recoverying_oid(segs[i].oid))
+			segs[i].result = SD_RES_NEW_NODE_VER;
+}
+
+/*
+ * Whether a gateway request has a segment on a local object being
+ * recovered.  It waits for them like a single request does, rather than
+ * failing on them and being retried until they are recovered.  Called in
+ * the main thread.
+ */
+int is_access_to_recoverying_segs(struct request *req)
+{
+	struct sd_objs_req *hdr = (struct sd_objs_req *)&req->rq;
+	struct sd_obj_seg *segs = req->data;
+	int i, copies;
+
+	if (!node_in_recovery() || !segs ||
+	    get_objs_data_length(hdr, segs) < 0)
+		return 0;
+
+	copies = hdr->copies;
+	if (!copies)
+		copies = sys->nr_sobjs;
+	if (copies > req->nr_zones)
+		copies = req->nr_zones;
+
+	for (i = 0; i < hdr->nr_segs; i++)
+		if (is_access_local(req->entry, req->nr_vnodes, segs[i].oid,
+				    copies) &&
+		    is_recoverying_oid(segs[i].oid))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Whether the request has a segment on oid.  A vectored request keeps the
+ * objects of all its segments busy, local or not, so that it is ordered
+ * with the other requests on them.  Called in the main thread.
+ */
+int objs_req_has_oid(struct request *req, uint64_t oid)
+{
+	struct sd_objs_req *hdr = (struct sd_objs_req *)&req->rq;
+	struct sd_obj_seg *segs = req->data;
+	int i;
+
+	if (!is_vectored_op(req->op) || !segs || !hdr->nr_segs ||
+	    hdr->nr_segs > SD_MAX_SEGS ||
+	    objs_data_offset(hdr->nr_segs) > hdr->data_length)
+		return 0;
+
+	for (i = 0; i < hdr->nr_segs; i++)
+		if (segs[i].oid == oid)
+			return 1;
+
+	return 0;
+}
+
+/* the node side, for the segments on the local objects */
+int store_objs(const struct sd_req *req, struct sd_rsp *rsp, void *data)
+{
+	struct sd_objs_req *hdr = (struct sd_objs_req *)req;
+	struct request *request = data;
+	struct sd_obj_seg *segs = request->data;
+	unsigned segs_len = objs_data_offset(hdr->nr_segs);
+	int64_t len;
+	char *p;
+	int i;
+
+	len = get_objs_data_length(hdr, segs);
+	if (len < 0)
+		return SD_RES_INVALID_PARMS;
+
+	if (hdr->opcode == SD_OP_READ_OBJS) {
+		if (grow_request_data(request, segs_len + len) < 0)
+			return SD_RES_NO_MEM;
+		segs = request->data;
+	}
+
+	p = (char *)segs + segs_len;
+	for (i = 0; i < hdr->nr_segs; i++) {
+		/* unless failed by fail_recoverying_segs() */
+		if (segs[i].result == SD_RES_SUCCESS)
+			segs[i].result = do_local_seg(hdr->opcode, segs + i, p,
+						      hdr->copies, hdr->epoch);
+		if (has_data(hdr->opcode))
+			p += segs[i].length;
+	}
+
+	rsp->data_length = segs_len;
+	if (hdr->opcode == SD_OP_READ_OBJS)
+		rsp->data_length += len;
+
+	return SD_RES_SUCCESS;
+}
@@ -30,6 +30,7 @@
 #include "work.h"
 #include "logger.h"
 #include "event.h"
+#include "coroutine.h"
 
 static int efd;
 static LIST_HEAD(worker_info_list);
@@ -229,6 +230,203 @@ retest:
 	pthread_exit(NULL);
 }
 
+struct async_worker {
+	struct worker_info *wi;
+	/* woken up waiters, protected by pending_lock */
+	struct list_head ready_list;
+	/* all waiters of this thread */
+	struct list_head timer_list;
+};
+
+static __thread struct async_worker *cur_worker;
+
+static int before_deadline(struct timespec *a, struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void async_work_fn(void *arg)
+{
+	struct work *work = arg;
+	struct worker_info *wi = cur_worker->wi;
+	eventfd_t value = 1;
+
+	work->fn(work);
+
+	pthread_mutex_lock(&wi->finished_lock);
+	list_add_tail(&work->w_list, &wi->finished_list);
+	pthread_mutex_unlock(&wi->finished_lock);
+
+	eventfd_write(efd, value);
+}
+
+/* resume the waiters which were woken up or timed out */
+static void run_waiters(struct async_worker *aw)
+{
+	struct worker_info *wi = aw->wi;
+	struct async_waiter *w, *n;
+	struct timespec now;
+	LIST_HEAD(expired);
+
+	for (;;) {
+		pthread_mutex_lock(&wi->pending_lock);
+		if (list_empty(&aw->ready_list)) {
+			pthread_mutex_unlock(&wi->pending_lock);
+			break;
+		}
+		w = list_first_entry(&aw->ready_list, struct async_waiter,
+				     w_list);
+		list_del(&w->w_list);
+		w->queued = 0;
+		w->waiting = 0;
+		pthread_mutex_unlock(&wi->pending_lock);
+
+		list_del(&w->t_list);
+		coroutine_enter(w->co, NULL);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	list_for_each_entry_safe(w, n, &aw->timer_list, t_list) {
+		if (before_deadline(&now, &w->deadline))
+			continue;
+		list_del(&w->t_list);
+		list_add_tail(&w->t_list, &expired);
+	}
+
+	while (!list_empty(&expired)) {
+		w = list_first_entry(&expired, struct async_waiter, t_list);
+		list_del(&w->t_list);
+
+		pthread_mutex_lock(&wi->pending_lock);
+		if (w->queued)
+			list_del(&w->w_list);
+		w->queued = 0;
+		w->waiting = 0;
+		pthread_mutex_unlock(&wi->pending_lock);
+
+		w->timed_out = 1;
+		coroutine_enter(w->co, NULL);
+	}
+}
+
+/*
+ * Each thread of an async work queue runs its works in coroutines.  A
+ * work which waits with async_wait() yields the thread to the others, so
+ * the queue can keep many more works in flight than it has threads.
+ */
+static void *async_worker_routine(void *arg)
+{
+	struct worker_info *wi = arg;
+	struct async_worker aw;
+	struct async_waiter *w;
+	struct timespec deadline;
+	struct work *work;
+	int ret;
+
+	aw.wi = wi;
+	INIT_LIST_HEAD(&aw.ready_list);
+	INIT_LIST_HEAD(&aw.timer_list);
+	cur_worker = &aw;
+
+	pthread_mutex_lock(&wi->startup_lock);
+	/* started this thread */
+	pthread_mutex_unlock(&wi->startup_lock);
+
+	while (!(wi->q.wq_state & WQ_DEAD)) {
+		work = NULL;
+
+		pthread_mutex_lock(&wi->pending_lock);
+		while (list_empty(&aw.ready_list) &&
+		       list_empty(&wi->q.pending_list)) {
+			if (wi->q.wq_state & WQ_DEAD) {
+				pthread_mutex_unlock(&wi->pending_lock);
+				pthread_exit(NULL);
+			}
+
+			if (list_empty(&aw.timer_list)) {
+				pthread_cond_wait(&wi->pending_cond,
+						  &wi->pending_lock);
+				continue;
+			}
+
+			deadline = list_first_entry(&aw.timer_list,
+						    struct async_waiter,
+						    t_list)->deadline;
+			list_for_each_entry(w, &aw.timer_list, t_list)
+				if (before_deadline(&w->deadline, &deadline))
+					deadline = w->deadline;
+
+			ret = pthread_cond_timedwait(&wi->pending_cond,
+						     &wi->pending_lock,
+						     &deadline);
+			if (ret == ETIMEDOUT)
+				break;
+		}
+
+		if (!list_empty(&wi->q.pending_list)) {
+			work = list_first_entry(&wi->q.pending_list,
+						struct work, w_list);
+			list_del(&work->w_list);
+		}
+		pthread_mutex_unlock(&wi->pending_lock);
+
+		run_waiters(&aw);
+
+		if (work)
+			coroutine_enter(coroutine_create(async_work_fn), work);
+	}
+
+	pthread_exit(NULL);
+}
+
+int in_async_work(void)
+{
+	return cur_worker != NULL;
+}
+
+/*
+ * Prepare to wait until async_wakeup() or the deadline.  Wakeups are
+ * caught from here on, so check the condition to wait for afterwards.
+ */
+void async_wait_prepare(struct async_waiter *w, struct timespec *deadline)
+{
+	struct worker_info *wi = cur_worker->wi;
+
+	w->co = coroutine_self();
+	w->worker = cur_worker;
+	w->deadline = *deadline;
+	w->queued = 0;
+	w->timed_out = 0;
+
+	pthread_mutex_lock(&wi->pending_lock);
+	w->waiting = 1;
+	pthread_mutex_unlock(&wi->pending_lock);
+}
+
+/* returns 0 if woken up, or -1 if the deadline has passed */
+int async_wait(struct async_waiter *w)
+{
+	list_add_tail(&w->t_list, &cur_worker->timer_list);
+	coroutine_yield();
+
+	return w->timed_out ? -1 : 0;
+}
+
+/* can be called from any thread */
+void async_wakeup(struct async_waiter *w)
+{
+	struct worker_info *wi = w->worker->wi;
+
+	pthread_mutex_lock(&wi->pending_lock);
+	if (w->waiting && !w->queued) {
+		list_add_tail(&w->w_list, &w->worker->ready_list);
+		w->queued = 1;
+		pthread_cond_broadcast(&wi->pending_cond);
+	}
+	pthread_mutex_unlock(&wi->pending_lock);
+}
+
 static int init_eventfd(void)
 {
 	int ret;
@@ -248,7 +446,8 @@ static int init_eventfd(void)
 	return 0;
 }
 
-struct work_queue *init_work_queue(int nr)
+static struct work_queue *__init_work_queue(int nr,
+					    void *(*routine)(void *))
 {
 	int i, ret;
 	struct worker_info *wi;
@@ -276,7 +475,7 @@ struct work_queue *init_work_queue(int nr)
 	pthread_mutex_lock(&wi->startup_lock);
 	for (i = 0; i < wi->nr_threads; i++) {
 		ret = pthread_create(&wi->worker_thread[i], NULL,
-				     worker_routine, wi);
+				     routine, wi);
 
 		if (ret) {
 			eprintf("failed to create worker thread #%d: %s\n",
@@ -308,6 +507,16 @@ destroy_threads:
 	return NULL;
 }
 
+struct work_queue *init_work_queue(int nr)
+{
+	return __init_work_queue(nr, worker_routine);
+}
+
+struct work_queue *init_async_work_queue(int nr)
+{
+	return __init_work_queue(nr, async_worker_routine);
+}
+
 #ifdef COMPILE_UNUSED_CODE
 static void exit_work_queue(struct work_queue *q)
 {
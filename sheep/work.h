@@ -1,8 +1,11 @@
 #ifndef __WORK_H__
 #define __WORK_H__
 
+#include <time.h>
+
 struct work;
 struct work_queue;
+struct async_worker;
 
 typedef void (*work_func_t)(struct work *);
 
@@ -18,7 +21,28 @@ struct work {
 	enum work_attr attr;
 };
 
+/*
+ * A work of an async work queue runs in a coroutine, and can yield its
+ * worker thread to other works while waiting with async_wait().
+ */
+struct async_waiter {
+	struct list_head w_list;
+	struct list_head t_list;
+	struct coroutine *co;
+	struct async_worker *worker;
+	struct timespec deadline;
+	int waiting;
+	int queued;
+	int timed_out;
+};
+
 struct work_queue *init_work_queue(int nr);
+struct work_queue *init_async_work_queue(int nr);
 void queue_work(struct work_queue *q, struct work *work);
 
+int in_async_work(void);
+void async_wait_prepare(struct async_waiter *w, struct timespec *deadline);
+int async_wait(struct async_waiter *w);
+void async_wakeup(struct async_waiter *w);
+
 #endif
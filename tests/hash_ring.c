@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Consistency check and microbenchmark for the consistent hash ring lookup.
+ *
+ * Without arguments, random rings are built with nodes_to_vnodes() and
+ * hval_to_sheep() and the replica successor table are compared against
+ * the original linear scan and ring walk for random and boundary hash
+ * values.  With -b, both lookups are timed across ring sizes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "sheepdog_proto.h"
+#include "sheep.h"
+
+static struct sd_node nodes[SD_MAX_NODES];
+static struct sd_vnode vnodes[SD_MAX_VNODES];
+
+/*
+ * the lookup used before hval_to_sheep() was turned into a binary search
+ * and get_nth_node() began to use the replica successor table
+ */
+static int hval_to_sheep_linear(struct sd_vnode *entries,
+				int nr_entries, uint64_t id, int idx)
+{
+	int i;
+	struct sd_vnode *e = entries, *n;
+
+	for (i = 0; i < nr_entries - 1; i++, e++) {
+		n = e + 1;
+		if (id > e->id && id <= n->id)
+			break;
+	}
+	return __get_nth_node(entries, nr_entries, (i + 1) % nr_entries, idx);
+}
+
+static uint64_t rand64(void)
+{
+	return ((uint64_t)random() << 62) ^ ((uint64_t)random() << 31) ^
+		random();
+}
+
+static int build_ring(int nr_nodes, int nr_zones, int max_vnodes, int fixed)
+{
+	int i;
+
+	memset(nodes, 0, sizeof(nodes));
+	for (i = 0; i < nr_nodes; i++) {
+		nodes[i].addr[12] = 10;
+		nodes[i].addr[13] = (i >> 16) & 0xff;
+		nodes[i].addr[14] = (i >> 8) & 0xff;
+		nodes[i].addr[15] = i & 0xff;
+		nodes[i].port = 7000 + random() % 100;
+		nodes[i].zone = i % nr_zones;
+		if (fixed)
+			nodes[i].nr_vnodes = max_vnodes;
+		else
+			nodes[i].nr_vnodes = 1 + random() % max_vnodes;
+	}
+
+	return nodes_to_vnodes(nodes, nr_nodes, vnodes);
+}
+
+static int check_one(int nr_vnodes, uint64_t hval, int copies)
+{
+	int i, old, new;
+
+	for (i = 0; i < copies; i++) {
+		old = hval_to_sheep_linear(vnodes, nr_vnodes, hval, i);
+		new = hval_to_sheep(vnodes, nr_vnodes, hval, i);
+		if (old != new) {
+			fprintf(stderr, "mismatch: %d vnodes, hval %" PRIx64
+				", copy %d, linear %d, bsearch %d\n",
+				nr_vnodes, hval, i, old, new);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int run_check(void)
+{
+	int round, i, nr_nodes, nr_zones, nr_vnodes, copies, ret = 0;
+	uint64_t id;
+
+	for (round = 0; round < 200; round++) {
+		nr_nodes = 1 + random() % 64;
+		nr_zones = 1 + random() % nr_nodes;
+		nr_vnodes = build_ring(nr_nodes, nr_zones,
+				       SD_DEFAULT_VNODES * 2, 0);
+		copies = min(nr_zones, SD_MAX_REDUNDANCY);
+
+		ret |= check_one(nr_vnodes, 0, copies);
+		ret |= check_one(nr_vnodes, UINT64_MAX, copies);
+		for (i = 0; i < nr_vnodes; i++) {
+			id = vnodes[i].id;
+			ret |= check_one(nr_vnodes, id, copies);
+			ret |= check_one(nr_vnodes, id - 1, copies);
+			ret |= check_one(nr_vnodes, id + 1, copies);
+		}
+		for (i = 0; i < 10000; i++)
+			ret |= check_one(nr_vnodes, rand64(), copies);
+		for (i = 0; i < 1000; i++) {
+			id = random();
+			ret |= check_one(nr_vnodes,
+					 fnv_64a_buf(&id, sizeof(id), FNV1A_64_INIT),
+					 copies);
+		}
+		if (ret)
+			break;
+	}
+
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) +
+		(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void run_bench(void)
+{
+	static const int sizes[] = { 64, 256, 1024, 4096, 16384, 65536 };
+	int i, j, k, base, nr_nodes, nr_vnodes, loops = 1000000, sink = 0;
+	int copies = SD_DEFAULT_REDUNDANCY;
+	uint64_t *hvals = xmalloc(sizeof(*hvals) * loops);
+	struct timespec start;
+	double linear, table;
+
+	for (j = 0; j < loops; j++)
+		hvals[j] = rand64();
+
+	printf("%d copies per lookup\n", copies);
+	printf("%8s %14s %14s %8s\n", "vnodes", "linear(ns/op)",
+	       "table(ns/op)", "speedup");
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		nr_nodes = max(sizes[i] / SD_DEFAULT_VNODES, copies);
+		nr_vnodes = build_ring(nr_nodes, nr_nodes,
+				       sizes[i] / nr_nodes, 1);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < loops / 100; j++)
+			for (k = 0; k < copies; k++)
+				sink += hval_to_sheep_linear(vnodes, nr_vnodes,
+							     hvals[j], k);
+		linear = elapsed(&start) / (loops / 100) * 1e9;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < loops; j++) {
+			base = hval_to_sheep(vnodes, nr_vnodes, hvals[j], 0);
+			for (k = 0; k < copies; k++)
+				sink += get_nth_node(vnodes, nr_vnodes, base, k);
+		}
+		table = elapsed(&start) / loops * 1e9;
+
+		printf("%8d %14.1f %14.1f %7.1fx\n", nr_vnodes, linear,
+		       table, linear / table);
+	}
+
+	/* keep the compiler from optimizing the lookups away */
+	if (sink == -1)
+		printf("%d\n", sink);
+	free(hvals);
+}
+
+int main(int argc, char **argv)
+{
+	int ch, bench = 0;
+
+	while ((ch = getopt(argc, argv, "bs:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bench = 1;
+			break;
+		case 's':
+			srandom(atoi(optarg));
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (bench) {
+		run_bench();
+		return 0;
+	}
+
+	return run_check();
+}
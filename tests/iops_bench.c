@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Small block IOPS benchmark
+ *
+ * A client keeps a queue of small reads in flight over a loopback TCP
+ * connection, and the responses are sent back in two ways: one at a
+ * time, corked with TCP_CORK and with EPOLLOUT turned on for each of
+ * them, as sheep used to do, and all the responses completed together
+ * with one sendmsg.  Reports the IOPS and the system calls per response
+ * of each.
+ *
+ *   iops_bench [-n requests] [-q depth] [-s size]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "sheepdog_proto.h"
+#include "util.h"
+
+static int nr_requests = 100000;
+static int depth = 32;
+static unsigned size = 4096;
+static unsigned long nr_syscalls;
+
+static void *client(void *arg)
+{
+	int fd = *(int *)arg, i, done;
+	struct sd_req *hdrs = xzalloc(sizeof(*hdrs) * depth);
+	struct sd_rsp rsp;
+	void *buf = xmalloc(size);
+
+	for (i = 0; i < depth; i++) {
+		hdrs[i].opcode = SD_OP_READ_OBJ;
+		hdrs[i].data_length = size;
+		hdrs[i].id = i;
+	}
+
+	for (done = 0; done < nr_requests; done += depth) {
+		if (xwrite(fd, hdrs, sizeof(*hdrs) * depth) < 0)
+			break;
+
+		for (i = 0; i < depth; i++)
+			if (xread(fd, &rsp, sizeof(rsp)) != sizeof(rsp) ||
+			    xread(fd, buf, rsp.data_length) != rsp.data_length)
+				goto out;
+	}
+out:
+	free(hdrs);
+	free(buf);
+	return NULL;
+}
+
+static int connect_loopback(int *rfd, int *wfd)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int lfd, opt = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sa, &len) < 0)
+		return -1;
+
+	*wfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (*wfd < 0 || connect(*wfd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		return -1;
+
+	*rfd = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (*rfd < 0)
+		return -1;
+
+	/* like the connections of sheep clients */
+	setsockopt(*rfd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	setsockopt(*wfd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	return 0;
+}
+
+static void set_events(int efd, int fd, unsigned events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
+	nr_syscalls++;
+}
+
+static int send_one_by_one(int efd, int fd, struct sd_rsp *rsps, void *buf)
+{
+	int i, opt;
+
+	for (i = 0; i < depth; i++)
+		set_events(efd, fd, EPOLLIN | EPOLLOUT);
+
+	for (i = 0; i < depth; i++) {
+		opt = 1;
+		setsockopt(fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
+		if (xwrite(fd, rsps + i, sizeof(*rsps)) < 0 ||
+		    xwrite(fd, buf, size) < 0)
+			return -1;
+		opt = 0;
+		setsockopt(fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
+		nr_syscalls += 4;
+	}
+
+	set_events(efd, fd, EPOLLIN);
+
+	return 0;
+}
+
+static int send_batch(int efd, int fd, struct sd_rsp *rsps, void *buf)
+{
+	struct iovec iov[depth * 2], *p = iov;
+	struct msghdr msg;
+	int i, nr = depth * 2;
+	ssize_t ret;
+
+	for (i = 0; i < depth; i++) {
+		iov[i * 2].iov_base = rsps + i;
+		iov[i * 2].iov_len = sizeof(*rsps);
+		iov[i * 2 + 1].iov_base = buf;
+		iov[i * 2 + 1].iov_len = size;
+	}
+
+	set_events(efd, fd, EPOLLIN | EPOLLOUT);
+
+	while (nr) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = p;
+		msg.msg_iovlen = nr;
+		ret = sendmsg(fd, &msg, 0);
+		nr_syscalls++;
+		if (ret < 0)
+			return -1;
+
+		for (; nr && (size_t)ret >= p->iov_len; nr--)
+			ret -= (p++)->iov_len;
+		if (nr) {
+			p->iov_base = (char *)p->iov_base + ret;
+			p->iov_len -= ret;
+		}
+	}
+
+	set_events(efd, fd, EPOLLIN);
+
+	return 0;
+}
+
+static double run(int batch)
+{
+	int sock, csock, efd, i, done, ret = 0;
+	struct sd_req *hdrs = xmalloc(sizeof(*hdrs) * depth);
+	struct sd_rsp *rsps = xzalloc(sizeof(*rsps) * depth);
+	struct timespec start, end;
+	struct epoll_event ev;
+	pthread_t thread;
+	void *buf = xzalloc(size);
+
+	if (connect_loopback(&sock, &csock) < 0) {
+		fprintf(stderr, "failed to connect, %m\n");
+		exit(1);
+	}
+
+	efd = epoll_create(1);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (efd < 0 || epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		fprintf(stderr, "failed to set up epoll, %m\n");
+		exit(1);
+	}
+
+	nr_syscalls = 0;
+	pthread_create(&thread, NULL, client, &csock);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (done = 0; done < nr_requests && !ret; done += depth) {
+		if (xread(sock, hdrs, sizeof(*hdrs) * depth) !=
+		    sizeof(*hdrs) * depth) {
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < depth; i++) {
+			rsps[i].opcode = hdrs[i].opcode;
+			rsps[i].id = hdrs[i].id;
+			rsps[i].data_length = size;
+		}
+
+		if (batch)
+			ret = send_batch(efd, sock, rsps, buf);
+		else
+			ret = send_one_by_one(efd, sock, rsps, buf);
+	}
+
+	pthread_join(thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (ret) {
+		fprintf(stderr, "failed to send, %m\n");
+		exit(1);
+	}
+
+	close(efd);
+	close(sock);
+	close(csock);
+	free(hdrs);
+	free(rsps);
+	free(buf);
+
+	return done / ((end.tv_sec - start.tv_sec) +
+		       (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n requests] [-q depth] [-s size]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+	double iops;
+
+	while ((ch = getopt(argc, argv, "n:q:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nr_requests = atoi(optarg);
+			if (nr_requests < 1)
+				usage(argv[0]);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			if (depth < 1 || depth > 512)
+				usage(argv[0]);
+			break;
+		case 's':
+			size = atoi(optarg);
+			if (size < 1 || size > SD_DATA_OBJ_SIZE)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	nr_requests = roundup(nr_requests, depth);
+
+	printf("%d reads of %u bytes, %d in flight\n", nr_requests, size,
+	       depth);
+	iops = run(0);
+	printf("one by one: %.0f IOPS, %.2f syscalls per response\n", iops,
+	       (double)nr_syscalls / nr_requests);
+	iops = run(1);
+	printf("batched:    %.0f IOPS, %.2f syscalls per response\n", iops,
+	       (double)nr_syscalls / nr_requests);
+
+	return 0;
+}
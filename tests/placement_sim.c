@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Placement simulator
+ *
+ * Places objects on the given node list with each placement driver and
+ * reports how evenly the replicas are spread in proportion to the number
+ * of vnodes of each node.  With -a or -d, it also reports how many
+ * replicas move when a node joins or leaves.
+ *
+ *   placement_sim [-m placement] [-c copies] [-o objects]
+ *                 [-a node] [-d node] node...
+ *
+ * A node is specified as "address:port[:zone[:vnodes]]".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include "sheep_priv.h"
+
+static struct sd_node nodes[SD_MAX_NODES], new_nodes[SD_MAX_NODES];
+static struct sd_vnode vnodes[SD_MAX_VNODES], new_vnodes[SD_MAX_VNODES];
+
+static int parse_node(char *str, struct sd_node *node)
+{
+	char *addr, *p;
+	int zone = 0, nr_vnodes = SD_DEFAULT_VNODES;
+
+	memset(node, 0, sizeof(*node));
+
+	addr = strtok(str, ":");
+	p = strtok(NULL, ":");
+	if (!addr || !p)
+		return -1;
+	node->port = atoi(p);
+
+	p = strtok(NULL, ":");
+	if (p) {
+		zone = atoi(p);
+		p = strtok(NULL, ":");
+		if (p)
+			nr_vnodes = atoi(p);
+	}
+
+	if (inet_pton(AF_INET6, addr, node->addr) != 1) {
+		if (inet_pton(AF_INET, addr, node->addr + 12) != 1)
+			return -1;
+	}
+	node->zone = zone;
+	node->nr_vnodes = nr_vnodes;
+
+	return 0;
+}
+
+static int find_node(struct sd_node *entries, int nr, struct sd_node *key)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (memcmp(entries[i].addr, key->addr, sizeof(key->addr)) == 0 &&
+		    entries[i].port == key->port)
+			return i;
+
+	return -1;
+}
+
+static int same_vnode_owner(struct sd_vnode *a, struct sd_vnode *b)
+{
+	return memcmp(a->addr, b->addr, sizeof(a->addr)) == 0 &&
+		a->port == b->port;
+}
+
+static int nr_zones(struct sd_node *entries, int nr)
+{
+	int i, j, nr_zones = 0;
+	uint32_t zones[SD_MAX_NODES];
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < nr_zones; j++)
+			if (entries[i].zone && zones[j] == entries[i].zone)
+				break;
+		if (j == nr_zones)
+			zones[nr_zones++] = entries[i].zone;
+	}
+
+	return nr_zones;
+}
+
+static uint64_t nth_oid(int n)
+{
+	/* spread objects over VDIs like a real cluster */
+	return vid_to_data_oid(fnv_64a_buf(&n, sizeof(n), FNV1A_64_INIT) %
+			       (SD_NR_VDIS / 1024) * 1024 + n / 4096, n % 4096);
+}
+
+static void report_balance(struct sd_node *entries, int nr_nodes,
+			   uint64_t *counts, uint64_t total)
+{
+	int i;
+	uint64_t weight = 0;
+	double ratio, max = 0, min = HUGE_VAL, sum = 0, sum2 = 0;
+
+	for (i = 0; i < nr_nodes; i++)
+		weight += entries[i].nr_vnodes;
+
+	for (i = 0; i < nr_nodes; i++) {
+		if (!entries[i].nr_vnodes)
+			continue;
+		ratio = (double)counts[i] /
+			((double)total * entries[i].nr_vnodes / weight);
+		max = max(max, ratio);
+		min = min(min, ratio);
+		sum += ratio;
+		sum2 += ratio * ratio;
+	}
+
+	sum /= nr_nodes;
+	printf("  balance: max %.3f, min %.3f, stddev %.3f "
+	       "(replicas per node / weighted share)\n",
+	       max, min, sqrt(sum2 / nr_nodes - sum * sum));
+}
+
+static void simulate(struct placement_driver *driver, int nr_nodes,
+		     int nr_new_nodes, int nr_objs, int copies)
+{
+	int i, j, k, nr_vnodes, nr_new_vnodes, nr, nr_new;
+	int idxs[SD_MAX_REDUNDANCY], new_idxs[SD_MAX_REDUNDANCY];
+	static uint64_t counts[SD_MAX_NODES];
+	uint64_t total = 0, moved = 0;
+	struct timespec start, end;
+	double ns;
+
+	sd_placement = driver;
+	nr_vnodes = nodes_to_vnodes(nodes, nr_nodes, vnodes);
+	nr_new_vnodes = nodes_to_vnodes(new_nodes, nr_new_nodes, new_vnodes);
+	memset(counts, 0, sizeof(counts));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_objs; i++) {
+		nr = obj_to_vnodes(vnodes, nr_vnodes, nth_oid(i), copies, idxs);
+		for (j = 0; j < nr; j++)
+			counts[vnodes[idxs[j]].node_idx]++;
+		total += nr;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = ((end.tv_sec - start.tv_sec) * 1e9 +
+	      (end.tv_nsec - start.tv_nsec)) / nr_objs;
+
+	printf("%s: %.1f ns per object\n", driver->name, ns);
+	report_balance(nodes, nr_nodes, counts, total);
+
+	if (!nr_new_nodes)
+		return;
+
+	for (i = 0; i < nr_objs; i++) {
+		nr = obj_to_vnodes(vnodes, nr_vnodes, nth_oid(i), copies, idxs);
+		nr_new = obj_to_vnodes(new_vnodes, nr_new_vnodes, nth_oid(i),
+				       copies, new_idxs);
+		for (j = 0; j < nr_new; j++) {
+			for (k = 0; k < nr; k++)
+				if (same_vnode_owner(new_vnodes + new_idxs[j],
+						     vnodes + idxs[k]))
+					break;
+			if (k == nr)
+				moved++;
+		}
+	}
+	printf("  movement: %.2f%% of replicas moved\n",
+	       100.0 * moved / total);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-m placement] [-c copies] [-o objects]"
+		" [-a node] [-d node] node...\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ch, i, nr_nodes = 0, nr_new_nodes = 0, copies = SD_DEFAULT_REDUNDANCY;
+	int nr_objs = 100000, idx, changed = 0;
+	uint64_t weight = 0;
+	struct sd_node add = { { 0 } }, del = { { 0 } };
+	struct placement_driver *driver = NULL;
+
+	while ((ch = getopt(argc, argv, "m:c:o:a:d:")) != -1) {
+		switch (ch) {
+		case 'm':
+			driver = find_placement_driver(optarg);
+			if (!driver) {
+				fprintf(stderr, "unknown placement %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			copies = atoi(optarg);
+			if (copies < 1 || copies > SD_MAX_REDUNDANCY)
+				usage(argv[0]);
+			break;
+		case 'o':
+			nr_objs = atoi(optarg);
+			if (nr_objs < 1)
+				usage(argv[0]);
+			break;
+		case 'a':
+			if (parse_node(optarg, &add) < 0)
+				usage(argv[0]);
+			changed = 1;
+			break;
+		case 'd':
+			if (parse_node(optarg, &del) < 0)
+				usage(argv[0]);
+			changed = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (nr_nodes == SD_MAX_NODES || parse_node(argv[i], nodes + nr_nodes) < 0)
+			usage(argv[0]);
+		weight += nodes[nr_nodes++].nr_vnodes;
+	}
+	if (!nr_nodes || weight > SD_MAX_VNODES)
+		usage(argv[0]);
+
+	if (changed) {
+		for (i = 0; i < nr_nodes; i++)
+			if (find_node(&del, 1, nodes + i) < 0)
+				new_nodes[nr_new_nodes++] = nodes[i];
+		if (add.port) {
+			idx = find_node(new_nodes, nr_new_nodes, &add);
+			if (idx < 0)
+				new_nodes[nr_new_nodes++] = add;
+			else
+				new_nodes[idx] = add;
+		}
+		qsort(new_nodes, nr_new_nodes, sizeof(*new_nodes), node_cmp);
+	}
+	qsort(nodes, nr_nodes, sizeof(*nodes), node_cmp);
+
+	printf("%d nodes, %d objects, %d copies\n", nr_nodes, nr_objs, copies);
+	if (nr_zones(nodes, nr_nodes) < copies ||
+	    (changed && nr_zones(new_nodes, nr_new_nodes) < copies)) {
+		fprintf(stderr, "too few zones for %d copies\n", copies);
+		return 1;
+	}
+
+	if (driver) {
+		simulate(driver, nr_nodes, nr_new_nodes, nr_objs, copies);
+		return 0;
+	}
+
+	list_for_each_entry(driver, &placement_drivers, list)
+		simulate(driver, nr_nodes, nr_new_nodes, nr_objs, copies);
+
+	return 0;
+}
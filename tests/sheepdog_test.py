@@ -92,13 +92,13 @@ class Node:
     def get_zone(self):
         return 10000 + self.idx
 
-    def start(self):
-        """Run a sheep daemon on this node."""
+    def start(self, args = []):
+        """Run a sheep daemon on this node with extra 'args'."""
         if self.p and self.p.poll() == None:
             return
 
         self.p = Popen([sheep_path, '-f', '-d', '-p', str(self.get_port()),
-                        str(self.idx), '-z', str(self.get_zone())],
+                        str(self.idx), '-z', str(self.get_zone())] + args,
                        stdout=PIPE, stderr=PIPE)
 
     def wait(self):
@@ -120,6 +120,7 @@ class Node:
         """Stop the sheep daemon on this node."""
         if self.p != None:
             self.p.terminate()
+            self.p.wait()
             self.p = None
 
         self.started = False
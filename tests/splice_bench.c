@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Splice benchmark
+ *
+ * Streams writes over a loopback TCP connection and stores them into a
+ * file in two ways: received into a buffer and written with pwrite, as
+ * replicas used to do, and spliced from the socket into a pipe and from
+ * the pipe into the file.  Reports the throughput of each.
+ *
+ *   splice_bench [-d directory] [-n writes] [-s size] [-D]
+ *
+ * With -D the file is opened with O_DIRECT | O_DSYNC like the object
+ * files of the stores, where splicing may fall back to pwrite.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "sheepdog_proto.h"
+#include "util.h"
+
+static int nr_writes = 64;
+static unsigned size = SD_DATA_OBJ_SIZE;
+static int pipe_size;
+
+static void *sender(void *arg)
+{
+	int fd = *(int *)arg, i;
+	void *buf = xmalloc(size);
+
+	memset(buf, 0x5a, size);
+	for (i = 0; i < nr_writes * 2; i++)
+		if (xwrite(fd, buf, size) != size)
+			break;
+
+	free(buf);
+	return NULL;
+}
+
+static int connect_loopback(int *rfd, int *wfd)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int lfd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sa, &len) < 0)
+		return -1;
+
+	*wfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (*wfd < 0 || connect(*wfd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		return -1;
+
+	*rfd = accept(lfd, NULL, NULL);
+	close(lfd);
+
+	return *rfd < 0 ? -1 : 0;
+}
+
+static int recv_pwrite(int sock, int fd, void *buf, off_t off)
+{
+	if (xread(sock, buf, size) != size)
+		return -1;
+
+	return xpwrite(fd, buf, size, off) == size ? 0 : -1;
+}
+
+/* the data goes through the pipe in chunks if it doesn't fit in */
+static int recv_splice(int sock, int fd, int *pipefd, off_t off)
+{
+	unsigned done = 0, len, chunk;
+	ssize_t ret;
+
+	while (done < size) {
+		chunk = min(size - done, (unsigned)pipe_size);
+		for (len = 0; len < chunk; len += ret) {
+			ret = splice(sock, NULL, pipefd[1], NULL, chunk - len,
+				     SPLICE_F_MOVE);
+			if (ret <= 0)
+				return -1;
+		}
+
+		if (xsplice_pwrite(pipefd[0], fd, chunk, off + done) != chunk)
+			return -1;
+		done += chunk;
+	}
+
+	return 0;
+}
+
+static double run(const char *path, int flags, int use_splice)
+{
+	int sock, wsock, fd, i, pipefd[2], ret = 0;
+	struct timespec start, end;
+	pthread_t thread;
+	off_t off;
+	void *buf;
+
+	fd = open(path, flags | O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s, %m\n", path);
+		exit(1);
+	}
+
+	if (pipe(pipefd) < 0) {
+		fprintf(stderr, "failed to create a pipe, %m\n");
+		exit(1);
+	}
+	for (pipe_size = size; pipe_size > 4096; pipe_size /= 2)
+		if (fcntl(pipefd[0], F_SETPIPE_SZ, pipe_size) >= pipe_size)
+			break;
+	pipe_size = fcntl(pipefd[0], F_GETPIPE_SZ);
+
+	if (connect_loopback(&sock, &wsock) < 0) {
+		fprintf(stderr, "failed to connect, %m\n");
+		exit(1);
+	}
+
+	buf = valloc(size);
+	pthread_create(&thread, NULL, sender, &wsock);
+
+	/* the first half warms up the page cache and the socket */
+	for (i = 0; i < nr_writes * 2 && !ret; i++) {
+		if (i == nr_writes)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+		off = (off_t)size * (i % nr_writes);
+		if (use_splice)
+			ret = recv_splice(sock, fd, pipefd, off);
+		else
+			ret = recv_pwrite(sock, fd, buf, off);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (ret) {
+		fprintf(stderr, "failed to write, %m\n");
+		exit(1);
+	}
+
+	pthread_join(thread, NULL);
+	close(sock);
+	close(wsock);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(fd);
+	unlink(path);
+	free(buf);
+
+	return (double)size * nr_writes / (1 << 20) /
+		((end.tv_sec - start.tv_sec) +
+		 (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d directory] [-n writes] [-s size] [-D]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ch, flags = 0;
+	double mbps;
+	const char *dir = ".";
+	char path[PATH_MAX];
+
+	while ((ch = getopt(argc, argv, "d:n:s:D")) != -1) {
+		switch (ch) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			nr_writes = atoi(optarg);
+			if (nr_writes < 1)
+				usage(argv[0]);
+			break;
+		case 's':
+			size = atoi(optarg);
+			if (size < 1 || size > SD_DATA_OBJ_SIZE)
+				usage(argv[0]);
+			break;
+		case 'D':
+			flags = O_DIRECT | O_DSYNC;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/splice_bench.%d", dir, getpid());
+
+	printf("%d writes of %u bytes%s\n", nr_writes, size,
+	       flags ? " with O_DIRECT | O_DSYNC" : "");
+	mbps = run(path, flags, 0);
+	printf("recv + pwrite: %.1f MB/s\n", mbps);
+	mbps = run(path, flags, 1);
+	printf("splice:        %.1f MB/s (pipe of %d bytes)\n", mbps,
+	       pipe_size);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+from sheepdog_test import *
+import threading
+import time
+
+nr_nodes = 4
+nr_objs = 32
+obj_size = 4 * 1024 ** 2
+
+
+class NodeLog:
+    """Read the log of a node in the background, so that the node never
+    blocks on it, and wait for its messages."""
+
+    def __init__(self, node):
+        self.lines = []
+        self.pos = 0
+        self.cond = threading.Condition()
+        t = threading.Thread(target=self.read, args=(node.p.stderr,))
+        t.daemon = True
+        t.start()
+
+    def read(self, f):
+        for line in iter(f.readline, ''):
+            self.cond.acquire()
+            self.lines.append(line)
+            self.cond.notify()
+            self.cond.release()
+
+    def wait(self, pattern, timeout = 300):
+        """Wait for a message matching 'pattern' and return the match."""
+        deadline = time.time() + timeout
+        self.cond.acquire()
+        try:
+            while True:
+                while self.pos < len(self.lines):
+                    match = re.search(pattern, self.lines[self.pos])
+                    self.pos = self.pos + 1
+                    if match:
+                        return match
+                if time.time() > deadline:
+                    return None
+                self.cond.wait(1)
+        finally:
+            self.cond.release()
+
+
+def start_cluster(nr, args = []):
+    """Start a cluster of 'nr' nodes, format it and write nr_objs objects
+    to a VDI.  Return the cluster, the logs of its nodes and the data."""
+
+    sdog = Sheepdog(nr)
+    logs = []
+    for n in sdog.nodes:
+        n.start(['-c', 'local'] + args)
+        logs.append(NodeLog(n))
+        assert logs[-1].wait(r'join Sheepdog cluster')
+
+    node = sdog.nodes[0]
+    p = node.run_collie('cluster format -c 2')
+    p.wait()
+    p = node.run_collie('vdi create test ' + str(nr_objs * obj_size))
+    p.wait()
+
+    data = os.urandom(nr_objs * obj_size)
+    p = Popen([collie_path, 'vdi', 'write', 'test', '-p',
+               str(node.get_port())], stdin=PIPE)
+    p.communicate(data)
+    assert p.returncode == 0
+
+    return (sdog, logs, data)
+
+
+def recover(window):
+    """Stop a node of a cluster holding nr_objs objects, and return the
+    seconds the other nodes take to recover."""
+
+    (sdog, logs, data) = start_cluster(nr_nodes, ['-R', str(window)])
+    port = str(sdog.nodes[0].get_port())
+
+    sdog.nodes[-1].stop()
+
+    seconds = 0
+    for l in logs[:-1]:
+        match = l.wait(r'recovered \d+ of \d+ objects of epoch \d+ ' +
+                       r'in ([0-9.]+) seconds')
+        assert match
+        seconds = max(seconds, float(match.group(1)))
+
+    p = Popen([collie_path, 'vdi', 'read', 'test', '-p', port], stdout=PIPE)
+    (out, _) = p.communicate()
+    assert out == data
+
+    for n in sdog.nodes:
+        n.stop()
+
+    return seconds
+
+
+def test_recovery_window():
+    """Measure the recovery time with several recovery windows."""
+
+    for window in [1, 4, 16]:
+        seconds = recover(window)
+        print('window %2d: %d objects recovered in %.3f seconds' %
+              (window, nr_objs, seconds))
+
+
+def test_delta_rejoin():
+    """Stop a node, write two objects and start the node again.  It
+    recovers only those two from the other nodes.  The objects written in
+    the last epoch of the node count as written while it was away, so it
+    is restarted once first to leave from an epoch without writes."""
+
+    (sdog, logs, data) = start_cluster(3)
+    port = str(sdog.nodes[0].get_port())
+
+    node = sdog.nodes[-1]
+    node.stop()
+    for l in logs[:-1]:
+        assert l.wait(r'recovered \d+ of \d+ objects of epoch 2 ')
+    node.start(['-c', 'local'])
+    log = NodeLog(node)
+    assert log.wait(r'rejoining from epoch 1, ')
+    assert log.wait(r'recovered \d+ of \d+ objects of epoch 3 ')
+
+    node.stop()
+    for l in logs[:-1]:
+        assert l.wait(r'recovered \d+ of \d+ objects of epoch 4 ')
+
+    new = os.urandom(2 * obj_size)
+    p = Popen([collie_path, 'vdi', 'write', 'test', str(4 * obj_size),
+               str(len(new)), '-p', port], stdin=PIPE)
+    p.communicate(new)
+    assert p.returncode == 0
+    data = data[:4 * obj_size] + new + data[6 * obj_size:]
+
+    node.start(['-c', 'local'])
+    log = NodeLog(node)
+    match = log.wait(r'rejoining from epoch 3, \d+ objects, (\d+) written')
+    assert match and int(match.group(1)) == 2
+    assert log.wait(r'recovered \d+ of \d+ objects of epoch 5 ')
+
+    p = Popen([collie_path, 'vdi', 'read', 'test', '-p',
+               str(node.get_port())], stdout=PIPE)
+    (out, _) = p.communicate()
+    assert out == data
+
+    for n in sdog.nodes:
+        n.stop()
+
+
+def recovering_epoch(node):
+    """Return the epoch 'node' is recovering, or 0."""
+
+    p = Popen([collie_path, 'cluster', 'throttle', '-r', '-p',
+               str(node.get_port())], stdout=PIPE)
+    (out, _) = p.communicate()
+    return int(out.split()[4])
+
+
+def test_vectored_io_in_recovery():
+    """Read and remove objects with vectored requests while the nodes
+    recover.  The segments of a recovering node are sent back to itself,
+    and must not wait for the request which sent them."""
+
+    (sdog, logs, data) = start_cluster(3)
+    node = sdog.nodes[0]
+    port = str(node.get_port())
+
+    p = node.run_collie('cluster throttle -O 1')
+    p.wait()
+
+    sdog.nodes[-1].stop()
+    while recovering_epoch(node) != 2:
+        time.sleep(0.1)
+
+    p = Popen([collie_path, 'vdi', 'read', 'test', '0', str(2 * obj_size),
+               '-p', port], stdout=PIPE)
+    (out, _) = p.communicate()
+    assert out == data[:2 * obj_size]
+    p = node.run_collie('vdi delete test')
+    p.wait()
+    assert p.returncode == 0
+
+    assert recovering_epoch(node) == 2
+    for l in logs[:-1]:
+        assert not [line for line in l.lines if 'no reply' in line]
+
+    for n in sdog.nodes[:-1]:
+        n.stop()
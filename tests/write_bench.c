@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2012 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Write benchmark
+ *
+ * Writes objects through a gateway and reports the write latency and the
+ * payload the gateway sent to the replicas, taken from SD_OP_STAT_GATEWAY.
+ * Run it against a cluster formatted with and without 'collie cluster
+ * format -C' to compare chain replication with fan-out from the gateway.
+ *
+ *   write_bench [-a address] [-p port] [-n objects] [-s size] [-v vid]
+ *
+ * The objects are created in a VDI id which is not supposed to be in use,
+ * so only run it on a scratch cluster.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "sheepdog_proto.h"
+#include "sheep.h"
+
+static const char *addr = "localhost";
+static int port = SD_LISTEN_PORT;
+
+static int get_gateway_stat(struct sd_gateway_stat *stat)
+{
+	int fd, ret;
+	unsigned wlen = 0, rlen = sizeof(*stat);
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+
+	fd = connect_to(addr, port);
+	if (fd < 0)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = SD_OP_STAT_GATEWAY;
+	hdr.data_length = rlen;
+
+	ret = exec_req(fd, &hdr, stat, &wlen, &rlen);
+	close(fd);
+	if (ret || rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "failed to get the gateway statistics\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int write_one(int fd, uint64_t oid, void *buf, unsigned size)
+{
+	unsigned wlen = size, rlen = 0;
+	struct sd_obj_req hdr;
+	struct sd_obj_rsp *rsp = (struct sd_obj_rsp *)&hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = SD_OP_CREATE_AND_WRITE_OBJ;
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.oid = oid;
+	hdr.data_length = size;
+
+	if (exec_req(fd, (struct sd_req *)&hdr, buf, &wlen, &rlen)) {
+		fprintf(stderr, "failed to write %" PRIx64 "\n", oid);
+		return -1;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "failed to write %" PRIx64 ", %s\n", oid,
+			sd_strerror(rsp->result));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-a address] [-p port] [-n objects]"
+		" [-s size] [-v vid]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ch, i, fd, nr_objs = 256;
+	unsigned size = SD_DATA_OBJ_SIZE;
+	uint32_t vid;
+	struct sd_gateway_stat before, after;
+	struct timespec start, end;
+	double *lats, total = 0;
+	void *buf;
+
+	srandom(time(NULL));
+	vid = SD_NR_VDIS - 1 - random() % 4096;
+
+	while ((ch = getopt(argc, argv, "a:p:n:s:v:")) != -1) {
+		switch (ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'n':
+			nr_objs = atoi(optarg);
+			if (nr_objs < 1)
+				usage(argv[0]);
+			break;
+		case 's':
+			size = atoi(optarg);
+			if (size < 1 || size > SD_DATA_OBJ_SIZE)
+				usage(argv[0]);
+			break;
+		case 'v':
+			vid = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	buf = xmalloc(size);
+	lats = xmalloc(sizeof(*lats) * nr_objs);
+	memset(buf, 0x5a, size);
+
+	if (get_gateway_stat(&before) < 0)
+		return 1;
+
+	fd = connect_to(addr, port);
+	if (fd < 0)
+		return 1;
+
+	for (i = 0; i < nr_objs; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (write_one(fd, vid_to_data_oid(vid, i), buf, size) < 0)
+			return 1;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		lats[i] = (end.tv_sec - start.tv_sec) * 1e3 +
+			(end.tv_nsec - start.tv_nsec) / 1e6;
+		total += lats[i];
+	}
+	close(fd);
+
+	if (get_gateway_stat(&after) < 0)
+		return 1;
+
+	qsort(lats, nr_objs, sizeof(*lats), lat_cmp);
+
+	printf("%d objects of %u bytes in vdi %" PRIx32 "\n", nr_objs, size,
+	       vid);
+	printf("latency (ms): avg %.2f, p50 %.2f, p99 %.2f, max %.2f\n",
+	       total / nr_objs, lats[nr_objs / 2], lats[nr_objs * 99 / 100],
+	       lats[nr_objs - 1]);
+	printf("throughput: %.1f MB/s\n",
+	       (double)size * nr_objs / (total / 1e3) / (1 << 20));
+	printf("gateway egress: %.2f bytes per payload byte\n",
+	       (double)(after.write_tx_bytes - before.write_tx_bytes) /
+	       ((double)size * nr_objs));
+
+	free(lats);
+	free(buf);
+
+	return 0;
+}